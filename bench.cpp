@@ -0,0 +1,736 @@
+/******************************************************************************
+ * Copyright (c) 2013 Dan Lecocq
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/* Micro benchmarks for the string manipulation, and macro benchmarks for the
+ * filesystem utilities over generated trees.
+ *
+ * Usage: ./bench [--filter=<substring>] [--format=console|json|csv]
+ *                [--min-time=<seconds>] */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+/* Internal libraries */
+#include "path.hpp"
+
+using namespace apathy;
+
+namespace {
+
+    /* Keep the compiler from optimizing away a result */
+    template <class T>
+    inline void do_not_optimize(const T& value) {
+        asm volatile("" : : "r,m"(value) : "memory");
+    }
+
+    typedef std::chrono::steady_clock clock_type;
+
+    /* Handed to each benchmark, which runs its body `iterations` times. Any
+     * setup that shouldn't be measured goes between `pause` and `resume` */
+    class State {
+    public:
+        explicit State(size_t n): iterations(n), elapsed(0), started(clock_type::now()),
+            items(0) {}
+
+        void pause() { elapsed += clock_type::now() - started; }
+        void resume() { started = clock_type::now(); }
+        void stop() { pause(); }
+
+        /* How many items (entries, paths) each iteration processes */
+        void set_items(size_t n) { items = n; }
+
+        size_t iterations;
+        clock_type::duration elapsed;
+        clock_type::time_point started;
+        size_t items;
+    };
+
+    struct Benchmark {
+        std::string name;
+        std::function<void(State&)> body;
+    };
+
+    struct Result {
+        std::string name;
+        size_t iterations;
+        double ns_per_iteration;
+        double items_per_second;
+    };
+
+    std::vector<Benchmark>& registry() {
+        static std::vector<Benchmark> benchmarks;
+        return benchmarks;
+    }
+
+    void add(const std::string& name, std::function<void(State&)> body) {
+        registry().push_back(Benchmark{name, std::move(body)});
+    }
+
+    /* Run with more and more iterations until it takes at least `min_time` */
+    Result run(const Benchmark& benchmark, double min_time) {
+        size_t iterations = 1;
+        while (true) {
+            State state(iterations);
+            benchmark.body(state);
+            state.stop();
+
+            double seconds = std::chrono::duration<double>(state.elapsed).count();
+            if (seconds >= min_time || iterations >= (size_t(1) << 30)) {
+                double ns = seconds * 1e9 / iterations;
+                double rate = state.items && seconds > 0 ?
+                    state.items * double(iterations) / seconds : 0;
+                return Result{benchmark.name, iterations, ns, rate};
+            }
+
+            /* Aim a little past the minimum time, but don't grow too fast */
+            double factor = seconds > 0 ? min_time * 1.4 / seconds : 100;
+            factor = std::min(std::max(factor, 2.0), 100.0);
+            iterations = static_cast<size_t>(iterations * factor);
+        }
+    }
+
+    /**************************************************************************
+     * Micro benchmarks
+     *************************************************************************/
+    const char* messy = "./foo///../a/b/./c/d/../../e/f//g/././h/../i.tar.gz";
+    const char* deep = "/usr/local/share/applications/some/deeply/nested/set/of/directories/file.txt";
+    const char* key = "/warehouse/tenant-000042/datasets/events/clickstream/version=3"
+        "/year=2026/month=10/day=14/hour=09/region=eu-west-1/availability-zone=b"
+        "/partition=000017/writer=ingest-7f9c2d3e-1a4b-4c5d-8e6f-0a1b2c3d4e5f"
+        "/part-00000-9f1c2d3e-4b5a-6c7d-8e9f-0a1b2c3d4e5f.c000.snappy.parquet";
+
+    /* Paths with two spellings of each */
+    std::vector<Path> spellings() {
+        std::vector<Path> paths;
+        for (int i = 0; i < 200; ++i) {
+            paths.push_back(Path::join("/srv/data", i % 10, "file" + std::to_string(i)));
+            paths.push_back(Path::join("/srv/./data//", i % 10, "x/..", "file" + std::to_string(i)));
+        }
+        return paths;
+    }
+
+    /* Relative paths that need some sanitizing, for batch normalization */
+    std::vector<std::string> batch() {
+        std::vector<std::string> paths;
+        for (int i = 0; i < 20000; ++i) {
+            paths.push_back("./data//" + std::to_string(i % 100) + "/x/../file"
+                + std::to_string(i) + ".txt");
+        }
+        return paths;
+    }
+
+    void register_micro() {
+        add("construct/char*", [](State& state) {
+            for (size_t i = 0; i < state.iterations; ++i) {
+                Path p(deep);
+                do_not_optimize(p);
+            }
+        });
+
+        add("construct/string", [](State& state) {
+            std::string s(deep);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                Path p(s);
+                do_not_optimize(p);
+            }
+        });
+
+        add("construct/int", [](State& state) {
+            for (size_t i = 0; i < state.iterations; ++i) {
+                Path p(static_cast<int>(i));
+                do_not_optimize(p);
+            }
+        });
+
+        add("append", [](State& state) {
+            for (size_t i = 0; i < state.iterations; ++i) {
+                Path p("/usr/local");
+                p.append("share").append("applications").append("file.txt");
+                do_not_optimize(p);
+            }
+        });
+
+        add("operator<<", [](State& state) {
+            for (size_t i = 0; i < state.iterations; ++i) {
+                Path p("/var/log");
+                p << 2026 << 10 << 14 << "app.log";
+                do_not_optimize(p);
+            }
+        });
+
+        add("join", [](State& state) {
+            for (size_t i = 0; i < state.iterations; ++i) {
+                Path p(Path::join("/var/log", 2026, 10, 14, "app.log"));
+                do_not_optimize(p);
+            }
+        });
+
+        add("sanitize", [](State& state) {
+            for (size_t i = 0; i < state.iterations; ++i) {
+                Path p(messy);
+                p.sanitize();
+                do_not_optimize(p);
+            }
+        });
+
+        add("split", [](State& state) {
+            Path p(deep);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                std::vector<Path::Segment> segments(p.split());
+                do_not_optimize(segments);
+            }
+        });
+
+        add("view/segments", [](State& state) {
+            Path p(deep);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                size_t count = 0;
+                for (std::string_view segment : p.view()) {
+                    count += segment.size();
+                }
+                do_not_optimize(count);
+            }
+        });
+
+        add("filename", [](State& state) {
+            Path p(deep);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                std::string name(p.filename());
+                do_not_optimize(name);
+            }
+        });
+
+        add("extension", [](State& state) {
+            Path p(deep);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                std::string extension(p.extension());
+                do_not_optimize(extension);
+            }
+        });
+
+        add("stem", [](State& state) {
+            Path p(deep);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                Path stem(p.stem());
+                do_not_optimize(stem);
+            }
+        });
+
+        add("equivalent", [](State& state) {
+            Path a("./foo////a/b/./d/../c");
+            Path b("foo/a/b/c");
+            for (size_t i = 0; i < state.iterations; ++i) {
+                bool result = a.equivalent(b);
+                do_not_optimize(result);
+            }
+        });
+
+        /* Finding the distinct paths among a few hundred, some of which are
+         * spelled differently */
+        add("unique/equivalent", [](State& state) {
+            std::vector<Path> paths(spellings());
+            state.set_items(paths.size());
+            for (size_t i = 0; i < state.iterations; ++i) {
+                std::vector<Path> results;
+                for (const Path& p : paths) {
+                    bool seen = false;
+                    for (const Path& result : results) {
+                        if ((seen = result.equivalent(p))) {
+                            break;
+                        }
+                    }
+                    if (!seen) {
+                        results.push_back(p);
+                    }
+                }
+                do_not_optimize(results);
+            }
+        });
+
+        add("unique/keys", [](State& state) {
+            std::vector<Path> paths(spellings());
+            state.set_items(paths.size());
+            for (size_t i = 0; i < state.iterations; ++i) {
+                std::vector<Path> results(PathKey::unique(paths));
+                do_not_optimize(results);
+            }
+        });
+
+        /* A well-known subpath built on each request, then as a constant */
+        add("join/runtime", [](State& state) {
+            for (size_t i = 0; i < state.iterations; ++i) {
+                Path p((Path("/usr/share/") << "./app//" << "icons/").sanitize());
+                do_not_optimize(p);
+            }
+        });
+
+        add("join/constexpr", [](State& state) {
+            constexpr auto icons = (FixedPath<64>("/usr/share/") << "./app//" << "icons/").sanitize();
+            for (size_t i = 0; i < state.iterations; ++i) {
+                Path p(icons);
+                do_not_optimize(p);
+            }
+        });
+
+        /* Normalizing the same path each time, and looking it up instead */
+        add("normalize/uncached", [](State& state) {
+            Path p(messy);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                Path result(Path(p).absolute().sanitize());
+                do_not_optimize(result);
+            }
+        });
+
+        add("normalize/shared-cache", [](State& state) {
+            Path p(messy);
+            SharedPathCache cache;
+            for (size_t i = 0; i < state.iterations; ++i) {
+                Path result(cache.normalize(p));
+                do_not_optimize(result);
+            }
+        });
+
+        /* Normalizing a batch one at a time, then all at once */
+        add("normalize/each", [](State& state) {
+            std::vector<std::string> paths(batch());
+            state.set_items(paths.size());
+            Path base("/srv");
+            for (size_t i = 0; i < state.iterations; ++i) {
+                std::vector<Path> results;
+                for (const std::string& s : paths) {
+                    results.push_back(Path(s).absolute(base).sanitize());
+                }
+                do_not_optimize(results);
+            }
+        });
+
+        add("normalize/batch", [](State& state) {
+            std::vector<std::string> paths(batch());
+            state.set_items(paths.size());
+            std::vector<Path> results;
+            for (size_t i = 0; i < state.iterations; ++i) {
+                Path::normalize(paths, "/srv", results);
+                do_not_optimize(results);
+            }
+        });
+
+        add("glob/match", [](State& state) {
+            Glob pattern("src/**/*.cpp");
+            PathView p("src/a/b/c/d/file.cpp");
+            for (size_t i = 0; i < state.iterations; ++i) {
+                bool result = pattern.match(p);
+                do_not_optimize(result);
+            }
+        });
+
+        /* The scanning kernels, each against the byte-at-a-time version it
+         * replaced, over a long object-store style key */
+        add("scan/find_last", [](State& state) {
+            std::string_view k(key);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                do_not_optimize(k);
+                size_t result = scan::find_last(k, '#');
+                do_not_optimize(result);
+            }
+        });
+
+        add("scan/find_last/scalar", [](State& state) {
+            std::string_view k(key);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                do_not_optimize(k);
+                size_t result = k.rfind('#');
+                do_not_optimize(result);
+            }
+        });
+
+        add("scan/find_last_not", [](State& state) {
+            std::string slashes(std::string(key) + std::string(200, '/'));
+            std::string_view s(slashes);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                do_not_optimize(s);
+                size_t result = scan::find_last_not(s, '/');
+                do_not_optimize(result);
+            }
+        });
+
+        add("scan/find_last_not/scalar", [](State& state) {
+            std::string slashes(std::string(key) + std::string(200, '/'));
+            std::string_view s(slashes);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                do_not_optimize(s);
+                size_t result = s.find_last_not_of('/');
+                do_not_optimize(result);
+            }
+        });
+
+        add("scan/count", [](State& state) {
+            std::string_view k(key);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                do_not_optimize(k);
+                size_t result = scan::count(k, '/');
+                do_not_optimize(result);
+            }
+        });
+
+        add("scan/count/scalar", [](State& state) {
+            std::string_view k(key);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                do_not_optimize(k);
+                size_t result = std::count(k.begin(), k.end(), '/');
+                do_not_optimize(result);
+            }
+        });
+
+        add("scan/normalized", [](State& state) {
+            std::string_view k(key);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                do_not_optimize(k);
+                bool result = scan::normalized(k);
+                do_not_optimize(result);
+            }
+        });
+
+        add("scan/normalized/scalar", [](State& state) {
+            std::string_view k(key);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                do_not_optimize(k);
+                bool result = true;
+                for (size_t j = 0; j < k.size() && result; ++j) {
+                    bool starts = j == 0 || k[j - 1] == separator;
+                    if (k[j] == separator) {
+                        result = j == 0 || k[j - 1] != separator;
+                    } else if (starts && k[j] == '.') {
+                        size_t length = 1 + (j + 1 < k.size() && k[j + 1] == '.');
+                        result = j + length < k.size() && k[j + length] != separator;
+                    }
+                }
+                do_not_optimize(result);
+            }
+        });
+
+        add("sanitize/clean", [](State& state) {
+            Path p(key);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                p.sanitize();
+                do_not_optimize(p);
+            }
+        });
+
+        /* Asking the same path for its components over and over, as in a
+         * sort or a group-by */
+        add("components", [](State& state) {
+            Path p(key);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                do_not_optimize(p);
+                size_t total = p.filename().size() + p.extension().size() +
+                    p.parent().view().string().size();
+                do_not_optimize(total);
+            }
+        });
+
+        add("components/indexed", [](State& state) {
+            IndexedPath p(key);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                do_not_optimize(p);
+                size_t total = p.filename().size() + p.extension().size() +
+                    p.parent().string().size();
+                do_not_optimize(total);
+            }
+        });
+
+        add("segment/indexed", [](State& state) {
+            IndexedPath p(key);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                do_not_optimize(p);
+                std::string_view segment(p.segment(i % p.segments()));
+                do_not_optimize(segment);
+            }
+        });
+
+        add("filename/long", [](State& state) {
+            PathView p(key);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                do_not_optimize(p);
+                std::string_view name(p.filename());
+                do_not_optimize(name);
+            }
+        });
+    }
+
+    /**************************************************************************
+     * Macro benchmarks
+     *************************************************************************/
+    /* Where the generated trees live */
+    Path scratch() {
+        static Path root(Path::join(Path::tmp(), "apathy-bench-" + std::to_string(getpid())));
+        return root;
+    }
+
+    /* One directory with lots of files in it */
+    const size_t wide_files = 10000;
+    /* A single chain of nested directories */
+    const size_t deep_levels = 100;
+    /* Lots of directories, each with a few small files */
+    const size_t small_directories = 100;
+    const size_t small_files = 50;
+
+    void make_wide(const Path& root) {
+        std::vector<Path> files;
+        for (size_t i = 0; i < wide_files; ++i) {
+            files.push_back(Path::join(root, "file" + std::to_string(i) + ".txt"));
+        }
+        Path::touch(files);
+    }
+
+    Path make_deep(const Path& root) {
+        Path p(root);
+        for (size_t i = 0; i < deep_levels; ++i) {
+            p.append("d" + std::to_string(i));
+        }
+        Path::makedirs(p);
+        return p;
+    }
+
+    void make_small(const Path& root) {
+        std::vector<Path> files;
+        for (size_t i = 0; i < small_directories; ++i) {
+            for (size_t j = 0; j < small_files; ++j) {
+                files.push_back(Path::join(root, i % 10, i,
+                    "file" + std::to_string(j) + (j % 2 ? ".txt" : ".dat")));
+            }
+        }
+        Path::touch(files);
+    }
+
+    void register_macro() {
+        add("listdir/wide", [](State& state) {
+            state.pause();
+            Path root(Path::join(scratch(), "wide"));
+            make_wide(root);
+            state.set_items(wide_files);
+            state.resume();
+
+            for (size_t i = 0; i < state.iterations; ++i) {
+                std::vector<Path> entries(Path::listdir(root));
+                do_not_optimize(entries);
+            }
+        });
+
+        add("recursive_listdir/small", [](State& state) {
+            state.pause();
+            Path root(Path::join(scratch(), "small"));
+            make_small(root);
+            state.set_items(small_directories * (small_files + 1) + 10);
+            state.resume();
+
+            for (size_t i = 0; i < state.iterations; ++i) {
+                std::vector<Path> entries(Path::recursive_listdir(root));
+                do_not_optimize(entries);
+            }
+        });
+
+        add("recursive_listdir/deep", [](State& state) {
+            state.pause();
+            Path root(Path::join(scratch(), "deep"));
+            make_deep(root);
+            state.set_items(deep_levels);
+            state.resume();
+
+            for (size_t i = 0; i < state.iterations; ++i) {
+                std::vector<Path> entries(Path::recursive_listdir(root));
+                do_not_optimize(entries);
+            }
+        });
+
+        add("glob/wide", [](State& state) {
+            state.pause();
+            Path root(Path::join(scratch(), "wide"));
+            make_wide(root);
+            std::string pattern(Path::join(root, "file1*.txt").string());
+            state.resume();
+
+            for (size_t i = 0; i < state.iterations; ++i) {
+                std::vector<Path> matches(Path::glob(pattern));
+                do_not_optimize(matches);
+            }
+        });
+
+        add("glob/small", [](State& state) {
+            state.pause();
+            Path root(Path::join(scratch(), "small"));
+            make_small(root);
+            std::string pattern(Path::join(root, "**", "*.txt").string());
+            state.resume();
+
+            for (size_t i = 0; i < state.iterations; ++i) {
+                std::vector<Path> matches(Path::glob(pattern));
+                do_not_optimize(matches);
+            }
+        });
+
+        add("makedirs/deep", [](State& state) {
+            state.set_items(deep_levels);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                state.pause();
+                Path root(Path::join(scratch(), "makedirs"));
+                Path::rmdirs(root, true);
+                Path p(root);
+                for (size_t j = 0; j < deep_levels; ++j) {
+                    p.append("d" + std::to_string(j));
+                }
+                state.resume();
+
+                Path::makedirs(p);
+            }
+        });
+
+        add("makedirs/batch", [](State& state) {
+            std::vector<Path> directories;
+            for (size_t i = 0; i < small_directories; ++i) {
+                directories.push_back(Path::join(scratch(), "batch", i % 10, i));
+            }
+            state.set_items(directories.size());
+
+            for (size_t i = 0; i < state.iterations; ++i) {
+                state.pause();
+                Path::rmdirs(Path::join(scratch(), "batch"), true);
+                state.resume();
+
+                Path::makedirs(directories);
+            }
+        });
+
+        add("rmdirs/small", [](State& state) {
+            state.set_items(small_directories * (small_files + 1) + 10);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                state.pause();
+                Path root(Path::join(scratch(), "rmdirs"));
+                make_small(root);
+                state.resume();
+
+                Path::rmdirs(root);
+            }
+        });
+
+        add("rmdirs/deep", [](State& state) {
+            state.set_items(deep_levels);
+            for (size_t i = 0; i < state.iterations; ++i) {
+                state.pause();
+                Path root(Path::join(scratch(), "rmdirs"));
+                make_deep(root);
+                state.resume();
+
+                Path::rmdirs(root);
+            }
+        });
+    }
+
+    /**************************************************************************
+     * Reporting
+     *************************************************************************/
+    void report_console(const std::vector<Result>& results) {
+        printf("%-32s %14s %14s %16s\n", "Benchmark", "Time (ns)", "Iterations", "Items/s");
+        printf("%s\n", std::string(79, '-').c_str());
+        for (const Result& result : results) {
+            printf("%-32s %14.1f %14zu", result.name.c_str(), result.ns_per_iteration,
+                   result.iterations);
+            if (result.items_per_second > 0) {
+                printf(" %16.0f", result.items_per_second);
+            }
+            printf("\n");
+        }
+    }
+
+    void report_json(const std::vector<Result>& results) {
+        printf("{\n  \"benchmarks\": [\n");
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result& result(results[i]);
+            printf("    {\"name\": \"%s\", \"iterations\": %zu, \"ns_per_iteration\": %.3f, "
+                   "\"items_per_second\": %.3f}%s\n", result.name.c_str(), result.iterations,
+                   result.ns_per_iteration, result.items_per_second,
+                   i + 1 < results.size() ? "," : "");
+        }
+        printf("  ]\n}\n");
+    }
+
+    void report_csv(const std::vector<Result>& results) {
+        printf("name,iterations,ns_per_iteration,items_per_second\n");
+        for (const Result& result : results) {
+            printf("%s,%zu,%.3f,%.3f\n", result.name.c_str(), result.iterations,
+                   result.ns_per_iteration, result.items_per_second);
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::string filter;
+    std::string format("console");
+    double min_time = 0.2;
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--filter=", 9)) {
+            filter = argv[i] + 9;
+        } else if (!strncmp(argv[i], "--format=", 9)) {
+            format = argv[i] + 9;
+        } else if (!strncmp(argv[i], "--min-time=", 11)) {
+            min_time = atof(argv[i] + 11);
+        } else {
+            fprintf(stderr, "Usage: %s [--filter=<substring>] "
+                    "[--format=console|json|csv] [--min-time=<seconds>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (format != "console" && format != "json" && format != "csv") {
+        fprintf(stderr, "Unknown format: %s\n", format.c_str());
+        return 1;
+    }
+
+    register_micro();
+    register_macro();
+
+    Path::rmdirs(scratch(), true);
+    Path::makedirs(scratch());
+
+    std::vector<Result> results;
+    for (const Benchmark& benchmark : registry()) {
+        if (benchmark.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        results.push_back(run(benchmark, min_time));
+    }
+
+    Path::rmdirs(scratch(), true);
+
+    if (format == "json") {
+        report_json(results);
+    } else if (format == "csv") {
+        report_csv(results);
+    } else {
+        report_console(results);
+    }
+    return 0;
+}
@@ -27,14 +27,38 @@
 /* C++ includes */
 #include <algorithm>
 #include <vector>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <initializer_list>
 #include <string>
+#include <string_view>
+#include <charconv>
+#include <limits>
+#include <type_traits>
 #include <cstring>
 #include <cstdlib>
+#include <cstdint>
 #include <istream>
 #include <sstream>
 #include <iostream>
 #include <iterator>
 #include <cctype>
+#include <deque>
+#include <memory>
+#include <memory_resource>
+#include <functional>
+#include <exception>
+#include <system_error>
+#include <stdexcept>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <future>
+#include <chrono>
 
 /* C includes */
 #include <errno.h>
@@ -43,6 +67,16 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+/* For the scanning kernels */
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+    #include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    #include <arm_neon.h>
+#endif
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
 /* Arrgh Windows! */
 #if defined(_WIN32)
     #include <windows.h>
@@ -60,842 +94,7679 @@
         #define ssize_t long
     #endif
 #else
-    #include <glob.h>
     #include <unistd.h>
+    #include <sys/mman.h>
 #endif
 
-/* A class for path manipulation */
-namespace apathy {
-
-    int makedir(const char *path, mode_t mode)
-    {
-#if defined(_WIN32)
-        (void)(mode);
-        return mkdir(path);
-#else
-        return mkdir(path, mode);
+#if defined(__linux__)
+    #include <sys/ioctl.h>
+    #include <sys/sendfile.h>
+    #include <linux/fs.h>
+    #include <sys/inotify.h>
+    #include <poll.h>
+    #ifndef FICLONE
+        #define FICLONE _IOW(0x94, 9, int)
+    #endif
 #endif
-    }
 
-#if defined(_WIN32)
-    static const char windows_separator = '\\';
-    static const char windows_drive_separator = ':';
-    static const char posix_separator = '/';
-    static const char separator = windows_separator;
-#else
-    static const char separator = '/';
-#endif
+/* A class for path manipulation
+ *
+ * Threads: like a `std::string`, a `Path` can be read from any number of
+ * threads at once, but needs external locking to be changed while it's
+ * shared. The static functions keep no state of their own other than the
+ * cached working directory, so they can all be called from any thread
+ * (see `cwd` for how changing directory interacts with that). `TreeWalker`,
+ * `AsyncFilesystem` and `SharedPathCache` are meant to be shared between
+ * threads. Everything else (`StatCache`, `PathTable`, `IndexedPath`,
+ * `Snapshot`, `Watcher` and so on) needs either one per thread or a lock.
+ *
+ * Errors: the functions that touch the filesystem return false or an empty
+ * result when they fail. `cwd`, `touch`, `rm`, `makedirs` and `rmdirs` also
+ * print the error to stderr, like `perror`, and the rest leave it in errno.
+ * Those and `absolute`, `move`, `copy`, `recursive_copy`, `read_all`,
+ * `write_all`, `listdir` and `scandir` each have an overload taking a
+ * `std::error_code&` instead, which is cleared on success and set to the
+ * first error on failure, even one on another thread. They never print, and
+ * neither do any of the calls they make themselves. */
+namespace apathy {
 
-    class Path {
-    public:
-        /* A class meant to contain path segments */
-        struct Segment {
-            /* The actual string segment */
-            std::string segment;
+#if defined(APATHY_INSTRUMENT)
+    /* Counters and timings for finding out what the filesystem is being asked
+     * to do. These only exist when compiled with APATHY_INSTRUMENT defined,
+     * and otherwise the hooks into them compile away to nothing */
+    namespace instrument {
+        /* Each of the system calls made through `sys` */
+        enum class Syscall {
+            stat, lstat, fstatat, open, openat, close, opendir, fdopendir,
+            readdir, closedir, getcwd, chdir, mkdir, mkdirat, rmdir, unlink,
+            unlinkat, rename, remove, fstat, read, write, fsync, fchmod,
+            fchown, futimens, readlink, symlink, clone, copy_file_range,
+            sendfile, mmap, munmap, madvise, inotify_init, inotify_add_watch,
+            inotify_rm_watch, poll,
+            count
+        };
 
-            Segment(std::string s=""): segment(s) {}
+        inline const char* name(Syscall call) {
+            static const char* names[] = {
+                "stat", "lstat", "fstatat", "open", "openat", "close", "opendir",
+                "fdopendir", "readdir", "closedir", "getcwd", "chdir", "mkdir",
+                "mkdirat", "rmdir", "unlink", "unlinkat", "rename", "remove",
+                "fstat", "read", "write", "fsync", "fchmod", "fchown", "futimens",
+                "readlink", "symlink", "clone", "copy_file_range", "sendfile",
+                "mmap", "munmap", "madvise", "inotify_init", "inotify_add_watch",
+                "inotify_rm_watch", "poll"
+            };
+            return names[static_cast<size_t>(call)];
+        }
 
-#if defined(_WIN32)
-            bool is_drive_letter() const { return segment.size() >= 2 && segment[1] == windows_drive_separator; }
-#endif
+        /* How much one thread has asked of the filesystem and the allocator */
+        struct Counters {
+            std::uint64_t syscalls[static_cast<size_t>(Syscall::count)];
+            /* Only counted once `track_allocations` has been called */
+            std::uint64_t allocations;
+            std::uint64_t bytes_allocated;
 
-            friend std::istream& operator>>(std::istream& stream, Segment& s) {
-                return std::getline(stream, s.segment, separator);
+            std::uint64_t operator[](Syscall call) const {
+                return syscalls[static_cast<size_t>(call)];
+            }
+
+            /* All the system calls, of any kind */
+            std::uint64_t total() const {
+                std::uint64_t result = 0;
+                for (std::uint64_t count : syscalls) {
+                    result += count;
+                }
+                return result;
             }
         };
 
-        /**********************************************************************
-         * Constructors
-         *********************************************************************/
+        /* The calling thread's counters. Threads started by a `TreeWalker`
+         * or a parallel `rmdirs` count separately, so use a hook to see
+         * those */
+        inline Counters& thread_counters() {
+            static thread_local Counters counters = Counters();
+            return counters;
+        }
 
-        /* Default constructor
-         *
-         * Points to current directory
-         * On Windows, this will also convert the separators to windows separators.
-         * If you want to retain your current separators, just use a string.
-         */
-        Path(const std::string& p="");
+        /* Zero the calling thread's counters */
+        inline void reset() {
+            thread_counters() = Counters();
+        }
 
-        /* Our generalized constructor.
-         *
-         * This enables all sorts of type promotion (like int -> Path) for
-         * arguments into all the functions below. Anything that
-         * std::stringstream can support is implicitly supported as well
-         *
-         * @param p - path to construct */
+        /* Called for every system call, from whichever thread made it. The
+         * path is null for calls that don't take one */
+        typedef void (*Hook)(Syscall call, const char* path);
 
-        template <class T>
-        Path(const T& p);
+        inline std::atomic<Hook>& hook() {
+            static std::atomic<Hook> installed(nullptr);
+            return installed;
+        }
 
-        /**********************************************************************
-         * Operators
-         *********************************************************************/
-        /* Checks if the paths are exactly the same */
-        bool operator==(const Path& other) const { return path == other.path; }
+        /* Install a hook, or remove it with nullptr */
+        inline void set_hook(Hook h) {
+            hook().store(h);
+        }
 
-        /* Check if the paths are not exactly the same */
-        bool operator!=(const Path& other) const { return ! (*this == other); }
+        inline void count(Syscall call, const char* path) {
+            ++thread_counters().syscalls[static_cast<size_t>(call)];
+            Hook h = hook().load(std::memory_order_relaxed);
+            if (h) {
+                h(call, path);
+            }
+        }
 
-        /* Append the provided segment to the path as a directory. This is the
-         * same as append(segment)
-         *
-         * @param segment - path segment to add to this path */
-        Path& operator<<(const Path& segment);
+        /* The APIs whose latency is tracked */
+        enum class Operation {
+            listdir, scandir, recursive_listdir, glob, tree_walk, match_walk,
+            makedirs, rmdirs, snapshot, normalize,
+            count
+        };
 
-        /* Append the provided segment to the path as a directory. This is the
-         * same as append(segment). Returns a /new/ path object rather than a
-         * reference.
-         *
-         * @param segment - path segment to add to this path */
-        Path operator+(const Path& segment) const;
+        /* Latencies, counted in power-of-two buckets of nanoseconds. This
+         * can be recorded into from many threads at once */
+        class Histogram {
+        public:
+            static constexpr size_t buckets = 64;
 
-        /* Check if the two paths are equivalent
-         *
-         * Two paths are equivalent if they point to the same resource, even if
-         * they are not exact string matches
-         *
-         * @param other - path to compare to */
-        bool equivalent(const Path& other);
+            Histogram(): counts() {}
+            Histogram(const Histogram&) = delete;
+            Histogram& operator=(const Histogram&) = delete;
 
-        /* Return a string version of this path */
-        std::string string() const { return path; }
+            void record(std::uint64_t nanoseconds) {
+                size_t bucket = 0;
+                while (nanoseconds >> bucket > 1 && bucket + 1 < buckets) {
+                    ++bucket;
+                }
+                counts[bucket].fetch_add(1, std::memory_order_relaxed);
+            }
 
-        /* Return the name of the file */
-        std::string filename() const;
+            /* How many took in [2^bucket, 2^(bucket + 1)) nanoseconds. The
+             * first bucket also has everything under a nanosecond */
+            std::uint64_t count(size_t bucket) const {
+                return counts[bucket].load(std::memory_order_relaxed);
+            }
 
-        /* Return the extension of the file */
-        std::string extension() const;
+            /* How many were recorded altogether */
+            std::uint64_t total() const {
+                std::uint64_t result = 0;
+                for (size_t i = 0; i < buckets; ++i) {
+                    result += count(i);
+                }
+                return result;
+            }
 
-        /* Return a path object without the extension */
-        Path stem() const;
+            /* An upper bound on the latency at a fraction (like 0.99) of
+             * the way through the recorded ones */
+            std::uint64_t percentile(double fraction) const {
+                std::uint64_t target = static_cast<std::uint64_t>(total() * fraction);
+                std::uint64_t seen = 0;
+                for (size_t i = 0; i < buckets; ++i) {
+                    seen += count(i);
+                    if (seen > target) {
+                        return std::uint64_t(2) << i;
+                    }
+                }
+                return 0;
+            }
 
-        /**********************************************************************
-         * Manipulations
-         *********************************************************************/
+            void reset() {
+                for (std::atomic<std::uint64_t>& c : counts) {
+                    c.store(0, std::memory_order_relaxed);
+                }
+            }
 
-        /* Append the provided segment to the path as a directory. Alias for
-         * `operator<<`
-         *
-         * @param segment - path segment to add to this path */
-        Path& append(const Path& segment);
+        private:
+            std::atomic<std::uint64_t> counts[buckets];
+        };
 
-        /* Evaluate the provided path relative to this path. If the second path
-         * is absolute, then return the second path.
-         *
-         * @param rel - path relative to this path to evaluate */
-        Path& relative(const Path& rel);
+        /* The histogram for one of the APIs, which is shared by all threads */
+        inline Histogram& histogram(Operation operation) {
+            static Histogram histograms[static_cast<size_t>(Operation::count)];
+            return histograms[static_cast<size_t>(operation)];
+        }
 
-        /* Move up one level in the directory structure */
-        Path& up();
+        /* Records how long it lived in a histogram */
+        class Timer {
+        public:
+            explicit Timer(Operation o): operation(o), start(std::chrono::steady_clock::now()) {}
+            Timer(const Timer&) = delete;
+            Timer& operator=(const Timer&) = delete;
 
-        /* Turn this into an absolute path
-         *
-         * If the path is already absolute, it has no effect. Otherwise, it is
-         * evaluated relative to the current working directory */
-        Path& absolute();
+            ~Timer() {
+                histogram(operation).record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count());
+            }
 
-        /* Sanitize this path
-         *
-         * This...
-         *
-         * 1) replaces runs of consecutive separators with a single separator
-         * 2) evaluates '..' to refer to the parent directory, and
-         * 3) strips out '/./' as referring to the current directory
-         *
-         * If the path was absolute to begin with, it will be absolute 
-         * afterwards. If it was a relative path to begin with, it will only be
-         * converted to an absolute path if it uses enough '..'s to refer to
-         * directories above the current working directory */
-        Path& sanitize();
+        private:
+            Operation operation;
+            std::chrono::steady_clock::time_point start;
+        };
 
-        /* Make this path a directory
-         *
-         * If this path does not have a trailing directory separator, add one.
-         * If it already does, this does not affect the path */
-        Path& directory();
+        /* Counts allocations into the allocating thread's counters, passing
+         * them on to another resource */
+        class CountingResource: public std::pmr::memory_resource {
+        public:
+            explicit CountingResource(std::pmr::memory_resource* u): upstream(u) {}
+            CountingResource(const CountingResource&) = delete;
+            CountingResource& operator=(const CountingResource&) = delete;
+
+        private:
+            void* do_allocate(size_t bytes, size_t alignment) override {
+                Counters& counters(thread_counters());
+                ++counters.allocations;
+                counters.bytes_allocated += bytes;
+                return upstream->allocate(bytes, alignment);
+            }
 
-        /* Trim this path of trailing separators, up to the leading separator.
-         * For example, on *nix systems:
-         *
-         *   assert(Path("///").trim() == "/");
-         *   assert(Path("/foo//").trim() == "/foo");
-         */
-        Path& trim();
+            void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+                upstream->deallocate(p, bytes, alignment);
+            }
 
-        /**********************************************************************
-         * Copiers
-         *********************************************************************/
+            bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+                return this == &other;
+            }
 
-        /* Return parent path
-         *
-         * Returns a new Path object referring to the parent directory. To
-         * move _this_ path to the parent directory, use the `up` function */
-        Path parent() const { return Path(Path(*this).up()); }
+            std::pmr::memory_resource* upstream;
+        };
 
-        /**********************************************************************
-         * Member Utility Methods
-         *********************************************************************/
+        /* Start counting allocations for paths. Paths that aren't given a
+         * memory resource of their own use the default one, so this wraps
+         * the current default resource in a `CountingResource`. Calling it
+         * again does nothing */
+        inline void track_allocations() {
+            static CountingResource resource(std::pmr::get_default_resource());
+            std::pmr::set_default_resource(&resource);
+        }
+    }
 
-        /* Returns a vector of each of the path segments in this path */
-        std::vector<Segment> split() const;
+    #define APATHY_COUNT(call, path) \
+        ::apathy::instrument::count(::apathy::instrument::Syscall::call, path)
+    #define APATHY_TIME(operation) ::apathy::instrument::Timer apathy_timer( \
+        ::apathy::instrument::Operation::operation)
+#else
+    #define APATHY_COUNT(call, path) ((void)0)
+    #define APATHY_TIME(operation) ((void)0)
+#endif
 
-        /**********************************************************************
-         * Type Tests
-         *********************************************************************/
-        /* Is the path an absolute path? */
-        bool is_absolute() const;
+    /* Thin wrappers for the system calls we make, so that they can all be
+     * instrumented in one place */
+    namespace sys {
+        inline int stat(const char* path, struct stat* buf) {
+            APATHY_COUNT(stat, path);
+            return ::stat(path, buf);
+        }
 
-        /* Does the path have a trailing slash? */
-        bool trailing_slash() const;
+        inline int lstat(const char* path, struct stat* buf) {
+            APATHY_COUNT(lstat, path);
+#if defined(_WIN32)
+            return ::stat(path, buf);
+#else
+            return ::lstat(path, buf);
+#endif
+        }
 
-        /* Does this path exist?
-         *
-         * Returns true if the path can be `stat`d */
-        bool exists() const;
+        inline int open(const char* path, int flags, mode_t mode=0) {
+            APATHY_COUNT(open, path);
+            return ::open(path, flags, mode);
+        }
 
-        /* Is this path an existing file?
-         *
-         * Only returns true if the path has stat.st_mode that is a regular
-         * file */
-        bool is_file() const;
+        inline int close(int fd) {
+            APATHY_COUNT(close, nullptr);
+            return ::close(fd);
+        }
 
-        /* Is this path an existing directory?
-         *
-         * Only returns true if the path has a stat.st_mode that is a
-         * directory */
-        bool is_directory() const;
+        inline DIR* opendir(const char* path) {
+            APATHY_COUNT(opendir, path);
+            return ::opendir(path);
+        }
 
-        /* How large is this file?
-         *
-         * Returns the file size in bytes. If the file doesn't exist, it
-         * returns 0 */
-        size_t size() const;
+        inline dirent* readdir(DIR* dir) {
+            APATHY_COUNT(readdir, nullptr);
+            return ::readdir(dir);
+        }
 
-        /**********************************************************************
-         * Static Utility Methods
-         *********************************************************************/
+        inline int closedir(DIR* dir) {
+            APATHY_COUNT(closedir, nullptr);
+            return ::closedir(dir);
+        }
 
-        /* Return a brand new path as the concatenation of the two provided
-         * paths
-         *
-         * @param a - first part of the path to join
-         * @param b - second part of the path to join
-         */
-        static Path join(const Path& a, const Path& b);
+        inline char* getcwd(char* buf, size_t size) {
+            APATHY_COUNT(getcwd, nullptr);
+            return ::getcwd(buf, size);
+        }
 
-        /* Return a branch new path as the concatenation of each segments
-         *
-         * @param segments - the path segments to concatenate
-         */
-        static Path join(const std::vector<Segment>& segments);
+        inline int chdir(const char* path) {
+            APATHY_COUNT(chdir, path);
+            return ::chdir(path);
+        }
 
-        /* Current working directory */
-        static Path cwd();
+        inline int rmdir(const char* path) {
+            APATHY_COUNT(rmdir, path);
+            return ::rmdir(path);
+        }
 
-        /* Temporary directory */
-        static Path tmp();
+        inline int unlink(const char* path) {
+            APATHY_COUNT(unlink, path);
+            return ::unlink(path);
+        }
 
-        /* Create a file if one does not exist
-         *
-         * @param p - path to create
-         * @param mode - mode to create with */
-        static bool touch(const Path& p, mode_t mode=0777);
+        inline int rename(const char* source, const char* dest) {
+            APATHY_COUNT(rename, source);
+            return ::rename(source, dest);
+        }
 
-        /* Move / rename a file
-         *
-         * @param source - original path
-         * @param dest - new path
-         * @param mkdirs - recursively make any needed directories? */
-        static bool move(const Path& source, const Path& dest,
-                         bool mkdirs=false);
+        inline int remove(const char* path) {
+            APATHY_COUNT(remove, path);
+            return ::remove(path);
+        }
 
-        /* Remove a file
-         *
-         * @param path - path to remove */
-        static bool rm(const Path& path);
+#if !defined(_WIN32)
+        inline int fstatat(int fd, const char* path, struct stat* buf, int flags) {
+            APATHY_COUNT(fstatat, path);
+            return ::fstatat(fd, path, buf, flags);
+        }
 
-        /* Recursively make directories
-         *
-         * @param p - path to recursively make
-         * @returns true if it was able to, false otherwise */
-        static bool makedirs(const Path& p, mode_t mode=0777);
+        inline int openat(int fd, const char* path, int flags, mode_t mode=0) {
+            APATHY_COUNT(openat, path);
+            return ::openat(fd, path, flags, mode);
+        }
 
-        /* Recursively remove directories
-         *
-         * @param p - path to recursively remove */
-        static bool rmdirs(const Path& p, bool ignore_errors=false);
+        inline DIR* fdopendir(int fd) {
+            APATHY_COUNT(fdopendir, nullptr);
+            return ::fdopendir(fd);
+        }
 
-        /* List all the paths in a directory
-         *
-         * @param p - path to list items for */
-        static std::vector<Path> listdir(const Path& p);
+        inline int mkdirat(int fd, const char* path, mode_t mode) {
+            APATHY_COUNT(mkdirat, path);
+            return ::mkdirat(fd, path, mode);
+        }
 
-#if !defined(_WIN32)
-        /* Returns all matching globs
+        inline int unlinkat(int fd, const char* path, int flags) {
+            APATHY_COUNT(unlinkat, path);
+            return ::unlinkat(fd, path, flags);
+        }
+
+        inline int fstat(int fd, struct stat* buf) {
+            APATHY_COUNT(fstat, nullptr);
+            return ::fstat(fd, buf);
+        }
+
+        inline ssize_t read(int fd, void* buf, size_t count) {
+            APATHY_COUNT(read, nullptr);
+            return ::read(fd, buf, count);
+        }
+
+        inline ssize_t write(int fd, const void* buf, size_t count) {
+            APATHY_COUNT(write, nullptr);
+            return ::write(fd, buf, count);
+        }
+
+        inline int fsync(int fd) {
+            APATHY_COUNT(fsync, nullptr);
+            return ::fsync(fd);
+        }
+
+        inline int fchmod(int fd, mode_t mode) {
+            APATHY_COUNT(fchmod, nullptr);
+            return ::fchmod(fd, mode);
+        }
+
+        inline int fchown(int fd, uid_t owner, gid_t group) {
+            APATHY_COUNT(fchown, nullptr);
+            return ::fchown(fd, owner, group);
+        }
+
+        inline int futimens(int fd, const struct timespec times[2]) {
+            APATHY_COUNT(futimens, nullptr);
+            return ::futimens(fd, times);
+        }
+
+        inline ssize_t readlink(const char* path, char* buf, size_t size) {
+            APATHY_COUNT(readlink, path);
+            return ::readlink(path, buf, size);
+        }
+
+        inline int symlink(const char* target, const char* path) {
+            APATHY_COUNT(symlink, path);
+            return ::symlink(target, path);
+        }
+
+        inline void* mmap(size_t length, int prot, int flags, int fd) {
+            APATHY_COUNT(mmap, nullptr);
+            return ::mmap(NULL, length, prot, flags, fd, 0);
+        }
+
+        inline int munmap(void* address, size_t length) {
+            APATHY_COUNT(munmap, nullptr);
+            return ::munmap(address, length);
+        }
+
+        inline int madvise(void* address, size_t length, int advice) {
+            APATHY_COUNT(madvise, nullptr);
+            return ::madvise(address, length, advice);
+        }
+#endif
+
+#if defined(__linux__)
+        /* Share the source's extents with the destination, on filesystems
+         * that support reflinks */
+        inline int clone(int source, int dest) {
+            APATHY_COUNT(clone, nullptr);
+            return ::ioctl(dest, FICLONE, source);
+        }
+
+        inline ssize_t copy_file_range(int source, int dest, size_t length) {
+            APATHY_COUNT(copy_file_range, nullptr);
+            return ::copy_file_range(source, NULL, dest, NULL, length, 0);
+        }
+
+        inline ssize_t sendfile(int dest, int source, size_t length) {
+            APATHY_COUNT(sendfile, nullptr);
+            return ::sendfile(dest, source, NULL, length);
+        }
+
+        inline int inotify_init() {
+            APATHY_COUNT(inotify_init, nullptr);
+            return ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        }
+
+        inline int inotify_add_watch(int fd, const char* path, std::uint32_t mask) {
+            APATHY_COUNT(inotify_add_watch, path);
+            return ::inotify_add_watch(fd, path, mask);
+        }
+
+        inline int inotify_rm_watch(int fd, int wd) {
+            APATHY_COUNT(inotify_rm_watch, nullptr);
+            return ::inotify_rm_watch(fd, wd);
+        }
+
+        /* Wait up to `timeout` milliseconds for `fd` to be readable */
+        inline int poll(int fd, int timeout) {
+            APATHY_COUNT(poll, nullptr);
+            struct pollfd descriptor = {fd, POLLIN, 0};
+            return ::poll(&descriptor, 1, timeout);
+        }
+#endif
+    }
+
+    inline int makedir(const char *path, mode_t mode)
+    {
+        APATHY_COUNT(mkdir, path);
+#if defined(_WIN32)
+        (void)(mode);
+        return mkdir(path);
+#else
+        return mkdir(path, mode);
+#endif
+    }
+
+#if defined(_WIN32)
+    static const char windows_separator = '\\';
+    static const char windows_drive_separator = ':';
+    static const char posix_separator = '/';
+    static const char separator = windows_separator;
+#else
+    static const char separator = '/';
+#endif
+
+    /* Kernels that look for characters in paths 64 bytes at a time
+     *
+     * Each block becomes a 64-bit mask with bit i set where byte i matches,
+     * using AVX2 or SSE2 on x86 and NEON on 64-bit ARM, whichever the compiler
+     * is allowed to use, and a plain loop otherwise. The rest is bit twiddling
+     * on the masks, which finds the last of something, counts them, or looks
+     * at neighbouring bytes for every position at once */
+    namespace scan {
+        static constexpr size_t block = 64;
+        static constexpr size_t npos = std::string_view::npos;
+
+        /* One block's worth of bytes, ready to compare */
+#if defined(__AVX2__)
+        class Block {
+        public:
+            explicit Block(const char* data):
+                low(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data))),
+                high(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32))) {}
+
+            std::uint64_t equal(char c) const {
+                __m256i needle = _mm256_set1_epi8(c);
+                std::uint64_t l = static_cast<std::uint32_t>(
+                    _mm256_movemask_epi8(_mm256_cmpeq_epi8(low, needle)));
+                std::uint64_t h = static_cast<std::uint32_t>(
+                    _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, needle)));
+                return l | (h << 32);
+            }
+
+        private:
+            __m256i low;
+            __m256i high;
+        };
+#elif defined(__SSE2__) || defined(_M_X64)
+        class Block {
+        public:
+            explicit Block(const char* data): chunks() {
+                for (size_t i = 0; i < 4; ++i) {
+                    chunks[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * i));
+                }
+            }
+
+            std::uint64_t equal(char c) const {
+                __m128i needle = _mm_set1_epi8(c);
+                std::uint64_t result = 0;
+                for (size_t i = 0; i < 4; ++i) {
+                    std::uint64_t bits = static_cast<std::uint16_t>(
+                        _mm_movemask_epi8(_mm_cmpeq_epi8(chunks[i], needle)));
+                    result |= bits << (16 * i);
+                }
+                return result;
+            }
+
+        private:
+            __m128i chunks[4];
+        };
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+        class Block {
+        public:
+            explicit Block(const char* data): chunks() {
+                for (size_t i = 0; i < 4; ++i) {
+                    chunks[i] = vld1q_u8(reinterpret_cast<const std::uint8_t*>(data + 16 * i));
+                }
+            }
+
+            /* NEON has no movemask, so weight each lane by its bit within
+             * its byte of the result, and add neighbouring lanes together
+             * until there's one byte for each eight */
+            std::uint64_t equal(char c) const {
+                static const std::uint8_t weights[16] = {
+                    1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+                };
+                uint8x16_t weight = vld1q_u8(weights);
+                uint8x16_t needle = vdupq_n_u8(static_cast<std::uint8_t>(c));
+                uint8x16_t m[4];
+                for (size_t i = 0; i < 4; ++i) {
+                    m[i] = vandq_u8(vceqq_u8(chunks[i], needle), weight);
+                }
+                uint8x16_t sum = vpaddq_u8(vpaddq_u8(m[0], m[1]), vpaddq_u8(m[2], m[3]));
+                sum = vpaddq_u8(sum, sum);
+                return vgetq_lane_u64(vreinterpretq_u64_u8(sum), 0);
+            }
+
+        private:
+            uint8x16_t chunks[4];
+        };
+#else
+        class Block {
+        public:
+            explicit Block(const char* d): data(d) {}
+
+            std::uint64_t equal(char c) const {
+                std::uint64_t result = 0;
+                for (size_t i = 0; i < block; ++i) {
+                    result |= static_cast<std::uint64_t>(data[i] == c) << i;
+                }
+                return result;
+            }
+
+        private:
+            const char* data;
+        };
+#endif
+
+        /* A mask of the first `length` bits */
+        inline std::uint64_t first(size_t length) {
+            return length >= block ? ~std::uint64_t(0) : (std::uint64_t(1) << length) - 1;
+        }
+
+        /* Load a block, padding a short one out with zeros so that nothing
+         * past the end is read */
+        template <class Function>
+        inline auto with_block(const char* data, size_t length, Function function) {
+            if (length >= block) {
+                return function(Block(data));
+            }
+            char padded[block] = {};
+            std::memcpy(padded, data, length);
+            return function(Block(padded));
+        }
+
+        inline unsigned highest(std::uint64_t mask) {
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanReverse64(&index, mask);
+            return static_cast<unsigned>(index);
+#else
+            return 63 - static_cast<unsigned>(__builtin_clzll(mask));
+#endif
+        }
+
+        inline unsigned lowest(std::uint64_t mask) {
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanForward64(&index, mask);
+            return static_cast<unsigned>(index);
+#else
+            return static_cast<unsigned>(__builtin_ctzll(mask));
+#endif
+        }
+
+        inline unsigned population(std::uint64_t mask) {
+#if defined(_MSC_VER)
+            return static_cast<unsigned>(__popcnt64(mask));
+#else
+            return static_cast<unsigned>(__builtin_popcountll(mask));
+#endif
+        }
+
+        /* Walk the blocks of `s` from the back, until `found` returns a
+         * non-zero mask for one, and return the position of its highest bit */
+        template <class Found>
+        inline size_t find_last_block(std::string_view s, Found found) {
+            size_t end = s.size();
+            while (end > 0) {
+                size_t start = end >= block ? end - block : 0;
+                size_t length = end - start;
+                std::uint64_t mask = with_block(s.data() + start, length,
+                    [&](const Block& b) { return found(b) & first(length); });
+                if (mask) {
+                    return start + highest(mask);
+                }
+                end = start;
+            }
+            return npos;
+        }
+
+        /* The position of the last `c` in `s`, like `rfind` */
+        inline size_t find_last(std::string_view s, char c) {
+            return find_last_block(s, [c](const Block& b) { return b.equal(c); });
+        }
+
+        /* The position of the last character in `s` that isn't `c`, like
+         * `find_last_not_of` */
+        inline size_t find_last_not(std::string_view s, char c) {
+            return find_last_block(s, [c](const Block& b) { return ~b.equal(c); });
+        }
+
+        /* How many times `c` appears in `s` */
+        inline size_t count(std::string_view s, char c) {
+            size_t result = 0;
+            for (size_t start = 0; start < s.size(); start += block) {
+                size_t length = std::min(block, s.size() - start);
+                result += population(with_block(s.data() + start, length,
+                    [c](const Block& b) { return b.equal(c); }));
+            }
+            return result;
+        }
+
+        /* Whether `path` is already sanitized: it has no empty segments other
+         * than a leading or trailing one, and no '.' or '..' segments. These
+         * are found from the separator and dot masks of each block alone, by
+         * checking at every separator whether the bytes before it make one
+         * of those segments */
+        inline bool normalized(std::string_view path) {
+            /* The previous block's separators and dots. A segment starts at
+             * the beginning, as if there were a separator just before it */
+            std::uint64_t last_separators = std::uint64_t(1) << 63;
+            std::uint64_t last_dots = 0;
+            bool first_block = true;
+
+            for (size_t start = 0; start < path.size(); start += block) {
+                size_t length = std::min(block, path.size() - start);
+                std::uint64_t separators = 0;
+                std::uint64_t dots = 0;
+                with_block(path.data() + start, length, [&](const Block& b) {
+                    separators = b.equal(separator);
+                    dots = b.equal('.');
+                    return 0;
+                });
+
+                /* Whether each byte is preceded by a separator, or a dot, one,
+                 * two or three bytes back */
+                std::uint64_t separator1 = (separators << 1) | (last_separators >> 63);
+                std::uint64_t separator2 = (separators << 2) | (last_separators >> 62);
+                std::uint64_t separator3 = (separators << 3) | (last_separators >> 61);
+                std::uint64_t dot1 = (dots << 1) | (last_dots >> 63);
+                std::uint64_t dot2 = (dots << 2) | (last_dots >> 62);
+
+                /* The separator before the start isn't there to double up */
+                if (first_block) {
+                    separator1 &= ~std::uint64_t(1);
+                }
+
+                std::uint64_t bad = separators & (separator1 |
+                    (dot1 & separator2) | (dot1 & dot2 & separator3));
+                if (bad) {
+                    return false;
+                }
+
+                /* Only the last block is short, so the separator before the
+                 * start never reaches past the first */
+                last_separators = separators;
+                last_dots = dots;
+                first_block = false;
+            }
+
+            /* The end of the path ends the last segment, too */
+            size_t n = path.size();
+            if (n >= 1 && path[n - 1] == '.') {
+                if (n == 1 || path[n - 2] == separator) {
+                    return false;
+                }
+                if (path[n - 2] == '.' && (n == 2 || path[n - 3] == separator)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    }
+
+    class DirectoryIterator;
+    class RecursiveDirectoryIterator;
+    template <class Iterator> class DirectoryRange;
+
+    /* Whether a T can be written to a std::ostream, which is what makes it
+     * convertible to a Path */
+    template <class T, class = void>
+    struct is_streamable: std::false_type {};
+
+    template <class T>
+    struct is_streamable<T, decltype(void(std::declval<std::ostream&>() << std::declval<const T&>()))>:
+        std::true_type {};
+
+    /* A non-owning view of a path
+     *
+     * This provides the read-only queries of Path over a std::string_view, so
+     * that walking the segments of a path doesn't need to allocate. Like any
+     * string_view, it's up to the caller to make sure the underlying string
+     * outlives the view. */
+    class PathView {
+    public:
+        /* A bidirectional iterator over the segments of a path
          *
-         * @param pattern - the glob pattern to match */
-        static std::vector<Path> glob(const std::string& pattern);
+         * This yields exactly the segments that Path::split() does, including
+         * the empty leading segment for absolute paths and the empty trailing
+         * segment for directories */
+        class iterator {
+        public:
+            typedef std::bidirectional_iterator_tag iterator_category;
+            typedef std::string_view value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef const std::string_view* pointer;
+            typedef std::string_view reference;
+
+            iterator(): path(), start(0), stop(0) {}
+
+            std::string_view operator*() const {
+                return path.substr(start, stop - start);
+            }
+
+            iterator& operator++();
+            iterator operator++(int) {
+                iterator result(*this);
+                ++(*this);
+                return result;
+            }
+
+            iterator& operator--();
+            iterator operator--(int) {
+                iterator result(*this);
+                --(*this);
+                return result;
+            }
+
+            bool operator==(const iterator& other) const {
+                return path.data() == other.path.data() &&
+                    start == other.start;
+            }
+            bool operator!=(const iterator& other) const {
+                return !(*this == other);
+            }
+
+        private:
+            friend class PathView;
+
+            iterator(std::string_view p, size_t b, size_t e):
+                path(p), start(b), stop(e) {}
+
+            /* The whole path we're iterating over */
+            std::string_view path;
+            /* Bounds of the current segment. The end iterator has a start
+             * one past the end of the path */
+            size_t start;
+            size_t stop;
+        };
+
+        PathView(): path() {}
+        PathView(const char* p): path(p) {}
+        PathView(const std::string& p): path(p) {}
+        PathView(std::string_view p): path(p) {}
+
+        /* Checks if the paths are exactly the same */
+        bool operator==(const PathView& other) const { return path == other.path; }
+
+        /* Check if the paths are not exactly the same */
+        bool operator!=(const PathView& other) const { return ! (*this == other); }
+
+        /* Order paths segment by segment, which is like ordering the strings
+         * except that the separator comes before everything else. So each
+         * directory sorts right before what's in it: "a" < "a/b" < "a-b"
+         *
+         * Returns less than, equal to or greater than 0 */
+        int compare(const PathView& other) const;
+
+        bool operator<(const PathView& other) const { return compare(other) < 0; }
+        bool operator>(const PathView& other) const { return compare(other) > 0; }
+        bool operator<=(const PathView& other) const { return compare(other) <= 0; }
+        bool operator>=(const PathView& other) const { return compare(other) >= 0; }
+
+        /* Return the viewed string */
+        std::string_view string() const { return path; }
+
+        /* Is this an empty path? */
+        bool empty() const { return path.empty(); }
+
+        /* Iterate over the segments in this path */
+        iterator begin() const;
+        iterator end() const { return iterator(path, path.size() + 1, path.size() + 1); }
+
+        /* Return the name of the file */
+        std::string_view filename() const;
+
+        /* Return the extension of the file */
+        std::string_view extension() const;
+
+        /* Return a view of the path without the extension */
+        PathView stem() const;
+
+        /* Is the path an absolute path? */
+        bool is_absolute() const;
+
+        /* Does the path have a trailing slash? */
+        bool trailing_slash() const;
+
+        /* So that we can write paths out to ostreams */
+        friend std::ostream& operator<<(std::ostream& stream, const PathView& p) {
+            return stream << p.path;
+        }
+
+    private:
+        /* The path we're looking at */
+        std::string_view path;
+    };
+
+    class Path {
+    public:
+        /* The allocator our storage comes from */
+        typedef std::pmr::polymorphic_allocator<char> allocator_type;
+
+        /* A class meant to contain path segments */
+        struct Segment {
+            /* The actual string segment */
+            std::string segment;
+
+            Segment(std::string s=""): segment(s) {}
+
+#if defined(_WIN32)
+            bool is_drive_letter() const { return segment.size() >= 2 && segment[1] == windows_drive_separator; }
 #endif
 
-        /* Returns all the files contained in the directory and it's subdirectories
-         *
-         * @param p - path to start searching */
-        static std::vector<Path> recursive_listdir(const Path &p);
+            friend std::istream& operator>>(std::istream& stream, Segment& s) {
+                return std::getline(stream, s.segment, separator);
+            }
+        };
+
+        /* Everything we learn about a path from a single `stat`
+         *
+         * Rather than stat'ing separately to check whether the path exists,
+         * whether it's a directory and how large it is, stat once and ask
+         * this instead */
+        struct Status {
+            enum Type {
+                not_found,
+                file,
+                directory,
+                symlink,
+                other
+            };
+
+            /* What kind of thing the path refers to */
+            Type type;
+            /* The full st_mode, including permission bits */
+            mode_t mode;
+            /* Size in bytes */
+            std::uint64_t size;
+            /* Last modification time */
+            time_t mtime;
+            long mtime_nsec;
+            /* Identify the underlying file, even across renames */
+            ino_t inode;
+            dev_t device;
+
+            /* A status for a path that doesn't exist */
+            Status(): type(not_found), mode(0), size(0), mtime(0),
+                mtime_nsec(0), inode(0), device(0) {}
+
+            explicit Status(const struct stat& buf);
+
+            bool exists() const { return type != not_found; }
+            bool is_file() const { return type == file; }
+            bool is_directory() const { return type == directory; }
+            bool is_symlink() const { return type == symlink; }
+        };
+
+        /* An entry read from a directory. See `scandir` */
+        struct Entry;
+
+        /**********************************************************************
+         * Constructors
+         *********************************************************************/
+
+        /* Default constructor
+         *
+         * Points to current directory
+         * On Windows, this will also convert the separators to windows separators.
+         * If you want to retain your current separators, just use a string.
+         */
+        Path(const std::string& p="");
+
+        /* Allocator-aware constructors
+         *
+         * A path's storage comes from a std::pmr memory resource, which is
+         * normally the default one. To put a path somewhere else, like a
+         * std::pmr::monotonic_buffer_resource shared by a whole batch of
+         * paths, construct it with that resource. Copies of the path revert
+         * to the default resource, unless they're made into containers that
+         * use a resource of their own, like a std::pmr::vector<Path>.
+         *
+         * @param p - path to construct
+         * @param alloc - allocator to store the path with */
+        explicit Path(const allocator_type& alloc);
+        template <class T, class = typename std::enable_if<
+            std::is_convertible<const T&, std::string_view>::value>::type>
+        Path(const T& p, const allocator_type& alloc);
+        Path(const Path& p, const allocator_type& alloc): path(p.path, alloc) {}
+        Path(Path&& p, const allocator_type& alloc): path(std::move(p.path), alloc) {}
+
+        Path(const Path& p) = default;
+        Path(Path&& p) = default;
+        Path& operator=(const Path& p) = default;
+        Path& operator=(Path&& p) = default;
+
+        /* Our generalized constructor.
+         *
+         * This enables all sorts of type promotion (like int -> Path) for
+         * arguments into all the functions below. Anything that
+         * std::stringstream can support is implicitly supported as well.
+         *
+         * Strings, views, integers and floating point numbers are converted
+         * directly, with the same results a std::stringstream would give. Only
+         * other types actually go through a stream.
+         *
+         * @param p - path to construct */
+
+        template <class T, class = typename std::enable_if<is_streamable<T>::value>::type>
+        Path(const T& p);
+
+        /**********************************************************************
+         * Operators
+         *********************************************************************/
+        /* Checks if the paths are exactly the same */
+        bool operator==(const Path& other) const { return path == other.path; }
+
+        /* Check if the paths are not exactly the same */
+        bool operator!=(const Path& other) const { return ! (*this == other); }
+
+        /* Order paths segment by segment, so that parents come before their
+         * children. See `PathView::compare` */
+        bool operator<(const Path& other) const { return view() < other.view(); }
+        bool operator>(const Path& other) const { return view() > other.view(); }
+        bool operator<=(const Path& other) const { return view() <= other.view(); }
+        bool operator>=(const Path& other) const { return view() >= other.view(); }
+
+        /* Append the provided segment to the path as a directory. This is the
+         * same as append(segment)
+         *
+         * @param segment - path segment to add to this path */
+        Path& operator<<(const Path& segment) &;
+        Path operator<<(const Path& segment) && { return std::move(*this).append(segment); }
+
+        /* Append the provided segment to the path as a directory. This is the
+         * same as append(segment). Returns a /new/ path object rather than a
+         * reference.
+         *
+         * @param segment - path segment to add to this path */
+        Path operator+(const Path& segment) const &;
+        Path operator+(const Path& segment) &&;
+
+        /* Check if the two paths are equivalent
+         *
+         * Two paths are equivalent if they point to the same resource, even if
+         * they are not exact string matches
+         *
+         * @param other - path to compare to */
+        bool equivalent(const Path& other) const;
+
+        /* Return a string version of this path */
+        std::string string() const { return std::string(path.data(), path.size()); }
+
+        /* The allocator this path's storage comes from */
+        allocator_type get_allocator() const { return path.get_allocator(); }
+
+        /* Return a non-owning view of this path. It's only valid as long as
+         * this path is alive and unmodified */
+        PathView view() const { return PathView(path); }
+
+        /* Return the name of the file */
+        std::string filename() const;
+
+        /* Return the extension of the file */
+        std::string extension() const;
+
+        /* Return a path object without the extension */
+        Path stem() const;
+
+        /**********************************************************************
+         * Manipulations
+         *
+         * Each of these also has an overload for temporaries, which returns
+         * the modified path by value rather than a reference. That way chains
+         * like `Path(p).absolute().sanitize()` keep reusing the one buffer
+         *********************************************************************/
+
+        /* Append the provided segment to the path as a directory. Alias for
+         * `operator<<`
+         *
+         * @param segment - path segment to add to this path */
+        Path& append(const Path& segment) &;
+        Path append(const Path& segment) && { append(segment); return std::move(*this); }
+
+        /* Evaluate the provided path relative to this path. If the second path
+         * is absolute, then return the second path.
+         *
+         * @param rel - path relative to this path to evaluate */
+        Path& relative(const Path& rel) &;
+        Path relative(const Path& rel) && { relative(rel); return std::move(*this); }
+
+        /* Move up one level in the directory structure */
+        Path& up() &;
+        Path up() && { up(); return std::move(*this); }
+
+        /* Turn this into an absolute path
+         *
+         * If the path is already absolute, it has no effect. Otherwise, it is
+         * evaluated relative to the current working directory. If that can't
+         * be found out, the path is left as it is, and `ec` is set */
+        Path& absolute() &;
+        Path absolute() && { absolute(); return std::move(*this); }
+        Path& absolute(std::error_code& ec) &;
+        Path absolute(std::error_code& ec) && { absolute(ec); return std::move(*this); }
+
+        /* Turn this into an absolute path, relative to the provided base
+         *
+         * If the path is already absolute, it has no effect. Otherwise, it is
+         * evaluated relative to `base`, which should itself be absolute
+         *
+         * @param base - directory to evaluate this path relative to */
+        Path& absolute(const Path& base) &;
+        Path absolute(const Path& base) && { absolute(base); return std::move(*this); }
+
+        /* Sanitize this path
+         *
+         * This...
+         *
+         * 1) replaces runs of consecutive separators with a single separator
+         * 2) evaluates '..' to refer to the parent directory, and
+         * 3) strips out '/./' as referring to the current directory
+         *
+         * If the path was absolute to begin with, it will be absolute 
+         * afterwards. If it was a relative path to begin with, it will only be
+         * converted to an absolute path if it uses enough '..'s to refer to
+         * directories above the current working directory
+         *
+         * The path is normalized in place in a single pass, so this never
+         * allocates beyond the storage the path already owns */
+        Path& sanitize() &;
+        Path sanitize() && { sanitize(); return std::move(*this); }
+
+        /* Make this path a directory
+         *
+         * If this path does not have a trailing directory separator, add one.
+         * If it already does, this does not affect the path */
+        Path& directory() &;
+        Path directory() && { directory(); return std::move(*this); }
+
+        /* Trim this path of trailing separators, up to the leading separator.
+         * For example, on *nix systems:
+         *
+         *   assert(Path("///").trim() == "/");
+         *   assert(Path("/foo//").trim() == "/foo");
+         */
+        Path& trim() &;
+        Path trim() && { trim(); return std::move(*this); }
+
+        /**********************************************************************
+         * Copiers
+         *********************************************************************/
+
+        /* Return parent path
+         *
+         * Returns a new Path object referring to the parent directory. To
+         * move _this_ path to the parent directory, use the `up` function */
+        Path parent() const & { return Path(*this).up(); }
+        Path parent() && { return std::move(*this).up(); }
+
+        /**********************************************************************
+         * Member Utility Methods
+         *********************************************************************/
+
+        /* Returns a vector of each of the path segments in this path. To walk
+         * them without copying, iterate over `view()` instead */
+        std::vector<Segment> split() const;
+
+        /**********************************************************************
+         * Type Tests
+         *********************************************************************/
+        /* Is the path an absolute path? */
+        bool is_absolute() const;
+
+        /* Does the path have a trailing slash? */
+        bool trailing_slash() const;
+
+        /* Stat this path, following symlinks
+         *
+         * If the path can't be `stat`d, the status has type `not_found` */
+        Status status() const;
+
+        /* Stat this path without following symlinks */
+        Status symlink_status() const;
+
+        /* Does this path exist?
+         *
+         * Returns true if the path can be `stat`d */
+        bool exists() const;
+
+        /* Is this path an existing file?
+         *
+         * Only returns true if the path has stat.st_mode that is a regular
+         * file */
+        bool is_file() const;
+
+        /* Is this path an existing directory?
+         *
+         * Only returns true if the path has a stat.st_mode that is a
+         * directory */
+        bool is_directory() const;
+
+        /* How large is this file?
+         *
+         * Returns the file size in bytes. If the file doesn't exist, it
+         * returns 0 */
+        size_t size() const;
+
+        /**********************************************************************
+         * Static Utility Methods
+         *********************************************************************/
+
+        /* Return a brand new path as the concatenation of the two provided
+         * paths
+         *
+         * @param a - first part of the path to join
+         * @param b - second part of the path to join
+         */
+        static Path join(const Path& a, const Path& b);
+
+        /* Return a brand new path as the concatenation of all the provided
+         * paths. The result is sized once up front, and if the first part is
+         * a temporary, its buffer is reused
+         *
+         * @param first - first part of the path to join
+         * @param second, rest... - the parts to append to it
+         */
+        template <class First, class Second, class... Rest>
+        static Path join(First&& first, const Second& second, const Rest&... rest);
+
+        /* Return a branch new path as the concatenation of each segments
+         *
+         * @param segments - the path segments to concatenate
+         */
+        static Path join(const std::vector<Segment>& segments);
+
+        /* Make each of `paths` absolute against `base`, and sanitize it
+         *
+         * Each result is `Path(p).absolute(base).sanitize()`, except that
+         * `base` is only made absolute once, and the paths are shared out
+         * between threads. They're written over whatever paths `results`
+         * already has, after resizing it to match, so reusing `results` from
+         * one batch to the next stops allocating once it's big enough. If it's
+         * a std::pmr::vector<Path>, new paths come from its memory resource,
+         * which needs to be thread-safe if there's more than one thread.
+         *
+         * @param paths - a vector or array of strings, views or paths
+         * @param base - directory that relative paths are relative to
+         * @param results - where the normalized paths go
+         * @param threads - how many threads to use. If 0, one for each
+         *                  hardware thread */
+        template <class Paths, class Results>
+        static void normalize(const Paths& paths, const Path& base,
+                              Results& results, unsigned threads=0);
+
+        /* Like `normalize`, but only keep the first of each distinct result,
+         * in order. `groups` is set to the index in `results` of each path's
+         * result, so each path's equivalents share its index */
+        template <class Paths, class Results>
+        static void normalize(const Paths& paths, const Path& base,
+                              Results& results, std::vector<size_t>& groups,
+                              unsigned threads=0);
+
+        /* Current working directory
+         *
+         * This is cached for the whole process, so it's safe and cheap to call
+         * from many threads at once. `Path::chdir` keeps it up to date, but if
+         * the working directory is changed any other way, the cache needs to
+         * be refreshed with `invalidate_cwd`. The same goes for a failure to
+         * find it out, which is also cached */
+        static Path cwd();
+
+        /* Current working directory, setting `ec` if it can't be found out
+         * rather than printing to stderr */
+        static Path cwd(std::error_code& ec);
+
+        /* Change the current working directory, and update the cached one
+         *
+         * @param p - directory to change to */
+        static bool chdir(const Path& p);
+
+        /* Forget the cached working directory, so it's looked up again */
+        static void invalidate_cwd();
+
+        /* Temporary directory
+         *
+         * This reads `TMPDIR` each time, so it's only safe to call from many
+         * threads at once if none of them are changing the environment */
+        static Path tmp();
+
+        /* Create a file if one does not exist
+         *
+         * @param p - path to create
+         * @param mode - mode to create with */
+        static bool touch(const Path& p, mode_t mode=0777);
+        static bool touch(const Path& p, std::error_code& ec, mode_t mode=0777);
+
+        /* Create all of the provided files, and the directories they're in.
+         * See the batch `makedirs`
+         *
+         * @param paths - paths to create
+         * @param mode - mode to create with
+         * @param threads - how many threads to create with */
+        static bool touch(const std::vector<Path>& paths, mode_t mode=0777,
+                          unsigned threads=1);
+        static bool touch(const std::vector<Path>& paths, std::error_code& ec,
+                          mode_t mode=0777, unsigned threads=1);
+
+        /* Move / rename a file
+         *
+         * If the destination is on another filesystem, the source is copied
+         * there with `copy` (or `recursive_copy` for directories) and then
+         * removed. A copy that fails leaves the destination untouched.
+         *
+         * @param source - original path
+         * @param dest - new path
+         * @param mkdirs - recursively make any needed directories? */
+        static bool move(const Path& source, const Path& dest,
+                         bool mkdirs=false);
+        static bool move(const Path& source, const Path& dest,
+                         std::error_code& ec, bool mkdirs=false);
+
+        /* Copy a file, along with its mode, owner (where permitted) and
+         * access and modification times
+         *
+         * The data is copied within the kernel where possible. Reflinks are
+         * tried first, then `copy_file_range` and `sendfile`, and finally
+         * plain reads and writes. The copy is written to a temporary file
+         * next to `dest` and renamed over it once complete, so `dest` is
+         * never left half-written. Only regular files can be copied, and
+         * anything else, like a FIFO or a device, fails with
+         * `std::errc::invalid_argument` rather than being read.
+         *
+         * @param source - file to copy
+         * @param dest - path to copy it to */
+        static bool copy(const Path& source, const Path& dest);
+        static bool copy(const Path& source, const Path& dest, std::error_code& ec);
+
+        /* Read a whole file into `contents`, sizing it from a single `fstat`
+         *
+         * @param p - file to read
+         * @param contents - where to put what's read */
+        static bool read_all(const Path& p, std::string& contents);
+        static bool read_all(const Path& p, std::string& contents,
+                             std::error_code& ec);
+
+        /* Replace the contents of a file
+         *
+         * The contents are written to a temporary file next to `p`, which is
+         * synced and then renamed over it, so readers only ever see either
+         * the old contents or the new ones
+         *
+         * @param p - file to write
+         * @param contents - what to write
+         * @param mode - mode to create the file with */
+        static bool write_all(const Path& p, std::string_view contents,
+                              mode_t mode=0666);
+        static bool write_all(const Path& p, std::string_view contents,
+                              std::error_code& ec, mode_t mode=0666);
+
+        /* Copy a directory and everything in it, which must not already
+         * exist at `dest`
+         *
+         * The tree is read with a `TreeWalker`, and files are copied by
+         * several threads at once, into a temporary directory that's only
+         * renamed to `dest` once everything is copied. On failure it's
+         * removed. Symlinks are copied as symlinks, and other special files
+         * are skipped.
+         *
+         * @param source - directory to copy
+         * @param dest - path to copy it to
+         * @param threads - how many threads to copy with. If 0, one for each
+         *                  hardware thread */
+        static bool recursive_copy(const Path& source, const Path& dest,
+                                   unsigned threads=0);
+        static bool recursive_copy(const Path& source, const Path& dest,
+                                   std::error_code& ec, unsigned threads=0);
+
+        /* Remove a file
+         *
+         * @param path - path to remove */
+        static bool rm(const Path& path);
+        static bool rm(const Path& path, std::error_code& ec);
+
+        /* Recursively make directories
+         *
+         * This finds the deepest directory that already exists by bisecting
+         * the path's ancestors, and then creates each missing one in turn
+         * relative to it. A directory that something else creates in the
+         * meantime counts as success, so it's safe to race other callers
+         *
+         * @param p - path to recursively make
+         * @returns true if it was able to, false otherwise */
+        static bool makedirs(const Path& p, mode_t mode=0777);
+        static bool makedirs(const Path& p, std::error_code& ec, mode_t mode=0777);
+
+        /* Make all of the provided directories, and their ancestors
+         *
+         * The paths are sorted so that those sharing ancestors are next to
+         * each other, and each distinct directory is only created once, with
+         * `mkdirat` relative to its parent. The subtrees under the paths'
+         * common ancestor can be created by several threads at once
+         *
+         * @param paths - paths to recursively make
+         * @param mode - mode to create with
+         * @param threads - how many threads to create with
+         * @returns true if it was able to make all of them */
+        static bool makedirs(const std::vector<Path>& paths, mode_t mode=0777,
+                             unsigned threads=1);
+        static bool makedirs(const std::vector<Path>& paths, std::error_code& ec,
+                             mode_t mode=0777, unsigned threads=1);
+
+        /* Recursively remove directories
+         *
+         * Except on Windows, the tree is removed as it's walked, each
+         * directory right after its contents, relative to its parent's
+         * descriptor. Symlinks are removed, not followed. For wide trees,
+         * the subtrees directly under `p` can be removed by several threads
+         * at once.
+         *
+         * @param p - path to recursively remove
+         * @param ignore_errors - keep going after a failure?
+         * @param threads - how many threads to remove with */
+        static bool rmdirs(const Path& p, bool ignore_errors=false,
+                           unsigned threads=1);
+        static bool rmdirs(const Path& p, std::error_code& ec,
+                           bool ignore_errors=false, unsigned threads=1);
+
+        /* List all the paths in a directory
+         *
+         * @param p - path to list items for */
+        static std::vector<Path> listdir(const Path& p);
+        static std::vector<Path> listdir(const Path& p, std::error_code& ec);
+
+        /* List all the paths in a directory, with both the vector and the
+         * paths allocated from the provided memory resource
+         *
+         * @param p - path to list items for
+         * @param resource - memory resource to allocate the results from */
+        static std::pmr::vector<Path> listdir(const Path& p,
+                                              std::pmr::memory_resource* resource);
+
+        /* List all the entries in a directory, along with their types
+         *
+         * The types come from the directory itself where the filesystem
+         * reports them, and so don't cost a `stat` per entry. Only entries of
+         * unknown type are `lstat`d. Like `lstat`, symlinks are reported as
+         * symlinks rather than what they point to.
+         *
+         * @param p - path to list entries for */
+        static std::vector<Entry> scandir(const Path& p);
+        static std::vector<Entry> scandir(const Path& p, std::error_code& ec);
+
+        /* Returns all the paths matching a glob pattern, sorted. See `Glob`
+         * for the syntax, or to stream the matches instead
+         *
+         * @param pattern - the glob pattern to match */
+        static std::vector<Path> glob(const std::string& pattern);
+
+        /* Returns all the files contained in the directory and it's subdirectories
+         *
+         * @param p - path to start searching */
+        static std::vector<Path> recursive_listdir(const Path &p);
+
+        /* Returns all the files contained in the directory and it's
+         * subdirectories, with both the vector and the paths allocated from
+         * the provided memory resource
+         *
+         * @param p - path to start searching
+         * @param resource - memory resource to allocate the results from */
+        static std::pmr::vector<Path> recursive_listdir(const Path &p,
+            std::pmr::memory_resource* resource);
+
+        /* Iterate over the entries in a directory, reading them lazily
+         *
+         * Unlike `scandir`, entries are read one at a time as the iteration
+         * advances, and nothing else is held on to. Stopping early simply
+         * closes the directory.
+         *
+         * @param p - directory to iterate over */
+        static DirectoryRange<DirectoryIterator> iterate(const Path& p);
+
+        /* Iterate over all the entries under a directory, reading them lazily
+         *
+         * Unlike `recursive_listdir`, only the directories on the way to the
+         * current entry are kept open, so memory use doesn't depend on the
+         * size of the tree. To skip a directory's contents, call `prune()`
+         * on the iterator while it's on that directory:
+         *
+         *   DirectoryRange<RecursiveDirectoryIterator> range(Path::walk(p));
+         *   for (auto it = range.begin(); it != range.end(); ++it) {
+         *       if (it->name() == ".git") { it.prune(); }
+         *   }
+         *
+         * @param p - directory to walk
+         * @param follow_symlinks - descend into symlinks to directories? */
+        static DirectoryRange<RecursiveDirectoryIterator> walk(const Path& p,
+            bool follow_symlinks=true);
+
+        /* So that we can write paths out to ostreams */
+        friend std::ostream& operator<<(std::ostream& stream, const Path& p) {
+            return stream << p.path;
+        }
+    private:
+        /* The working directory that we share between threads */
+        struct CwdCache;
+        static CwdCache& cwd_cache();
+
+        /* This thread's copy of the cached working directory */
+        static const Path& cached_cwd();
+        static const Path& cached_cwd(std::error_code& ec);
+
+        /* The error in errno */
+        static std::error_code last_error() {
+            return std::error_code(errno, std::generic_category());
+        }
+
+        /* Print a failure of `what` like `perror` does, leaving errno set */
+        static void complain(const char* what, const std::error_code& ec);
+
+        friend class StatCache;
+        friend class SharedPathCache;
+        friend class DirectoryIterator;
+        friend class RecursiveDirectoryIterator;
+        friend class Snapshot;
+
+        /* The string in a path, view, or anything convertible to a view */
+        template <class T>
+        static std::string_view string_of(const T& p);
+
+        /* Join the segments onto the first, reserving space for all of them */
+        static Path join_segments(const Path& first,
+                                  std::initializer_list<const Path*> segments);
+        static Path join_segments(Path&& first,
+                                  std::initializer_list<const Path*> segments);
+
+        /* Set `result` to the path of a directory entry named `name` within
+         * `base`, keeping its allocator */
+        static void child(const Path& base, const char* name, Path& result);
+
+        /* List the paths in a directory into `results`, which is some kind
+         * of vector of paths */
+        template <class Paths>
+        static void listdir_into(const Path& p, Paths& results,
+                                 std::error_code& ec);
+
+        /* Read the next entry (other than '.' and '..') from an open
+         * directory within `base`. Returns false when there are no more, or
+         * there was an error reading, in which case errno is set */
+        static bool read_entry(DIR* dir, const Path& base, Entry& entry);
+
+#if !defined(_WIN32)
+        /* Stat `name` within the directory open as `fd`, so that only that
+         * one component needs to be resolved */
+        static Status status_at(int fd, const char* name, bool follow_symlinks);
+
+        /* Open the directory `name` within the directory open as `fd` */
+        static DIR* opendir_at(int fd, const char* name, bool follow_symlinks);
+
+        /* Remove `name` within the directory open as `fd`, along with
+         * everything under it. `ec` is set to the first error, if it isn't
+         * already set */
+        static bool remove_at(int fd, const char* name, bool ignore_errors,
+                              std::error_code& ec);
+#endif
+
+        /* Make the directories (or files) named by `paths`, which are
+         * absolute and tidy, setting `ec` to the first error */
+        static bool create_all(std::vector<std::string>& paths, bool files,
+                               mode_t mode, unsigned threads, std::error_code& ec);
+
+        /* The same for the paths as given, sorting them for `create_all` */
+        static bool create_all(const std::vector<Path>& paths, bool files,
+                               mode_t mode, unsigned threads, std::error_code& ec);
+
+#if !defined(_WIN32)
+        /* Make the paths in [first, last), all of which are under the
+         * directory open as `fd`, the first `length` characters of them.
+         * `ec` is set to the first error, if it isn't already set */
+        static bool create_at(int fd, size_t length, std::vector<std::string>& paths,
+                              size_t first, size_t last, bool files, mode_t mode,
+                              std::error_code& ec);
+#endif
+
+        /* A name for a temporary file or directory next to `p` */
+        static std::string temporary_name(const Path& p);
+
+#if !defined(_WIN32)
+        /* Copy the file `source` to `dest`, writing a temporary file first
+         * if it's to be `atomic`. Otherwise, `dest` must not exist */
+        static bool copy_file(const char* source, const char* dest, bool atomic,
+                              std::error_code& ec);
+
+        /* Copy everything from one descriptor to another */
+        static bool copy_data(int source, int dest);
+
+        /* Write all of `size` bytes, despite short writes */
+        static bool write_fully(int fd, const char* data, size_t size);
+
+        /* Give the open file `fd` the mode, owner and times in `st` */
+        static bool copy_metadata(int fd, const struct stat& st);
+
+        /* Make `dest` a symlink to wherever `source` points */
+        static bool copy_symlink(const char* source, const char* dest);
+#endif
+
+        /* Order paths so that everything under a directory comes right
+         * after it, before any of its siblings */
+        static bool segment_less(const std::string& a, const std::string& b);
+
+        /* Get the type of a directory entry, if the filesystem told us.
+         * Returns false if we'd have to stat it to find out */
+        static bool entry_type(const dirent* ent, Status::Type& type);
+
+        /* Our current path */
+        std::pmr::string path;
+    };
+
+    struct Path::CwdCache {
+        CwdCache(): lock(), path(), error(), valid(false), generation(1) {}
+
+        std::mutex lock;
+        Path path;
+        /* Why `path` couldn't be found out, if it couldn't */
+        std::error_code error;
+        bool valid;
+        /* Bumped every time the cache is invalidated */
+        std::atomic<std::uint64_t> generation;
+    };
+
+    /* An entry read from a directory */
+    struct Path::Entry {
+        /* The full path to the entry */
+        Path path;
+        /* What kind of entry this is, without following symlinks */
+        Status::Type type;
+        /* The inode number, where the platform reports it */
+        ino_t inode;
+
+        Entry(): path(), type(Status::not_found), inode(0) {}
+        Entry(const Path& p, Status::Type t, ino_t i): path(p), type(t), inode(i) {}
+
+        /* The name of the entry within its directory */
+        std::string_view name() const { return path.view().filename(); }
+
+        bool is_file() const { return type == Status::file; }
+        bool is_directory() const { return type == Status::directory; }
+        bool is_symlink() const { return type == Status::symlink; }
+    };
+
+    /* Iterates over the entries of a single directory, reading them as it
+     * goes. See `Path::iterate` */
+    class DirectoryIterator {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef Path::Entry value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Path::Entry* pointer;
+        typedef const Path::Entry& reference;
+
+        /* The end iterator */
+        DirectoryIterator(): state() {}
+
+        /* Start reading entries from the provided directory. If it can't be
+         * opened, this is the end iterator
+         *
+         * @param p - directory to read */
+        explicit DirectoryIterator(const Path& p);
+
+        const Path::Entry& operator*() const { return state->entry; }
+        const Path::Entry* operator->() const { return &state->entry; }
+
+        DirectoryIterator& operator++();
+
+        /* Copies of an iterator all reach the end together */
+        bool operator==(const DirectoryIterator& other) const {
+            return state == other.state || (at_end() && other.at_end());
+        }
+        bool operator!=(const DirectoryIterator& other) const { return !(*this == other); }
+
+    private:
+        struct State {
+            State(DIR* d, const Path& b): dir(d), base(b), entry(), done(false) {}
+            State(const State&) = delete;
+            State& operator=(const State&) = delete;
+            ~State() { sys::closedir(dir); }
+
+            DIR* dir;
+            Path base;
+            Path::Entry entry;
+            bool done;
+        };
+
+        bool at_end() const { return !state || state->done; }
+
+        /* Copies of an iterator share the open directory, which is closed
+         * along with the last of them */
+        std::shared_ptr<State> state;
+    };
+
+    /* Iterates over all the entries under a directory, depth first, reading
+     * them as it goes. See `Path::walk`
+     *
+     * The only things held on to are the directories currently being read,
+     * one for each level between the root and the current entry. Each
+     * directory is reported before its contents.
+     *
+     * Except on Windows, subdirectories are opened and entries stat'd
+     * relative to the already-open parent directory (with `openat`,
+     * `fdopendir` and `fstatat`), so each one only costs the kernel a single
+     * path component to resolve. That also means renaming a directory that's
+     * being walked doesn't derail the walk, though the reported paths will
+     * still use the old name. */
+    class RecursiveDirectoryIterator {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef Path::Entry value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Path::Entry* pointer;
+        typedef const Path::Entry& reference;
+
+        /* The end iterator */
+        RecursiveDirectoryIterator(): state() {}
+
+        /* Start walking the provided directory. If it can't be opened, this
+         * is the end iterator
+         *
+         * @param p - directory to walk
+         * @param follow_symlinks - descend into symlinks to directories? */
+        explicit RecursiveDirectoryIterator(const Path& p,
+                                            bool follow_symlinks=true);
+
+        const Path::Entry& operator*() const { return state->entry; }
+        const Path::Entry* operator->() const { return &state->entry; }
+
+        RecursiveDirectoryIterator& operator++();
+
+        /* Don't descend into the current entry, if it's a directory */
+        void prune() { state->descend = false; }
+
+        /* How far below the root the current entry is. Entries directly in
+         * the root have a depth of 0 */
+        size_t depth() const { return state->directories.size() - 1; }
+
+        /* Stat the current entry. Unlike `Path::status`, this doesn't have to
+         * resolve the whole path again
+         *
+         * @param follow_symlinks - `stat` rather than `lstat`? */
+        Path::Status status(bool follow_symlinks=true) const;
+
+#if !defined(_WIN32)
+        /* The descriptor of the directory containing the current entry, for
+         * use with `fstatat`, `unlinkat` and friends. It's owned by the
+         * iterator, and is closed once the walk leaves that directory */
+        int directory_fd() const { return dirfd(state->directories.back().first); }
+#endif
+
+        /* Copies of an iterator all reach the end together */
+        bool operator==(const RecursiveDirectoryIterator& other) const {
+            return state == other.state || (at_end() && other.at_end());
+        }
+        bool operator!=(const RecursiveDirectoryIterator& other) const { return !(*this == other); }
+
+    private:
+        struct State {
+            State(bool follow): directories(), entry(), descend(false),
+                follow_symlinks(follow) {}
+            State(const State&) = delete;
+            State& operator=(const State&) = delete;
+            ~State();
+
+            /* Each of the directories being read, and their paths */
+            std::vector<std::pair<DIR*, Path> > directories;
+            Path::Entry entry;
+            /* Whether to descend into the current entry when we advance */
+            bool descend;
+            bool follow_symlinks;
+        };
+
+        /* Read the next entry, moving up out of finished directories */
+        void advance();
+
+        bool at_end() const { return !state || state->directories.empty(); }
+
+        std::shared_ptr<State> state;
+    };
+
+    /* A range for iterating over directory entries in a range-based for */
+    template <class Iterator>
+    class DirectoryRange {
+    public:
+        explicit DirectoryRange(const Iterator& it): first(it) {}
+
+        Iterator begin() const { return first; }
+        Iterator end() const { return Iterator(); }
+
+    private:
+        Iterator first;
+    };
+
+    /* Walks directory trees with a pool of threads
+     *
+     * Directory reads are mostly waiting on the filesystem, so this keeps
+     * several of them in flight at once. Each thread keeps its own deque of
+     * directories it has yet to read, working from the back of it, and steals
+     * from the front of the others' when it runs out. Like
+     * `Path::recursive_listdir`, the root itself isn't reported, and by
+     * default symlinks to directories are descended into. */
+    class TreeWalker {
+    public:
+        /* @param threads - how many threads to walk with. If 0, one for
+         *                  each hardware thread
+         * @param follow_symlinks - descend into symlinks to directories? */
+        TreeWalker(unsigned threads=0, bool follow_symlinks=true);
+
+        /* The number of threads walks use, including the calling thread */
+        unsigned threads() const { return thread_count; }
+
+        /* Call `callback` with every entry under `root`, as they're found
+         *
+         * The callback is called concurrently from all of the walking
+         * threads, so it needs to be thread-safe. Each directory is passed
+         * to it before anything under it is read. If it throws, the walk
+         * stops and the exception is rethrown from here.
+         *
+         * @param root - directory to walk
+         * @param callback - called with each entry */
+        void walk(const Path& root,
+                  const std::function<void(const Path::Entry&)>& callback) const;
+
+        /* Return all of the paths under `root`
+         *
+         * The paths come out in whatever order the threads found them,
+         * unless they're `sorted`, in which case they're in lexicographic
+         * order and the same from one walk to the next
+         *
+         * @param root - directory to walk
+         * @param sorted - whether to sort the results */
+        std::vector<Path> listdir(const Path& root, bool sorted=false) const;
+
+    private:
+        /* Walk `root`, calling `callback` with the index of the thread that
+         * found each entry, which is in [0, threads()). The callback may take
+         * the path of any entry but a directory or a symlink, which are
+         * still needed once it returns */
+        void run(const Path& root,
+                 const std::function<void(unsigned, Path::Entry&)>& callback) const;
+
+        unsigned thread_count;
+        bool follow_symlinks;
+    };
+
+    /* A cache of path statuses
+     *
+     * Each path is only stat'd the first time it's asked about, and then the
+     * status is remembered until it's explicitly invalidated. It's up to the
+     * caller to invalidate paths they know have changed. This is not safe to
+     * share between threads without external locking. */
+    class StatCache {
+    public:
+        /* @param follow_symlinks - whether to `stat` or `lstat` */
+        explicit StatCache(bool follow_symlinks=true):
+            follow_symlinks(follow_symlinks), entries() {}
+
+        /* Return the status of this path, stat'ing it only if we haven't yet
+         *
+         * @param p - path to look up */
+        Path::Status status(const Path& p);
+
+        /* Forget the status of one path, so the next lookup stats it again
+         *
+         * @param p - path to forget */
+        void invalidate(const Path& p) { entries.erase(p.path); }
+
+        /* Forget everything */
+        void clear() { entries.clear(); }
+
+        /* The number of paths we've cached */
+        size_t size() const { return entries.size(); }
+
+    private:
+        bool follow_symlinks;
+        std::unordered_map<std::pmr::string, Path::Status> entries;
+    };
+
+    /* A cache of normalized paths and path statuses that many threads can
+     * share
+     *
+     * Entries are spread over shards by the hash of their path, each with its
+     * own reader-writer lock. Lookups that hit only take a shared lock, so
+     * threads reading the cache don't wait on each other, and a miss only
+     * locks its shard exclusively for long enough to insert the answer. The
+     * `stat` or the normalizing happens with no lock held, so when two threads
+     * miss on the same path at once, both do the work and the first answer
+     * is kept.
+     *
+     * Like a `StatCache`, statuses are remembered until they're invalidated.
+     * Relative paths are normalized against the working directory, so the
+     * cache needs clearing after changing directory. */
+    class SharedPathCache {
+    public:
+        /* @param shards - how many shards to spread the entries over
+         * @param follow_symlinks - whether to `stat` or `lstat` */
+        explicit SharedPathCache(size_t shards=64, bool follow_symlinks=true):
+            follow_symlinks(follow_symlinks), shards(std::max<size_t>(shards, 1)) {}
+
+        /* Return the path made absolute and sanitized, only working it out
+         * the first time it's asked for
+         *
+         * @param p - path to normalize */
+        Path normalize(const Path& p);
+
+        /* Return the status of this path, stat'ing it only if we haven't yet
+         *
+         * @param p - path to look up */
+        Path::Status status(const Path& p);
+
+        /* Forget about one path, so the next lookup stats it again
+         *
+         * @param p - path to forget */
+        void invalidate(const Path& p);
+
+        /* Forget everything */
+        void clear();
+
+        /* The number of normalized paths and statuses we've cached */
+        size_t size() const;
+
+    private:
+        /* Each on its own cache line, so that readers of different shards
+         * aren't bouncing the same line between them */
+        struct alignas(64) Shard {
+            Shard(): lock(), normalized(), statuses() {}
+
+            mutable std::shared_mutex lock;
+            std::unordered_map<std::pmr::string, Path> normalized;
+            std::unordered_map<std::pmr::string, Path::Status> statuses;
+        };
+
+        Shard& shard(const Path& p) {
+            return shards[std::hash<std::string_view>()(p.path) % shards.size()];
+        }
+
+        bool follow_symlinks;
+        std::vector<Shard> shards;
+    };
+
+    /* A compact store for large sets of paths
+     *
+     * Paths are interned as ids into a trie of their segments, where each
+     * node only knows its parent and its own name, and each distinct name is
+     * stored once. So a million files in one directory share one copy of
+     * the directory's path, and a million files named `index.html` share one
+     * copy of the name.
+     *
+     * Paths are interned by their non-empty segments, other than the leading
+     * one of an absolute path. So `a//b/` and `a/b` are the same path here.
+     * The empty path is always id 0. This is not safe to share between
+     * threads without external locking. */
+    class PathTable {
+    public:
+        typedef std::uint32_t id_type;
+
+        /* Returned by `find` for paths that aren't in the table */
+        static constexpr id_type npos = static_cast<id_type>(-1);
+
+        PathTable();
+
+        /* Add a path to the table, returning its id. If it's already in the
+         * table, this returns the existing id
+         *
+         * @param p - path to add */
+        id_type insert(const PathView& p);
+
+        /* Add a path to the table by its parent and name
+         *
+         * @param parent - id of the directory containing the path
+         * @param name - the last segment of the path */
+        id_type insert(id_type parent, std::string_view name);
+
+        /* Add `root` and everything under it to the table, straight from a
+         * walk. Returns the id of the root
+         *
+         * @param root - directory to walk
+         * @param follow_symlinks - descend into symlinks to directories? */
+        id_type insert_tree(const Path& root, bool follow_symlinks=true);
+
+        /* Find the id of a path, or `npos` if it's not in the table
+         *
+         * @param p - path to look for */
+        id_type find(const PathView& p) const;
+
+        /* The id of the path without its last segment. The empty path is its
+         * own parent */
+        id_type parent(id_type id) const { return nodes[id].parent; }
+
+        /* The last segment of the path */
+        std::string_view filename(id_type id) const { return names[nodes[id].name]; }
+
+        /* How many segments there are in the path */
+        size_t depth(id_type id) const;
+
+        /* Build the full path */
+        Path path(id_type id) const;
+
+        /* The number of paths in the table, including the empty one */
+        size_t size() const { return nodes.size(); }
+
+        /* The number of distinct segment names in the table */
+        size_t name_count() const { return names.size(); }
+
+    private:
+        struct Node {
+            id_type parent;
+            std::uint32_t name;
+        };
+
+        /* Find or store a segment name */
+        std::uint32_t intern(std::string_view name);
+
+        /* The key for looking up a child by its parent and name */
+        static std::uint64_t child_key(id_type parent, std::uint32_t name) {
+            return (static_cast<std::uint64_t>(parent) << 32) | name;
+        }
+
+        /* Call `callback` with each segment of `p` that gets interned */
+        template <class Callback>
+        static bool each_segment(const PathView& p, Callback callback);
+
+        /* Names are copied into fixed blocks, so that the views into them
+         * stay valid as more are added */
+        static constexpr size_t block_size = 64 * 1024;
+        std::vector<std::unique_ptr<char[]> > blocks;
+        size_t block_used;
+
+        std::vector<std::string_view> names;
+        std::unordered_map<std::string_view, std::uint32_t> name_ids;
+
+        std::vector<Node> nodes;
+        std::unordered_map<std::uint64_t, id_type> children;
+    };
+
+    /* A compiled glob pattern
+     *
+     * Patterns are split into segments up front, and matched against the
+     * filesystem one segment at a time, so only directories that can still
+     * match are ever read. Segments without any wildcards are checked with a
+     * single `stat` rather than by reading their directory.
+     *
+     * Within a segment, `*` matches any run of characters, `?` matches any
+     * one character and `[...]` matches one character from a set (`[a-z]`,
+     * or `[!...]` for the complement). A segment that is just `**` matches
+     * zero or more directories. As with the shell, names starting with `.`
+     * are only matched by a pattern that starts with a literal `.`, and `**`
+     * doesn't descend into them. Except on Windows, where `\` is also a
+     * separator, a backslash matches the character after it literally. A
+     * trailing separator matches only directories. */
+    class Glob {
+    public:
+        /* @param pattern - the glob pattern to compile */
+        explicit Glob(std::string_view pattern);
+
+        /* Does the path match the pattern? This only looks at the path
+         * itself, not the filesystem
+         *
+         * @param p - path to match */
+        bool match(const PathView& p) const;
+
+        /* Call `callback` with each path on the filesystem that matches, as
+         * they're found. Stops early if the callback returns false. Paths
+         * come out in directory order, and a pattern with more than one
+         * `**` can produce the same path more than once
+         *
+         * @param callback - called with each matching path */
+        void find(const std::function<bool(const Path&)>& callback) const;
+
+        /* All the paths on the filesystem that match, sorted */
+        std::vector<Path> find() const;
+
+        const std::string& pattern() const { return text; }
+
+    private:
+        friend class PathMatcher;
+
+        struct Segment {
+            enum Kind { literal, wildcard, globstar };
+
+            Segment(Kind k, std::string t): kind(k), text(std::move(t)) {}
+
+            Kind kind;
+            /* With any escapes removed, for literals */
+            std::string text;
+        };
+
+        static bool is_separator(char c);
+
+        /* If the element of `pattern` at `index` matches `c`, the index of
+         * the next element, and otherwise npos */
+        static size_t match_char(std::string_view pattern, size_t index, char c);
+
+        /* Does the pattern start with a literal '.'? */
+        static bool explicit_dot(std::string_view pattern);
+
+        /* Match the segment `name` against a single wildcard segment */
+        static bool match_segment(std::string_view pattern, std::string_view name);
+
+        /* The remaining segments from `index` against the remaining names */
+        bool match_from(size_t index, const std::vector<std::string_view>& names,
+                        size_t name_index) const;
+
+        /* Look for the segments from `index` onwards in the existing
+         * directory `prefix`. Returns false to stop */
+        bool search(const std::string& prefix, size_t index,
+                    const std::function<bool(const Path&)>& callback) const;
+
+        /* Report a match, marking directories if the pattern asks for them */
+        bool emit(const std::string& path, bool directory,
+                  const std::function<bool(const Path&)>& callback) const;
+
+        std::string text;
+        std::vector<Segment> segments;
+        bool absolute;
+        bool directories_only;
+    };
+
+    /* Matches paths against many glob patterns at once
+     *
+     * The patterns are compiled into a single automaton over path segments,
+     * sharing any prefix they have in common, so matching a path costs one
+     * step per segment rather than a pass over every pattern. Patterns of the
+     * form `*.ext` are looked up by their suffix instead of being tried one
+     * at a time. The syntax is the same as `Glob`'s. */
+    class PathMatcher {
+    public:
+        PathMatcher();
+
+        /* Add a pattern, returning its index
+         *
+         * @param pattern - the glob pattern to add */
+        size_t add(std::string_view pattern);
+
+        /* The number of patterns added */
+        size_t size() const { return patterns.size(); }
+
+        /* The pattern with the provided index */
+        const std::string& pattern(size_t index) const { return patterns[index]; }
+
+        /* Return the indices of all the patterns that match, in order. Like
+         * `Glob::match`, this only looks at the path itself
+         *
+         * @param p - path to match */
+        std::vector<size_t> match(const PathView& p) const;
+
+        /* Does any pattern match?
+         *
+         * @param p - path to match */
+        bool matches(const PathView& p) const;
+
+        /* Walk `root`, calling `callback` with each entry whose path relative
+         * to `root` matches, along with the indices of the patterns it
+         * matches. Directories that nothing could match under aren't read at
+         * all. Stops early if the callback returns false
+         *
+         * @param root - directory to walk
+         * @param callback - called with each matching entry
+         * @param follow_symlinks - descend into symlinks to directories? */
+        void walk(const Path& root,
+                  const std::function<bool(const Path::Entry&, const std::vector<size_t>&)>& callback,
+                  bool follow_symlinks=true) const;
+
+    private:
+        typedef std::uint32_t state_type;
+        static constexpr state_type npos = static_cast<state_type>(-1);
+
+        struct Node {
+            Node(): literals(), suffixes(), wildcards(), globstar(npos),
+                loops(false), accepts() {}
+
+            std::map<std::string, state_type, std::less<> > literals;
+            /* For `*` followed by a literal suffix */
+            std::map<std::string, state_type, std::less<> > suffixes;
+            std::vector<std::pair<std::string, state_type> > wildcards;
+            /* The state for a `**` following this one */
+            state_type globstar;
+            /* Whether this is a `**`, and so matches any number of names */
+            bool loops;
+            /* The patterns that end here, and whether they only match
+             * directories */
+            std::vector<std::pair<size_t, bool> > accepts;
+        };
+
+        /* Add the states reachable from `states` without consuming a name */
+        void closure(std::vector<state_type>& states) const;
+
+        /* The states reached from `from` by consuming `name` */
+        void step(const std::vector<state_type>& from, std::string_view name,
+                  std::vector<state_type>& to) const;
+
+        /* Collect the patterns accepted in any of `states` */
+        void accepted(const std::vector<state_type>& states, bool directory,
+                      std::vector<size_t>& results) const;
+
+        /* Could anything further below match? */
+        bool can_descend(const std::vector<state_type>& states) const;
+
+        /* The state for a segment following `from`, adding it if need be */
+        state_type transition(state_type from, const Glob::Segment& segment);
+
+        std::vector<std::string> patterns;
+        /* The first is where relative paths start, the second absolute ones */
+        std::vector<Node> nodes;
+        /* The lengths of all the suffixes, across all of the nodes */
+        std::vector<size_t> suffix_lengths;
+    };
+
+    /* Runs filesystem operations on a bounded pool of threads
+     *
+     * Each operation returns a std::future for its result, so that callers
+     * like event loops don't have to block on a slow filesystem. Operations
+     * wait in a queue of limited size for a free thread, and submitting more
+     * than fits blocks until there's room again. Batches of operations are
+     * queued all at once. Pending operations are finished before the pool is
+     * destroyed. */
+    class AsyncFilesystem {
+    public:
+        /* @param threads - how many operations to run at once. If 0, four
+         *                  for each hardware thread, since they spend most
+         *                  of their time waiting on the filesystem
+         * @param capacity - how many operations can be queued */
+        explicit AsyncFilesystem(unsigned threads=0, size_t capacity=65536);
+        ~AsyncFilesystem();
+
+        AsyncFilesystem(const AsyncFilesystem&) = delete;
+        AsyncFilesystem& operator=(const AsyncFilesystem&) = delete;
+
+        /* The number of threads operations run on */
+        unsigned threads() const { return static_cast<unsigned>(workers.size()); }
+
+        /* The number of operations yet to be started */
+        size_t pending() const;
+
+        /* Run any callable on the pool. If it throws, the exception comes
+         * out of the future
+         *
+         * @param f - what to run */
+        template <class F>
+        std::future<std::invoke_result_t<F> > submit(F f);
+
+        /* Run `f` on each of the paths, queueing them all at once
+         *
+         * @param paths - paths to run with
+         * @param f - what to run with each of them */
+        template <class F>
+        std::vector<std::future<std::invoke_result_t<F, const Path&> > >
+            submit_all(const std::vector<Path>& paths, F f);
+
+        /* Like the Path methods of the same names */
+        std::future<bool> exists(const Path& p);
+        std::future<bool> is_file(const Path& p);
+        std::future<bool> is_directory(const Path& p);
+        std::future<size_t> size(const Path& p);
+        std::future<Path::Status> status(const Path& p);
+        std::future<std::vector<Path> > listdir(const Path& p);
+
+        /* Like the Path methods of the same names, taking a
+         * `std::error_code&`. Nothing is printed, and the future holds the
+         * error, which is empty on success */
+        std::future<std::error_code> touch(const Path& p, mode_t mode=0777);
+        std::future<std::error_code> move(const Path& source, const Path& dest,
+                                          bool mkdirs=false);
+        std::future<std::error_code> rm(const Path& p);
+        std::future<std::error_code> makedirs(const Path& p, mode_t mode=0777);
+
+        /* The statuses of all of the paths */
+        std::vector<std::future<Path::Status> > status(const std::vector<Path>& paths);
+
+    private:
+        typedef std::function<void()> Task;
+
+        /* Queue the tasks, waiting for room as need be */
+        void enqueue(std::vector<Task>& tasks);
+
+        /* Run tasks until we're told to stop and there are none left */
+        void work();
+
+        /* Whether the calling thread is one of ours. They never wait for
+         * room in the queue, since that could wait forever */
+        bool is_worker() const;
+
+        mutable std::mutex lock;
+        std::condition_variable not_empty;
+        std::condition_variable not_full;
+        std::deque<Task> queue;
+        size_t capacity;
+        bool stopping;
+        std::vector<std::thread> workers;
+    };
+
+    /* A read-only memory mapping of a whole file
+     *
+     * The file's contents can be read through `view` without copying them
+     * into a buffer first. The mapping is released when this is destroyed,
+     * and doesn't keep the file open. Writes to the file by others may or
+     * may not show up in the mapping. */
+    class MappedFile {
+    public:
+        /* Hints about how the mapping is going to be read */
+        enum Advice {
+            normal,
+            sequential,
+            random,
+            /* It'll be needed soon, so start reading it in */
+            willneed
+        };
+
+        /* Nothing mapped */
+        MappedFile(): address(NULL), length(0), opened(false) {}
+
+        /* Map the whole file. Check `is_open` to see whether it worked
+         *
+         * @param p - file to map
+         * @param advice - how it's going to be read */
+        explicit MappedFile(const Path& p, Advice advice=normal);
+
+        MappedFile(MappedFile&& other);
+        MappedFile& operator=(MappedFile&& other);
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile() { close(); }
+
+        /* Whether the file was mapped. Empty files count, even though
+         * there's nothing to map */
+        bool is_open() const { return opened; }
+
+        const char* data() const { return address; }
+        size_t size() const { return length; }
+        std::string_view view() const { return std::string_view(address, length); }
+
+        /* Change how the mapping is expected to be read */
+        bool advise(Advice advice);
+
+        /* Release the mapping */
+        void close();
+
+    private:
+        char* address;
+        size_t length;
+        bool opened;
+    };
+
+    /* A compact record of a tree, to compare the tree against later
+     *
+     * Everything under the root is kept, in the order it was walked, along
+     * with the status it was `lstat`ed with. An entry's index is its id, and
+     * its descendants are the entries after it up to its `end`, so the whole
+     * thing is a few flat arrays that are cheap to save and load. Symlinks
+     * aren't followed. */
+    class Snapshot {
+    public:
+        /* Something that differs between a snapshot and the tree */
+        struct Change {
+            enum Kind {
+                added,
+                removed,
+                /* Its type or inode changed, or for anything but directories,
+                 * its size or mtime did */
+                modified
+            };
+
+            Kind kind;
+            Path path;
+            /* What it is now, or what it was if it's been removed */
+            Path::Status::Type type;
+        };
+
+        /* A snapshot of nothing */
+        Snapshot(): root_path(), nodes(), names() {}
+
+        /* Walk `root` and record everything under it */
+        explicit Snapshot(const Path& root);
+
+        /* The absolute path that was walked */
+        const Path& root() const { return root_path; }
+
+        /* How many entries were recorded, including the root */
+        size_t size() const { return nodes.size(); }
+
+        /* The recorded status of `relative`, a path within the root, which
+         * is not-found if it wasn't recorded */
+        Path::Status find(const PathView& relative) const;
+
+        /* Compare the tree as it is now with this snapshot
+         *
+         * A directory's mtime changes whenever something is added to it,
+         * removed from it or renamed within it, so directories whose mtime
+         * and inode haven't changed aren't read again, and their recorded
+         * listing is used instead. Their entries are still `lstat`ed, unless
+         * `stat_files` is false, in which case only their subdirectories are,
+         * and files changed in place go unnoticed.
+         *
+         * Adding or removing a directory reports everything under it too.
+         * Changes come in walk order, so parents come before their children */
+        std::vector<Change> diff(bool stat_files=true) const;
+
+        /* Like `diff`, but also bring the snapshot up to date */
+        std::vector<Change> update(bool stat_files=true);
+
+        /* Like `update`, but only for `relative`, a directory within the
+         * root. Its entries are compared, but of its subdirectories, only
+         * new ones are read, and the rest keep what was recorded under them.
+         * If it isn't recorded as a directory, or isn't one any more, the
+         * nearest ancestor that is is updated instead.
+         *
+         * This is for when it's known which directories have changed, for
+         * example from filesystem events, and costs only as much as they do */
+        std::vector<Change> update_directory(const PathView& relative,
+                                             bool stat_files=true);
+
+        /* A compact binary form of the snapshot, and back again */
+        std::string serialize() const;
+        static bool deserialize(std::string_view data, Snapshot& result);
+
+        /* Atomically write the serialized snapshot to `p`, and read it back */
+        bool save(const Path& p) const { return Path::write_all(p, serialize()); }
+        static bool load(const Path& p, Snapshot& result);
+
+    private:
+        struct Node {
+            /* Where the name is in `names`. The root's is empty */
+            size_t name_offset;
+            size_t name_length;
+            /* One past its last descendant */
+            size_t end;
+            Path::Status status;
+        };
+
+        /* The state of a comparison as it walks the tree */
+        struct Scan;
+
+        std::string_view name(size_t index) const {
+            return std::string_view(names).substr(
+                nodes[index].name_offset, nodes[index].name_length);
+        }
+
+        /* Add an entry, which needs to be closed once its descendants are */
+        size_t open(std::string_view name, const Path::Status& status);
+        void close(size_t index) { nodes[index].end = nodes.size(); }
+
+        /* Walk `root`, comparing it with this snapshot and recording it in
+         * `next`, and return the changes if they're to be `reported` */
+        std::vector<Change> compare(const Path& root, Snapshot& next,
+                                    bool stat_files, bool reported) const;
+
+        /* Compare the contents of the directory open as `dir` with the
+         * children of `index`, which is `npos` if it wasn't recorded. If it's
+         * `unchanged`, its recorded listing is used rather than reading it.
+         * This goes all the way down, with a stack of its own rather than by
+         * recursing, and closes `dir` when it's done */
+        void scan(Scan& state, size_t index, bool unchanged, DIR* dir) const;
+
+        /* Find the entries of the directory `state` has just descended into,
+         * reporting those that have gone */
+        void list(Scan& state) const;
+
+        /* Report `index` and everything under it as removed */
+        void removed(Scan& state, size_t index) const;
+
+        /* Record everything under `index` in `next`, as it was, right after
+         * `index` itself */
+        void keep(Snapshot& next, size_t index) const;
+
+        /* Replace `index` and everything under it with `replacement` */
+        void splice(size_t index, const Snapshot& replacement);
+
+        /* Whether an entry is unchanged, and whether a directory's listing is */
+        static bool same(const Path::Status& before, const Path::Status& after);
+        static bool same_listing(const Path::Status& before, const Path::Status& after);
+
+        /* Write and read `bytes` of a little endian integer */
+        static void put(std::string& out, std::uint64_t value, size_t bytes);
+        static bool get(std::string_view& in, std::uint64_t& value, size_t bytes);
+
+        static constexpr size_t npos = static_cast<size_t>(-1);
+        /* How many directories a scan keeps open, one for each level. Below
+         * that, entries are looked up by their whole path instead, so that
+         * deep trees don't run out of descriptors */
+        static constexpr size_t max_open = 64;
+        static constexpr const char* magic = "apathy snapshot 1\n";
+
+        Path root_path;
+        std::vector<Node> nodes;
+        std::string names;
+    };
+
+    /* Reports changes under a set of roots as they happen
+     *
+     * On Linux, every directory under a root gets an inotify watch as the
+     * walker finds it, and directories that appear later are watched and
+     * walked as they're created. Each root also keeps a `Snapshot`, so that
+     * when the kernel's queue overflows and events are lost, diffing against
+     * it finds what changed, only re-reading directories whose mtime did.
+     * Elsewhere, and for roots that run out of watches, the roots are polled
+     * by diffing their snapshots instead. Before each batch is returned, the
+     * directories that had events are updated in the snapshot, so it costs
+     * as much as what changed, and neither an overflow nor switching to
+     * polling reports again what's already been reported.
+     *
+     * Events come in batches from `wait`, coalesced so that each path is
+     * reported at most once per batch with its net change. A directory that's
+     * moved away is reported on its own, without what was under it. This is
+     * not safe to share between threads. */
+    class Watcher {
+    public:
+        /* A path that's been added, removed or modified */
+        typedef Snapshot::Change Event;
+
+        /* @param latency - once something changes, how long to wait for
+         *                  more changes to batch with it. Polled roots are
+         *                  also diffed this often */
+        explicit Watcher(std::chrono::milliseconds latency=std::chrono::milliseconds(50));
+        ~Watcher();
+
+        Watcher(const Watcher&) = delete;
+        Watcher& operator=(const Watcher&) = delete;
+
+        /* Start watching everything under `root`. Returns false if it's not
+         * a directory
+         *
+         * @param root - directory to watch
+         * @param threads - how many threads to walk it with. If 0, one for
+         *                  each hardware thread */
+        bool add(const Path& root, unsigned threads=1);
+
+        /* Wait up to `timeout` for something to change, and then up to the
+         * latency for anything else to, returning the batch. It's empty if
+         * nothing changed in time */
+        std::vector<Event> wait(std::chrono::milliseconds timeout);
+
+        /* How many roots are being watched, and how many of those are being
+         * polled rather than watched */
+        size_t roots() const { return watched.size(); }
+        size_t polled() const;
+
+        /* How many directories are being watched */
+        size_t watches() const;
+
+    private:
+        struct Root {
+            Path path;
+            Snapshot snapshot;
+            bool polled;
+            /* The directories that have had events since the snapshot was
+             * updated, each with a trailing separator */
+            std::vector<std::string> dirty;
+        };
+
+        /* Events waiting to be returned, coalesced by path */
+        class Batch {
+        public:
+            Batch(): events(), positions() {}
+
+            void add(Event::Kind kind, const std::string& path, Path::Status::Type type);
+            bool empty() const { return positions.empty(); }
+            std::vector<Event> take();
+
+        private:
+            /* Those that have been cancelled out have an empty path */
+            std::vector<Event> events;
+            std::unordered_map<std::string, size_t> positions;
+        };
+
+        /* Diff the polled roots, or with `all`, every root */
+        void rescan(Batch& batch, bool all);
+
+        /* Whether `path` is `directory` or somewhere under it */
+        static bool within(const std::string& path, const std::string& directory);
+
+#if defined(__linux__)
+        /* Watch `root` and every directory under it, reporting everything
+         * under it as added if there's a `batch`. False if we ran out of
+         * watches */
+        bool watch(const std::string& root, Batch* batch, unsigned threads);
+
+        /* Stop watching `path` and everything under it */
+        void unwatch(const std::string& path);
+
+        /* Read all of the events that are ready */
+        void read_events(Batch& batch);
+
+        /* Switch the root that `path` is in over to polling */
+        void poll_instead(const std::string& path, Batch& batch);
+
+        /* Note that something changed in `directory` */
+        void mark(const std::string& directory);
+
+        /* Bring the dirty directories in `root`'s snapshot up to date,
+         * adding anything we hadn't heard about yet to `batch` */
+        void sync(Root& root, Batch& batch);
+
+        int fd;
+        /* The path of each watched directory, and the other way around */
+        std::unordered_map<int, std::string> directories;
+        std::map<std::string, int> descriptors;
+#endif
+
+        std::chrono::milliseconds latency;
+        std::vector<Root> watched;
+    };
+
+    /* A path that remembers where its segments are
+     *
+     * `Path` works things out from its string each time it's asked. This
+     * answers the same questions, but the first time any of them needs the
+     * segments, it finds all of the separators and the last dot in one pass
+     * and keeps their positions, so that after that `filename`, `extension`,
+     * `stem`, `parent` and `segment` are all O(1). Paths of up to
+     * `inline_capacity` bytes are kept inline rather than allocated, which
+     * keeps the whole thing to two cache lines, and the hash is kept once
+     * it's computed. Longer ones, like many object store keys, take one
+     * allocation. Changing the path forgets all of it.
+     *
+     * Paths longer than 64KB, or with more than `max_separators` separators,
+     * are still fine, but they're looked through on every query the way
+     * `Path` does. Since even const queries fill the cache in, this is not
+     * safe to share between threads without external locking. */
+    class IndexedPath {
+    public:
+        /* Paths up to this long don't allocate */
+        static constexpr size_t inline_capacity = 64;
+        /* How many separators are remembered */
+        static constexpr size_t max_separators = 16;
+
+        /* Only the first `length` bytes of `buffer` and `separator_count`
+         * separators are ever read, so the rest are left uninitialized */
+        IndexedPath(): heap(), length(0), hash_value(0), state(unknown),
+            hashed(false), separator_count(0), last_dot(none) {}
+        IndexedPath(const PathView& p): IndexedPath() { assign(p.string()); }
+        IndexedPath(const Path& p): IndexedPath(p.view()) {}
+        IndexedPath(const char* p): IndexedPath(PathView(p)) {}
+        IndexedPath(const std::string& p): IndexedPath(PathView(p)) {}
+
+        IndexedPath(const IndexedPath& other);
+        IndexedPath(IndexedPath&& other) noexcept;
+        IndexedPath& operator=(const IndexedPath& other);
+        IndexedPath& operator=(IndexedPath&& other) noexcept;
+        IndexedPath& operator=(const PathView& p) { assign(p.string()); return *this; }
+
+        /* The path itself */
+        const char* data() const { return heap ? heap.get() : buffer; }
+        std::string_view string() const { return std::string_view(data(), length); }
+        PathView view() const { return PathView(string()); }
+        Path path() const { return Path(string()); }
+
+        bool operator==(const IndexedPath& other) const;
+        bool operator!=(const IndexedPath& other) const { return !(*this == other); }
+        bool operator<(const IndexedPath& other) const { return view() < other.view(); }
+        bool operator>(const IndexedPath& other) const { return view() > other.view(); }
+        bool operator<=(const IndexedPath& other) const { return view() <= other.view(); }
+        bool operator>=(const IndexedPath& other) const { return view() >= other.view(); }
+
+        /* The same as the `Path` methods of the same names */
+        bool is_absolute() const { return view().is_absolute(); }
+        bool trailing_slash() const { return view().trailing_slash(); }
+        std::string_view filename() const;
+        std::string_view extension() const;
+        PathView stem() const;
+        IndexedPath parent() const;
+
+        /* How many segments there are, and each of them. These are the same
+         * ones that `Path::split` gives */
+        size_t segments() const;
+        std::string_view segment(size_t i) const;
+
+        /* A hash of the string, computed the first time it's needed */
+        size_t hash() const;
+
+        /* Modify the path, the same as the `Path` methods of the same names */
+        IndexedPath& append(const PathView& segment);
+        IndexedPath& sanitize();
+        IndexedPath& trim();
+        IndexedPath& directory();
+
+        friend std::ostream& operator<<(std::ostream& stream, const IndexedPath& p) {
+            return stream << p.string();
+        }
+
+    private:
+        enum State: std::uint8_t {
+            /* Not looked at yet */
+            unknown,
+            indexed,
+            /* Too long or too deep to remember */
+            unindexable
+        };
+
+        /* Replace the contents, forgetting everything about the old ones */
+        void assign(std::string_view p);
+        void forget();
+
+        /* Find the separators and last dot, if we haven't. False if the
+         * path is too big to remember them */
+        bool index() const;
+
+        /* Where the last segment starts */
+        size_t last_segment() const {
+            return separator_count ? separators[separator_count - 1] + 1 : 0;
+        }
+
+        static constexpr std::uint16_t none = 0xffff;
+
+        std::unique_ptr<char[]> heap;
+        size_t length;
+
+        mutable size_t hash_value;
+        mutable State state;
+        mutable bool hashed;
+        mutable std::uint16_t separator_count;
+        mutable std::uint16_t last_dot;
+        mutable std::uint16_t separators[max_separators];
+
+        char buffer[inline_capacity];
+    };
+
+    /* A path in the form `equivalent` compares, along with its hash
+     *
+     * `equivalent` makes both paths absolute and sanitizes them for every
+     * comparison. A key does that once, and hashes the result, so finding
+     * which of a large set of paths are equivalent is one pass through a
+     * hash set of keys. On Windows, keys are lowercased too, since that's
+     * how `equivalent` compares there. */
+    class PathKey {
+    public:
+        explicit PathKey(const Path& p);
+
+        /* The absolute, sanitized path */
+        const Path& path() const { return key; }
+        size_t hash() const { return hash_value; }
+
+        bool operator==(const PathKey& other) const {
+            return hash_value == other.hash_value && key == other.key;
+        }
+        bool operator!=(const PathKey& other) const { return !(*this == other); }
+        bool operator<(const PathKey& other) const { return key < other.key; }
+
+        /* The first of each set of equivalent paths, in their original order */
+        static std::vector<Path> unique(const std::vector<Path>& paths);
+
+    private:
+        Path key;
+        size_t hash_value;
+    };
+
+    /* A path of at most `Capacity` characters, kept inline, whose string
+     * operations all work at compile time
+     *
+     * Paths that are known up front, like resource directories under an
+     * install prefix, can be joined and sanitized as constants instead of on
+     * every request. They convert to a `std::string_view`, so a `Path` can be
+     * made from one with a single copy:
+     *
+     *     constexpr auto icons = FixedPath<64>("share/app/") << "./icons//";
+     *     Path p(FixedPath<64>(icons).sanitize());
+     *
+     * Each operation does what the `Path` one of the same name does. Going
+     * over the capacity throws `std::length_error`, which at compile time
+     * just means the constant won't compile. */
+    template <size_t Capacity>
+    class FixedPath {
+    public:
+        constexpr FixedPath(): buffer(), length(0) {}
+        constexpr FixedPath(std::string_view p);
+
+        /* From a path with a different capacity */
+        template <size_t Other>
+        constexpr FixedPath(const FixedPath<Other>& other): FixedPath(other.string()) {}
+
+        /* The most characters the path can hold */
+        static constexpr size_t capacity() { return Capacity; }
+
+        /* The path, which is also always null-terminated */
+        constexpr std::string_view string() const { return std::string_view(buffer, length); }
+        constexpr const char* c_str() const { return buffer; }
+        constexpr operator std::string_view() const { return string(); }
+        PathView view() const { return PathView(string()); }
+
+        friend constexpr bool operator==(const FixedPath& a, const FixedPath& b) {
+            return a.string() == b.string();
+        }
+        friend constexpr bool operator!=(const FixedPath& a, const FixedPath& b) {
+            return !(a == b);
+        }
+
+        /* Append the provided segment, like `Path::append` */
+        constexpr FixedPath& append(std::string_view segment) &;
+        constexpr FixedPath append(std::string_view segment) && { append(segment); return *this; }
+        constexpr FixedPath& operator<<(std::string_view segment) & { return append(segment); }
+        constexpr FixedPath operator<<(std::string_view segment) && { append(segment); return *this; }
+
+        /* Join any number of segments into a new path */
+        template <class... Segments>
+        static constexpr FixedPath join(std::string_view first, const Segments&... rest);
+
+        /* Clean up repeated separators and evaluate '.' and '..' */
+        constexpr FixedPath& sanitize() &;
+        constexpr FixedPath sanitize() && { sanitize(); return *this; }
+
+        /* Remove trailing separators, and then make sure there's exactly one */
+        constexpr FixedPath& trim() &;
+        constexpr FixedPath trim() && { trim(); return *this; }
+        constexpr FixedPath& directory() &;
+        constexpr FixedPath directory() && { directory(); return *this; }
+
+        constexpr std::string_view filename() const;
+        constexpr std::string_view extension() const;
+        constexpr FixedPath stem() const;
+        constexpr bool is_absolute() const;
+        constexpr bool trailing_slash() const;
+
+        friend std::ostream& operator<<(std::ostream& stream, const FixedPath& p) {
+            return stream << p.string();
+        }
+
+    private:
+        /* Add `s` to the end, converting separators as the constructor does */
+        constexpr void write(std::string_view s);
+
+        char buffer[Capacity + 1];
+        size_t length;
+    };
+
+    /* So that `FixedPath root("/usr/share/")` holds just what it's given */
+    template <size_t N>
+    FixedPath(const char (&)[N]) -> FixedPath<N - 1>;
+
+    /**************************************************************************
+     * PathView
+     *************************************************************************/
+    inline PathView::iterator& PathView::iterator::operator++() {
+        if (stop >= path.size()) {
+            start = stop = path.size() + 1;
+            return *this;
+        }
+
+        start = stop + 1;
+        stop = path.find(separator, start);
+        if (stop == std::string_view::npos) {
+            stop = path.size();
+        }
+        return *this;
+    }
+
+    inline PathView::iterator& PathView::iterator::operator--() {
+        /* Stepping back from the end lands on the last segment */
+        stop = (start > path.size()) ? path.size() : start - 1;
+        start = 0;
+        if (stop > 0) {
+            size_t pos = scan::find_last(path.substr(0, stop), separator);
+            if (pos != std::string_view::npos) {
+                start = pos + 1;
+            }
+        }
+        return *this;
+    }
+
+    inline PathView::iterator PathView::begin() const {
+        if (path.empty()) {
+            return end();
+        }
+
+        size_t stop = path.find(separator);
+        if (stop == std::string_view::npos) {
+            stop = path.size();
+        }
+        return iterator(path, 0, stop);
+    }
+
+    inline int PathView::compare(const PathView& other) const {
+        size_t length = std::min(path.size(), other.path.size());
+        size_t i = std::mismatch(path.begin(), path.begin() + length,
+                                 other.path.begin()).first - path.begin();
+        if (i == length) {
+            return path.size() < other.path.size() ? -1 :
+                   path.size() > other.path.size() ? 1 : 0;
+        }
+
+        unsigned char x = path[i] == separator ? 0 : path[i];
+        unsigned char y = other.path[i] == separator ? 0 : other.path[i];
+        return x < y ? -1 : 1;
+    }
+
+    inline std::string_view PathView::filename() const {
+        size_t pos = scan::find_last(path, separator);
+        if (pos != std::string_view::npos) {
+            return path.substr(pos + 1);
+        }
+        return std::string_view();
+    }
+
+    inline std::string_view PathView::extension() const {
+        /* Make sure we only look in the filename, and not the path */
+        std::string_view name = filename();
+        size_t pos = scan::find_last(name, '.');
+        if (pos != std::string_view::npos) {
+            return name.substr(pos + 1);
+        }
+        return std::string_view();
+    }
+
+    inline PathView PathView::stem() const {
+        /* Only look for the dot in the filename, so we only scan once */
+        size_t sep_pos = scan::find_last(path, separator);
+        size_t name_pos = (sep_pos == std::string_view::npos) ? 0 : sep_pos + 1;
+        size_t dot_pos = scan::find_last(path.substr(name_pos), '.');
+        if (dot_pos == std::string_view::npos) {
+            return *this;
+        }
+        return PathView(path.substr(0, name_pos + dot_pos));
+    }
+
+    inline bool PathView::is_absolute() const {
+#if defined(_WIN32)
+        return path.size() >= 2 && path[1] == windows_drive_separator;
+#else
+        return path.size() && path[0] == separator;
+#endif
+    }
+
+    inline bool PathView::trailing_slash() const {
+#if defined(_WIN32)
+        return path.size() && (path[path.length() - 1] == windows_separator
+                               || path[path.length() - 1] == posix_separator);
+#else
+        return path.size() && path[path.length() - 1] == separator;
+#endif
+    }
+
+    inline Path::Path(const std::string &p):
+        path(p.data(), p.size())
+    {
+#if defined(_WIN32)
+        std::replace(path.begin(), path.end(), posix_separator, windows_separator);
+        //FIXME: Deal with illegal paths on windows, like trying to pass posix paths: /home/meh/r
+#endif
+    }
+
+    inline Path::Path(const allocator_type& alloc): path(alloc) {}
+
+    template <class T, class>
+    inline Path::Path(const T& p, const allocator_type& alloc):
+        path(std::string_view(p), alloc)
+    {
+#if defined(_WIN32)
+        std::replace(path.begin(), path.end(), posix_separator, windows_separator);
+#endif
+    }
+
+    /* Constructor */
+    template <class T, class>
+    inline Path::Path(const T& p): path("") {
+        typedef typename std::decay<T>::type type;
+
+        if constexpr (std::is_same<type, const char*>::value ||
+                      std::is_same<type, char*>::value) {
+            /* A null pointer streams out as nothing */
+            const char* str = p;
+            if (str != NULL) {
+                path.assign(str);
+            }
+        } else if constexpr (std::is_convertible<const T&, std::string_view>::value) {
+            path.assign(std::string_view(p));
+        } else if constexpr (std::is_same<type, PathView>::value) {
+            path.assign(p.string());
+        } else if constexpr (std::is_same<type, char>::value) {
+            path.assign(1, p);
+        } else if constexpr (std::is_integral<type>::value &&
+                             !std::is_same<type, bool>::value &&
+                             !std::is_same<type, signed char>::value &&
+                             !std::is_same<type, unsigned char>::value &&
+                             !std::is_same<type, wchar_t>::value &&
+                             !std::is_same<type, char16_t>::value &&
+                             !std::is_same<type, char32_t>::value) {
+            char buf[std::numeric_limits<type>::digits10 + 3];
+            std::to_chars_result result = std::to_chars(buf, buf + sizeof(buf), p);
+            path.assign(buf, result.ptr);
+        } else if constexpr (std::is_floating_point<type>::value) {
+            /* This is what std::stringstream would give us with its default
+             * precision of 6 significant digits */
+            char buf[64];
+            std::to_chars_result result = std::to_chars(
+                buf, buf + sizeof(buf), p, std::chars_format::general, 6);
+            path.assign(buf, result.ptr);
+        } else {
+            std::stringstream ss;
+            ss << p;
+            path.assign(ss.str());
+        }
+#if defined(_WIN32)
+        std::replace(path.begin(), path.end(), posix_separator, windows_separator);
+        //FIXME: Deal with illegal paths on windows, like trying to pass posix paths: /home/meh/r
+#endif
+    }
+
+    /**************************************************************************
+     * Operators
+     *************************************************************************/
+    inline Path& Path::operator<<(const Path& segment) & {
+        return append(segment);
+    }
+
+    inline Path Path::operator+(const Path& segment) const & {
+        return join(*this, segment);
+    }
+
+    inline Path Path::operator+(const Path& segment) && {
+        return std::move(*this).append(segment);
+    }
+
+    inline bool Path::equivalent(const Path& other) const {
+        /* Make copies of both paths, sanitize, and ensure they're equal */
+
+#if defined(_WIN32)
+        std::string thisPath = Path(*this).absolute().sanitize().string();
+        std::string thatPath = Path(other).absolute().sanitize().string();
+        std::transform(thisPath.begin(), thisPath.end(), thisPath.begin(), ::tolower);
+        std::transform(thatPath.begin(), thatPath.end(), thatPath.begin(), ::tolower);
+        return  thisPath== thatPath;
+#else
+        return Path(*this).absolute().sanitize() ==
+               Path(other).absolute().sanitize();
+#endif
+    }
+
+    inline std::string Path::filename() const {
+        return std::string(view().filename());
+    }
+
+    inline std::string Path::extension() const {
+        return std::string(view().extension());
+    }
+
+    inline Path Path::stem() const {
+        return Path(std::string(view().stem().string()));
+    }
+
+    /**************************************************************************
+     * Manipulators
+     *************************************************************************/
+    inline Path& Path::append(const Path& segment) & {
+        /* First, check if the last character is the separator character.
+         * If not, then append one and then the segment. Otherwise, just
+         * the segment */
+        if (!trailing_slash()) {
+            path.push_back(separator);
+        }
+        path.append(segment.path);
+        return *this;
+    }
+
+    inline Path& Path::relative(const Path& rel) & {
+        if (!rel.is_absolute()) {
+            return append(rel);
+        } else {
+            operator=(rel);
+            return *this;
+        }
+    }
+
+    inline Path& Path::up() & {
+        /* Make sure we turn this into an absolute url if it's not already
+         * one */
+        if (path.size() == 0) {
+            path = "..";
+            return directory();
+        }
+
+        append(Path("..")).sanitize();
+        if (path.size() == 0) {
+            return *this;
+        }
+
+        return directory();
+    }
+
+    inline Path& Path::absolute() & {
+        std::error_code ec;
+        return absolute(ec);
+    }
+
+    inline Path& Path::absolute(std::error_code& ec) & {
+        ec.clear();
+        /* If the path doesn't begin with our separator, then it's not an
+         * absolute path, and should be appended to the current working
+         * directory */
+        if (!is_absolute()) {
+            /* Join our current working directory with the path */
+            const Path& cwd = cached_cwd(ec);
+            if (!ec) {
+                absolute(cwd);
+            }
+        }
+        return *this;
+    }
+
+    inline Path& Path::absolute(const Path& base) & {
+        if (!is_absolute()) {
+            /* Prepend the base in place, so that we keep our own storage */
+            size_t length = base.path.size();
+            path.insert(0, base.trailing_slash() ? length : length + 1, separator);
+            std::copy(base.path.begin(), base.path.end(), path.begin());
+        }
+        return *this;
+    }
+
+    inline Path& Path::sanitize() & {
+#if !defined(_WIN32)
+        /* Most paths are clean already, and that's quick to check */
+        if (scan::normalized(path)) {
+            return *this;
+        }
+#endif
+
+        /* We may have to test these repeatedly, so let's check once */
+        bool relative = !is_absolute();
+        bool was_directory = trailing_slash();
+
+        /* This works in place in a single pass over the buffer. We walk the
+         * segments with a view over our own storage, and `out` is the length
+         * of the sanitized path written so far. Since we only ever drop
+         * characters, `out` never overtakes the segment being read, so nothing
+         * the view has yet to visit gets clobbered.
+         *
+         * `floor` is the part of the output that '..' may not pop back into.
+         * For absolute paths it's the leading separator (or drive letter on
+         * Windows), and for relative paths it grows as we accumulate leading
+         * '..'s that exceed the stack depth */
+        size_t out = 0;
+#if !defined(_WIN32)
+        if (!relative) {
+            out = 1;
+        }
+#endif
+        size_t base = out;
+        size_t floor = out;
+
+        PathView segments(path);
+        PathView::iterator it(segments.begin());
+        for (size_t pos = 0; it != segments.end(); ++it, ++pos) {
+            std::string_view segment(*it);
+            size_t start = segment.data() - path.data();
+            size_t count = segment.size();
+
+            /* Skip over empty segments and '.'*/
+            if (count == 0 || (count == 1 && path[start] == '.')) {
+                continue;
+            }
+
+#if defined(_WIN32)
+            /* Skip over illegal paths */
+            bool drive_letter = count >= 2 &&
+                path[start + 1] == windows_drive_separator;
+            if (pos != 0 && drive_letter) {
+                continue;
+            }
+#endif
+
+            /* If there is a '..', then pop off a parent directory. However, if
+             * the path was relative to begin with, if the '..'s exceed the
+             * stack depth, then they should be appended to our path. If it was
+             * absolute to begin with, and we reach root, then '..' has no
+             * effect */
+            bool parent = count == 2 && path[start] == '.' &&
+                path[start + 1] == '.';
+            if (parent) {
+                if (out > floor) {
+                    size_t cut = scan::find_last(
+                        std::string_view(path).substr(0, out), separator);
+                    out = (cut != std::string::npos && cut >= floor) ?
+                        cut : floor;
+                    continue;
+                } else if (!relative) {
+                    continue;
+                }
+            }
+
+            if (out > base) {
+                path[out++] = separator;
+            }
+            std::memmove(&path[out], &path[start], count);
+            out += count;
+
+            if (parent) {
+                floor = out;
+            }
+#if defined(_WIN32)
+            if (pos == 0 && drive_letter) {
+                floor = out;
+            }
+#endif
+        }
+        path.resize(out);
+
+        if (was_directory && (!relative || path.length())) {
+            return directory();
+        }
+        return *this;
+    }
+
+    inline Path& Path::directory() & {
+        trim();
+        path.push_back(separator);
+        return *this;
+    }
+
+    inline Path& Path::trim() & {
+        if (path.length() == 0) { return *this; }
+
+        size_t p = scan::find_last_not(path, separator);
+        if (p != std::string::npos) {
+            path.erase(p + 1, path.size());
+        } else {
+            path = "";
+        }
+        return *this;
+    }
+
+    /**************************************************************************
+     * Member Utility Methods
+     *************************************************************************/
+
+    /* Returns a vector of each of the path segments in this path */
+    inline std::vector<Path::Segment> Path::split() const {
+        PathView segments(view());
+        std::vector<Path::Segment> results;
+        results.reserve(scan::count(path, separator) + 1);
+        for (PathView::iterator it(segments.begin()); it != segments.end(); ++it) {
+            results.push_back(Path::Segment(std::string(*it)));
+        }
+        return results;
+    }
+
+    /**************************************************************************
+     * Tests
+     *************************************************************************/
+    inline bool Path::is_absolute() const {
+        return view().is_absolute();
+    }
+
+    inline bool Path::trailing_slash() const {
+        return view().trailing_slash();
+    }
+
+    inline Path::Status::Status(const struct stat& buf):
+        type(other),
+        mode(buf.st_mode),
+        size(buf.st_size),
+        mtime(buf.st_mtime),
+        mtime_nsec(0),
+        inode(buf.st_ino),
+        device(buf.st_dev)
+    {
+        if (S_ISREG(buf.st_mode)) {
+            type = file;
+        } else if (S_ISDIR(buf.st_mode)) {
+            type = directory;
+        }
+#if !defined(_WIN32)
+        else if (S_ISLNK(buf.st_mode)) {
+            type = symlink;
+        }
+#endif
+
+#if defined(__APPLE__)
+        mtime_nsec = buf.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+        mtime_nsec = buf.st_mtim.tv_nsec;
+#endif
+    }
+
+    inline Path::Status Path::status() const {
+        struct stat buf;
+        if (sys::stat(path.c_str(), &buf) != 0) {
+            return Status();
+        }
+        return Status(buf);
+    }
+
+    inline Path::Status Path::symlink_status() const {
+        struct stat buf;
+#if defined(_WIN32)
+        if (sys::stat(path.c_str(), &buf) != 0) {
+#else
+        if (sys::lstat(path.c_str(), &buf) != 0) {
+#endif
+            return Status();
+        }
+        return Status(buf);
+    }
+
+    inline bool Path::exists() const {
+        return status().exists();
+    }
+
+    inline bool Path::is_file() const {
+        return status().is_file();
+    }
+
+    inline bool Path::is_directory() const {
+        return status().is_directory();
+    }
+
+    inline size_t Path::size() const {
+        return status().size;
+    }
+
+    /**************************************************************************
+     * Static Utility Methods
+     *************************************************************************/
+    inline Path Path::join(const Path& a, const Path& b) {
+        return join_segments(a, {&b});
+    }
+
+    template <class First, class Second, class... Rest>
+    inline Path Path::join(First&& first, const Second& second, const Rest&... rest) {
+        /* Anything that isn't already a path is converted into a temporary,
+         * which lives until join_segments returns */
+        return join_segments(std::forward<First>(first),
+            {&static_cast<const Path&>(second), &static_cast<const Path&>(rest)...});
+    }
+
+    inline Path Path::join_segments(const Path& first,
+        std::initializer_list<const Path*> segments) {
+        size_t length = first.path.size();
+        for (const Path* segment : segments) {
+            length += segment->path.size() + 1;
+        }
+
+        Path result;
+        result.path.reserve(length);
+        result.path.append(first.path);
+        for (const Path* segment : segments) {
+            result.append(*segment);
+        }
+        return result;
+    }
+
+    inline Path Path::join_segments(Path&& first,
+        std::initializer_list<const Path*> segments) {
+        size_t length = first.path.size();
+        for (const Path* segment : segments) {
+            length += segment->path.size() + 1;
+        }
+
+        first.path.reserve(length);
+        for (const Path* segment : segments) {
+            first.append(*segment);
+        }
+        return std::move(first);
+    }
+
+    inline Path Path::join(const std::vector<Segment>& segments) {
+        std::string path;
+        size_t length = segments.size();
+        for (size_t i = 0; i < segments.size(); ++i) {
+            length += segments[i].segment.size();
+        }
+        path.reserve(length);
+
+        /* Now, we'll go through the segments, and join them with
+         * separator */
+        std::vector<Segment>::const_iterator it(segments.begin());
+        for(; it != segments.end(); ++it) {
+            path += it->segment;
+            if (it + 1 != segments.end()) {
+                path.push_back(separator);
+            }
+        }
+        return Path(path);
+    }
+
+    inline Path Path::cwd() {
+        return cached_cwd();
+    }
+
+    inline Path Path::cwd(std::error_code& ec) {
+        ec.clear();
+        return cached_cwd(ec);
+    }
+
+    inline Path::CwdCache& Path::cwd_cache() {
+        static CwdCache cache;
+        return cache;
+    }
+
+    inline const Path& Path::cached_cwd() {
+        std::error_code ec;
+        const Path& result = cached_cwd(ec);
+        if (ec) {
+            complain("cwd", ec);
+        }
+        return result;
+    }
+
+    inline const Path& Path::cached_cwd(std::error_code& ec) {
+        /* Each thread keeps its own copy, and only takes the lock to refresh
+         * it when the shared one has been invalidated since */
+        thread_local Path cached;
+        thread_local std::error_code error;
+        thread_local std::uint64_t seen = 0;
+
+        CwdCache& cache = cwd_cache();
+        if (cache.generation.load(std::memory_order_acquire) != seen) {
+            std::lock_guard<std::mutex> guard(cache.lock);
+            if (!cache.valid) {
+                Path p;
+                cache.error.clear();
+
+                char * buf = sys::getcwd(NULL, 0);
+                if (buf != NULL) {
+                    p = std::string(buf);
+                    free(buf);
+                    /* Ensure this is a directory */
+                    p.directory();
+                } else {
+                    cache.error = last_error();
+                }
+
+                /* A failure is remembered too, so that we don't keep asking
+                 * until the working directory changes */
+                cache.path = std::move(p);
+                cache.valid = true;
+            }
+
+            cached = cache.path;
+            error = cache.error;
+            seen = cache.generation.load();
+        }
+
+        if (error) {
+            ec = error;
+        }
+        return cached;
+    }
+
+    inline bool Path::chdir(const Path& p) {
+        CwdCache& cache = cwd_cache();
+        std::lock_guard<std::mutex> guard(cache.lock);
+        if (sys::chdir(p.path.c_str()) != 0) {
+            return false;
+        }
+
+        cache.valid = false;
+        ++cache.generation;
+        return true;
+    }
+
+    inline void Path::invalidate_cwd() {
+        CwdCache& cache = cwd_cache();
+        std::lock_guard<std::mutex> guard(cache.lock);
+        cache.valid = false;
+        ++cache.generation;
+    }
+
+    inline Path Path::tmp() {
+#if defined(unix) || defined(__unix) || defined(__unix__) || defined(__APPLE__) || defined(__MACH__) || defined(__linux__) || defined(__FreeBSD__)
+        char* env_value = nullptr;
+
+        if ((env_value = getenv("TMPDIR"))) // Single = intended
+        {
+            return Path(std::string(env_value));
+        }
+
+        return Path("/tmp"); // As per the Filesystem Hierarchy Standard.
+#elif defined(_WIN32) || defined(__CYGWIN__)
+        wchar_t buf[MAX_PATH + 1]; // See http://msdn.microsoft.com/en-us/library/windows/desktop/aa364992%28v=vs.85%29.aspx for the +1
+        DWORD count = GetTempPathW(MAX_PATH + 1, buf);
+        std::string result;
+
+        if (count == 0)
+        {
+            std::cerr << "Error fetching tmp dir: " << GetLastError() << std::endl;
+        }
+        else
+        {
+            //FIXME: All path should be using wstring instead of std::string
+            std::wstring utf16(buf, count);
+            result.reserve(count);
+            std::copy(buf, buf+count, std::back_inserter(result));
+        }
+
+        return result;
+#else
+#error "Unsupported platform"
+#endif
+    }
+
+    inline bool Path::touch(const Path& p, mode_t mode) {
+        std::error_code ec;
+        if (!touch(p, ec, mode)) {
+            complain("touch", ec);
+            return false;
+        }
+        return true;
+    }
+
+    inline bool Path::touch(const Path& p, std::error_code& ec, mode_t mode) {
+        ec.clear();
+        int fd = sys::open(p.path.c_str(), O_RDONLY | O_CREAT, mode);
+        if (fd == -1) {
+            std::error_code ignored;
+            makedirs(p, ignored);
+            fd = sys::open(p.path.c_str(), O_RDONLY | O_CREAT, mode);
+            if (fd == -1) {
+                ec = last_error();
+                return false;
+            }
+        }
+
+        if (sys::close(fd) == -1) {
+            ec = last_error();
+            return false;
+        }
+
+        return true;
+    }
+
+    inline bool Path::touch(const std::vector<Path>& paths, mode_t mode,
+                            unsigned threads) {
+        std::error_code ec;
+        if (!create_all(paths, true, mode, threads, ec)) {
+            complain("touch", ec);
+            return false;
+        }
+        return true;
+    }
+
+    inline bool Path::touch(const std::vector<Path>& paths, std::error_code& ec,
+                            mode_t mode, unsigned threads) {
+        return create_all(paths, true, mode, threads, ec);
+    }
+
+    inline bool Path::move(const Path& source, const Path& dest,
+        bool mkdirs) {
+        std::error_code ec;
+        if (!move(source, dest, ec, mkdirs)) {
+            errno = ec.value();
+            return false;
+        }
+        return true;
+    }
+
+    inline bool Path::move(const Path& source, const Path& dest,
+        std::error_code& ec, bool mkdirs) {
+        ec.clear();
+        int result = sys::rename(source.path.c_str(), dest.path.c_str());
+        if (result == 0) {
+            return true;
+        }
+
+        /* Otherwise, there was an error */
+        if (errno == ENOENT && mkdirs) {
+            if (!makedirs(dest.parent(), ec)) {
+                return false;
+            }
+            if (sys::rename(source.path.c_str(), dest.path.c_str()) == 0) {
+                return true;
+            }
+        }
+
+        /* Renames can't cross filesystems, so copy it over instead */
+        if (errno != EXDEV) {
+            ec = last_error();
+            return false;
+        }
+
+        Status status(source.symlink_status());
+        if (status.is_directory()) {
+            return recursive_copy(source, dest, ec) && rmdirs(source, ec);
+        }
+#if !defined(_WIN32)
+        if (status.is_symlink()) {
+            /* Like rename, this replaces anything already at `dest` */
+            std::string temporary(temporary_name(dest));
+            if (!copy_symlink(source.path.c_str(), temporary.c_str())) {
+                ec = last_error();
+                return false;
+            }
+            if (sys::rename(temporary.c_str(), dest.path.c_str()) != 0) {
+                ec = last_error();
+                sys::unlink(temporary.c_str());
+                return false;
+            }
+            return rm(source, ec);
+        }
+#endif
+        return copy(source, dest, ec) && rm(source, ec);
+    }
+
+    inline std::string Path::temporary_name(const Path& p) {
+        static std::atomic<std::uint64_t> counter(0);
+        std::string result(p.path.data(), p.path.size());
+        while (!result.empty() && result.back() == separator) {
+            result.pop_back();
+        }
+#if defined(_WIN32)
+        result.append(".apathy-tmp-" + std::to_string(GetCurrentProcessId()));
+#else
+        result.append(".apathy-tmp-" + std::to_string(getpid()));
+#endif
+        result.append("-" + std::to_string(counter++));
+        return result;
+    }
+
+    inline bool Path::copy(const Path& source, const Path& dest) {
+        std::error_code ec;
+        if (!copy(source, dest, ec)) {
+            errno = ec.value();
+            return false;
+        }
+        return true;
+    }
+
+    inline bool Path::copy(const Path& source, const Path& dest, std::error_code& ec) {
+        ec.clear();
+#if defined(_WIN32)
+        if (CopyFileA(source.path.c_str(), dest.path.c_str(), FALSE) == 0) {
+            ec = std::error_code(GetLastError(), std::system_category());
+            return false;
+        }
+        return true;
+#else
+        return copy_file(source.path.c_str(), dest.path.c_str(), true, ec);
+#endif
+    }
+
+#if !defined(_WIN32)
+    inline bool Path::copy_file(const char* source, const char* dest, bool atomic,
+                                std::error_code& ec) {
+        /* Opening a FIFO to read waits for a writer, unless it's done without
+         * blocking. That makes no difference to regular files */
+        int in = sys::open(source, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+        if (in < 0) {
+            ec = last_error();
+            return false;
+        }
+
+        struct stat st;
+        if (sys::fstat(in, &st) != 0) {
+            ec = last_error();
+            sys::close(in);
+            return false;
+        } else if (!S_ISREG(st.st_mode)) {
+            ec = std::make_error_code(S_ISDIR(st.st_mode) ?
+                std::errc::is_a_directory : std::errc::invalid_argument);
+            sys::close(in);
+            return false;
+        }
+
+        /* The error is kept before cleaning up, which may change errno */
+        std::string target(atomic ? temporary_name(Path(dest)) : std::string(dest));
+        int out = sys::open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        bool success = out >= 0 && copy_data(in, out) && copy_metadata(out, st);
+
+        /* Make sure it's all on disk before it takes the place of `dest` */
+        if (success && atomic) {
+            success = sys::fsync(out) == 0;
+        }
+        if (!success) {
+            ec = last_error();
+        }
+        if (out >= 0 && sys::close(out) != 0 && success) {
+            ec = last_error();
+            success = false;
+        }
+        sys::close(in);
+
+        if (success && atomic && sys::rename(target.c_str(), dest) != 0) {
+            ec = last_error();
+            success = false;
+        }
+        if (!success && out >= 0) {
+            sys::unlink(target.c_str());
+        }
+        return success;
+    }
+
+    inline bool Path::copy_data(int source, int dest) {
+        /* Ask for this much at a time from the in-kernel copies */
+        const size_t chunk = size_t(1) << 30;
+#if defined(__linux__)
+        if (sys::clone(source, dest) == 0) {
+            return true;
+        }
+
+        /* Only fall back if nothing's been copied yet, since the file
+         * offsets have moved otherwise */
+        bool copied = false;
+        while (true) {
+            ssize_t n = sys::copy_file_range(source, dest, chunk);
+            if (n > 0) {
+                copied = true;
+            } else if (n == 0) {
+                return true;
+            } else if (errno != EINTR) {
+                break;
+            }
+        }
+        if (copied) {
+            return false;
+        }
+
+        while (true) {
+            ssize_t n = sys::sendfile(dest, source, chunk);
+            if (n > 0) {
+                copied = true;
+            } else if (n == 0) {
+                return true;
+            } else if (errno != EINTR) {
+                break;
+            }
+        }
+        if (copied) {
+            return false;
+        }
+#else
+        (void)(chunk);
+#endif
+
+        const size_t buffer_size = 1 << 20;
+        std::unique_ptr<char[]> buffer(new char[buffer_size]);
+        while (true) {
+            ssize_t n = sys::read(source, buffer.get(), buffer_size);
+            if (n == 0) {
+                return true;
+            } else if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+
+            if (!write_fully(dest, buffer.get(), n)) {
+                return false;
+            }
+        }
+    }
+
+    inline bool Path::write_fully(int fd, const char* data, size_t size) {
+        for (size_t written = 0; written < size; ) {
+            ssize_t n = sys::write(fd, data + written, size - written);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            written += n;
+        }
+        return true;
+    }
+
+    inline bool Path::copy_metadata(int fd, const struct stat& st) {
+        /* Only root can give files away, so that's allowed to fail */
+        if (sys::fchown(fd, st.st_uid, st.st_gid) != 0 && errno != EPERM) {
+            return false;
+        }
+        if (sys::fchmod(fd, st.st_mode & 07777) != 0) {
+            return false;
+        }
+#if defined(__APPLE__)
+        struct timespec times[2] = {st.st_atimespec, st.st_mtimespec};
+#else
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+#endif
+        return sys::futimens(fd, times) == 0;
+    }
+
+    inline bool Path::copy_symlink(const char* source, const char* dest) {
+        std::vector<char> target(256);
+        while (true) {
+            ssize_t n = sys::readlink(source, target.data(), target.size());
+            if (n < 0) {
+                return false;
+            } else if (static_cast<size_t>(n) < target.size()) {
+                target[n] = '\0';
+                break;
+            }
+            target.resize(target.size() * 2);
+        }
+        return sys::symlink(target.data(), dest) == 0;
+    }
+#endif
+
+    inline bool Path::read_all(const Path& p, std::string& contents) {
+        std::error_code ec;
+        if (!read_all(p, contents, ec)) {
+            errno = ec.value();
+            return false;
+        }
+        return true;
+    }
+
+    inline bool Path::read_all(const Path& p, std::string& contents,
+                               std::error_code& ec) {
+        ec.clear();
+#if defined(_WIN32)
+        FILE* file = fopen(p.path.c_str(), "rb");
+        if (file == NULL) {
+            ec = last_error();
+            return false;
+        }
+        contents.resize(p.size());
+        size_t n = fread(&contents[0], 1, contents.size(), file);
+        contents.resize(n);
+        char buffer[4096];
+        while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            contents.append(buffer, n);
+        }
+        bool success = !ferror(file);
+        if (!success) {
+            ec = last_error();
+        }
+        fclose(file);
+        return success;
+#else
+        int fd = sys::open(p.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            ec = last_error();
+            return false;
+        }
+
+        struct stat st;
+        if (sys::fstat(fd, &st) != 0) {
+            ec = last_error();
+            sys::close(fd);
+            return false;
+        }
+
+        /* Read straight into the string. If the file grows in the meantime,
+         * keep going until the end, and if it shrinks, stop there */
+        contents.resize(static_cast<size_t>(st.st_size) + 1);
+        size_t length = 0;
+        bool success = true;
+        while (true) {
+            if (length == contents.size()) {
+                contents.resize(contents.size() * 2);
+            }
+            ssize_t n = sys::read(fd, &contents[length], contents.size() - length);
+            if (n > 0) {
+                length += n;
+            } else if (n == 0) {
+                break;
+            } else if (errno != EINTR) {
+                ec = last_error();
+                success = false;
+                break;
+            }
+        }
+        contents.resize(length);
+        sys::close(fd);
+        return success;
+#endif
+    }
+
+    inline bool Path::write_all(const Path& p, std::string_view contents, mode_t mode) {
+        std::error_code ec;
+        if (!write_all(p, contents, ec, mode)) {
+            errno = ec.value();
+            return false;
+        }
+        return true;
+    }
+
+    inline bool Path::write_all(const Path& p, std::string_view contents,
+                                std::error_code& ec, mode_t mode) {
+        ec.clear();
+        std::string temporary(temporary_name(p));
+#if defined(_WIN32)
+        (void)(mode);
+        FILE* file = fopen(temporary.c_str(), "wb");
+        if (file == NULL) {
+            ec = last_error();
+            return false;
+        }
+        bool success = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+        success = fclose(file) == 0 && success;
+        if (!success) {
+            ec = last_error();
+        } else if (MoveFileExA(temporary.c_str(), p.path.c_str(),
+                MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) == 0) {
+            ec = std::error_code(GetLastError(), std::system_category());
+            success = false;
+        }
+#else
+        int fd = sys::open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+        if (fd < 0) {
+            ec = last_error();
+            return false;
+        }
+
+        bool success = write_fully(fd, contents.data(), contents.size()) &&
+            sys::fsync(fd) == 0;
+        if (!success) {
+            ec = last_error();
+        }
+        if (sys::close(fd) != 0 && success) {
+            ec = last_error();
+            success = false;
+        }
+        if (success && sys::rename(temporary.c_str(), p.path.c_str()) != 0) {
+            ec = last_error();
+            success = false;
+        }
+#endif
+        if (!success) {
+            sys::remove(temporary.c_str());
+        }
+        return success;
+    }
+
+    inline bool Path::recursive_copy(const Path& source, const Path& dest,
+                                     unsigned threads) {
+        std::error_code ec;
+        if (!recursive_copy(source, dest, ec, threads)) {
+            errno = ec.value();
+            return false;
+        }
+        return true;
+    }
+
+    inline bool Path::recursive_copy(const Path& source, const Path& dest,
+                                     std::error_code& ec, unsigned threads) {
+        ec.clear();
+        Path root(source);
+        root.absolute(ec);
+        if (ec) {
+            return false;
+        }
+        root.trim();
+
+        Status status(root.symlink_status());
+        if (!status.is_directory()) {
+            ec = std::make_error_code(status.exists() ?
+                std::errc::not_a_directory : std::errc::no_such_file_or_directory);
+            return false;
+        } else if (dest.symlink_status().exists()) {
+            ec = std::make_error_code(std::errc::file_exists);
+            return false;
+        }
+
+        /* Read the whole tree first, so the directories can all be made
+         * before any files are copied into them */
+        std::mutex lock;
+        std::vector<Path::Entry> entries;
+        TreeWalker walker(threads, false);
+        try {
+            walker.walk(root, [&lock, &entries](const Path::Entry& entry) {
+                std::lock_guard<std::mutex> guard(lock);
+                entries.push_back(entry);
+            });
+        } catch (const std::system_error& e) {
+            ec = e.code();
+            return false;
+        } catch (...) {
+            /* Otherwise, only keeping the entries can throw */
+            ec = std::make_error_code(std::errc::not_enough_memory);
+            return false;
+        }
+        threads = walker.threads();
+
+        /* Where each entry goes, in the temporary directory */
+        std::string temporary(temporary_name(dest));
+        size_t prefix = root.path.size();
+        auto target = [&temporary, prefix](const Path::Entry& entry) {
+            return temporary + std::string(entry.path.path.data() + prefix,
+                                           entry.path.path.size() - prefix);
+        };
+
+        if (makedir(temporary.c_str(), 0700) != 0) {
+            ec = last_error();
+            return false;
+        }
+
+        /* Keep the directories writable until their contents are copied */
+        std::vector<Path> directories;
+        for (const Path::Entry& entry : entries) {
+            if (entry.is_directory()) {
+                directories.push_back(Path(target(entry)));
+            }
+        }
+        bool success = directories.empty() || makedirs(directories, ec, 0700, threads);
+
+        /* Each thread keeps its own error, and the first one is reported */
+        std::atomic<size_t> next(0);
+        std::atomic<bool> copied(success);
+        auto work = [&]() {
+            std::error_code error;
+            for (size_t i = next++; copied && i < entries.size(); i = next++) {
+                const Path::Entry& entry(entries[i]);
+                std::string to(target(entry));
+                bool result = true;
+#if defined(_WIN32)
+                if (entry.is_file()) {
+                    result = CopyFileA(entry.path.path.c_str(), to.c_str(), TRUE) != 0;
+                    if (!result) {
+                        error = std::error_code(GetLastError(), std::system_category());
+                    }
+                }
+#else
+                if (entry.is_file()) {
+                    result = copy_file(entry.path.path.c_str(), to.c_str(), false, error);
+                } else if (entry.is_symlink()) {
+                    result = copy_symlink(entry.path.path.c_str(), to.c_str());
+                    if (!result) {
+                        error = last_error();
+                    }
+                }
+#endif
+                if (!result) {
+                    copied = false;
+                    std::lock_guard<std::mutex> guard(lock);
+                    if (!ec) {
+                        ec = error;
+                    }
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads && success; ++i) {
+            workers.push_back(std::thread(work));
+        }
+        if (success) {
+            work();
+        }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        success = copied;
+
+#if !defined(_WIN32)
+        /* Now that nothing more is going into them, give the directories
+         * their metadata, from the deepest up so the times stick */
+        std::vector<std::pair<std::string, std::string> > metadata;
+        for (const Path::Entry& entry : entries) {
+            if (entry.is_directory()) {
+                metadata.emplace_back(entry.path.string(), target(entry));
+            }
+        }
+        metadata.emplace_back(root.string(), temporary);
+        std::sort(metadata.begin(), metadata.end(),
+            [](const std::pair<std::string, std::string>& a,
+               const std::pair<std::string, std::string>& b) {
+                return a.first.size() > b.first.size();
+            });
+
+        for (size_t i = 0; success && i < metadata.size(); ++i) {
+            struct stat st;
+            int fd = sys::open(metadata[i].second.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            success = fd >= 0 && sys::stat(metadata[i].first.c_str(), &st) == 0 &&
+                copy_metadata(fd, st);
+            if (!success) {
+                ec = last_error();
+            }
+            if (fd >= 0) {
+                sys::close(fd);
+            }
+        }
+#endif
+
+        if (success && sys::rename(temporary.c_str(), dest.path.c_str()) != 0) {
+            ec = last_error();
+            success = false;
+        }
+        if (!success) {
+            std::error_code ignored;
+            rmdirs(Path(temporary), ignored, true);
+        }
+        return success;
+    }
+
+    inline void Path::complain(const char* what, const std::error_code& ec) {
+        errno = ec.value();
+        perror(what);
+    }
+
+    inline bool Path::rm(const Path& path) {
+        std::error_code ec;
+        if (!rm(path, ec)) {
+            complain("Remove", ec);
+            return false;
+        }
+        return true;
+    }
+
+    inline bool Path::rm(const Path& path, std::error_code& ec) {
+        ec.clear();
+        if (sys::remove(path.path.c_str()) != 0) {
+            ec = last_error();
+            return false;
+        }
+        return true;
+    }
+
+    inline bool Path::makedirs(const Path& p, mode_t mode) {
+        std::error_code ec;
+        if (!makedirs(p, ec, mode)) {
+            /* Something other than a directory in the way was never printed */
+            if (ec != std::errc::file_exists) {
+                complain("makedirs", ec);
+            }
+            return false;
+        }
+        return true;
+    }
+
+    inline bool Path::makedirs(const Path& p, std::error_code& ec, mode_t mode) {
+        APATHY_TIME(makedirs);
+        ec.clear();
+        /* We need to make a copy of the path, that's an absolute path */
+        Path abs(p);
+        abs.absolute(ec);
+        if (ec) {
+            return false;
+        }
+
+        /* Most of the time, either it exists or only it is missing */
+        if (makedir(abs.path.c_str(), mode) == 0) {
+            return true;
+        } else if (errno == EEXIST) {
+            if (!abs.is_directory()) {
+                ec = std::make_error_code(std::errc::file_exists);
+                return false;
+            }
+            return true;
+        } else if (errno != ENOENT) {
+            ec = last_error();
+            return false;
+        }
+
+        /* Find where each of the segments starts and stops. We'll cut the
+         * path short at each of these in turn to name its ancestors */
+        char* buffer = &abs.path[0];
+        size_t length = abs.path.size();
+        std::vector<std::pair<size_t, size_t> > segments;
+        for (size_t i = 0; i < length; ++i) {
+            if (buffer[i] == separator) {
+                continue;
+            }
+            size_t start = i;
+            while (i < length && buffer[i] != separator) {
+                ++i;
+            }
+            segments.emplace_back(start, i);
+        }
+        if (segments.empty()) {
+            ec = std::make_error_code(std::errc::no_such_file_or_directory);
+            return false;
+        }
+
+        /* Does the path through segment `i` exist as a directory? */
+        auto exists = [buffer](size_t stop) {
+            char saved = buffer[stop];
+            buffer[stop] = '\0';
+            struct stat buf;
+            bool result = sys::stat(buffer, &buf) == 0 && S_ISDIR(buf.st_mode);
+            buffer[stop] = saved;
+            return result;
+        };
+
+        /* The last segment is missing. If the one before it is there, that's
+         * all there is to it, and otherwise bisect for the first one that's
+         * missing. Ancestors of an existing directory always exist */
+        size_t missing = segments.size() - 1;
+        if (missing > 0 && !exists(segments[missing - 1].second)) {
+            size_t low = 0;
+            size_t high = missing - 1;
+            while (low < high) {
+                size_t middle = low + (high - low) / 2;
+                if (exists(segments[middle].second)) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+            missing = low;
+        }
+
+#if defined(_WIN32)
+        const char* relative = buffer;
+#else
+        /* Make everything relative to the deepest existing directory, so
+         * that's the only part of the path the kernel resolves repeatedly */
+        int fd;
+        if (missing == 0) {
+            fd = sys::open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        } else {
+            size_t stop = segments[missing - 1].second;
+            char saved = buffer[stop];
+            buffer[stop] = '\0';
+            fd = sys::open(buffer, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            buffer[stop] = saved;
+        }
+        if (fd < 0) {
+            ec = last_error();
+            return false;
+        }
+        const char* relative = buffer + segments[missing].first;
+#endif
+
+        bool success = true;
+        for (size_t i = missing; success && i < segments.size(); ++i) {
+            size_t stop = segments[i].second;
+            char saved = buffer[stop];
+            buffer[stop] = '\0';
+#if defined(_WIN32)
+            int result = makedir(relative, mode);
+#else
+            int result = sys::mkdirat(fd, relative, mode);
+#endif
+            /* If it already exists, someone beat us to it. Anything in the
+             * way that isn't a directory will fail the next level down, or
+             * the check below for the last one */
+            if (result != 0 && errno != EEXIST) {
+                ec = last_error();
+                success = false;
+            } else if (result != 0 && i + 1 == segments.size()) {
+#if defined(_WIN32)
+                success = Path(buffer).is_directory();
+#else
+                struct stat buf;
+                success = sys::fstatat(fd, relative, &buf, 0) == 0 && S_ISDIR(buf.st_mode);
+#endif
+                if (!success) {
+                    ec = std::make_error_code(std::errc::file_exists);
+                }
+            }
+            buffer[stop] = saved;
+        }
+
+#if !defined(_WIN32)
+        sys::close(fd);
+#endif
+        return success;
+    }
+
+    inline bool Path::makedirs(const std::vector<Path>& paths, mode_t mode,
+                               unsigned threads) {
+        std::error_code ec;
+        if (!create_all(paths, false, mode, threads, ec)) {
+            if (ec != std::errc::file_exists) {
+                complain("makedirs", ec);
+            }
+            return false;
+        }
+        return true;
+    }
+
+    inline bool Path::makedirs(const std::vector<Path>& paths, std::error_code& ec,
+                               mode_t mode, unsigned threads) {
+        return create_all(paths, false, mode, threads, ec);
+    }
+
+    inline bool Path::segment_less(const std::string& a, const std::string& b) {
+        return PathView(a) < PathView(b);
+    }
+
+    inline bool Path::create_all(const std::vector<Path>& paths, bool files,
+                                 mode_t mode, unsigned threads, std::error_code& ec) {
+        std::vector<std::string> sorted;
+        sorted.reserve(paths.size());
+        for (const Path& p : paths) {
+            Path abs(p);
+            abs.absolute(ec);
+            if (ec) {
+                return false;
+            }
+            abs.sanitize().trim();
+            sorted.push_back(abs.string());
+        }
+        return create_all(sorted, files, mode, threads, ec);
+    }
+
+    inline bool Path::create_all(std::vector<std::string>& paths, bool files,
+                                 mode_t mode, unsigned threads, std::error_code& ec) {
+        APATHY_TIME(makedirs);
+        ec.clear();
+        /* The root always exists */
+        paths.erase(std::remove_if(paths.begin(), paths.end(), [](const std::string& p) {
+            return p.find_first_not_of(separator) == std::string::npos;
+        }), paths.end());
+        std::sort(paths.begin(), paths.end(), segment_less);
+        paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+#if defined(_WIN32)
+        (void)(threads);
+        bool success = true;
+        std::error_code error;
+        for (size_t i = 0; i < paths.size(); ++i) {
+            if (files) {
+                /* Each distinct parent is only made once */
+                Path parent(Path(paths[i]).parent());
+                if (i == 0 || parent != Path(paths[i - 1]).parent()) {
+                    success = makedirs(parent, error, mode) && success;
+                    if (error == std::errc::file_exists) {
+                        error = std::make_error_code(std::errc::not_a_directory);
+                    }
+                    if (error && !ec) {
+                        ec = error;
+                    }
+                }
+                int fd = sys::open(paths[i].c_str(), O_RDONLY | O_CREAT, mode);
+                bool made = fd != -1 && sys::close(fd) != -1;
+                if (!made && !ec) {
+                    ec = last_error();
+                }
+                success = made && success;
+            } else {
+                /* Ancestors of the next one get made along with it */
+                const std::string& p(paths[i]);
+                bool ancestor = i + 1 < paths.size() &&
+                    paths[i + 1].compare(0, p.size(), p) == 0 &&
+                    paths[i + 1].size() > p.size() &&
+                    (paths[i + 1][p.size()] == windows_separator ||
+                     paths[i + 1][p.size()] == posix_separator);
+                if (!ancestor) {
+                    success = makedirs(p, error, mode) && success;
+                    if (error && !ec) {
+                        ec = error;
+                    }
+                }
+            }
+        }
+        return success;
+#else
+        /* Find the deepest directory that all of them are in. The root is
+         * represented by a length of zero */
+        if (paths.empty()) {
+            return true;
+        }
+        const std::string& front(paths.front());
+        size_t common = files ? front.rfind(separator) : front.size();
+        for (const std::string& p : paths) {
+            size_t length = files ? p.rfind(separator) : p.size();
+            size_t limit = std::min(common, length);
+            size_t i = 0;
+            while (i < limit && front[i] == p[i]) {
+                ++i;
+            }
+            bool whole = i == limit &&
+                (common == length || (common > length ? front[i] : p[i]) == separator);
+            common = whole ? i : front.rfind(separator, i - 1);
+        }
+
+        /* The common ancestor might itself be one of the directories,
+         * in which case the rest are made relative to its parent */
+        for (const std::string& p : paths) {
+            if (p.size() == common) {
+                common = front.rfind(separator, common - 1);
+                break;
+            }
+        }
+
+        std::string ancestor(common == 0 ? std::string(1, separator) : front.substr(0, common));
+        if (!makedirs(Path(ancestor), ec, mode)) {
+            /* It's above all of them, so a file there means they're not in a
+             * directory, like `makedirs` reports for one path */
+            if (ec == std::errc::file_exists) {
+                ec = std::make_error_code(std::errc::not_a_directory);
+            }
+            return false;
+        }
+        int fd = sys::open(ancestor.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            ec = last_error();
+            return false;
+        }
+
+        /* Group the paths by the subtree they're in under the ancestor */
+        std::vector<std::pair<size_t, size_t> > groups;
+        for (size_t i = 0; i < paths.size(); ) {
+            size_t stop = paths[i].find(separator, common + 1);
+            std::string_view name(std::string_view(paths[i]).substr(common + 1, stop - common - 1));
+            size_t j = i + 1;
+            while (j < paths.size() && paths[j].compare(common + 1, name.size(), name) == 0 &&
+                   (paths[j].size() == common + 1 + name.size() ||
+                    paths[j][common + 1 + name.size()] == separator)) {
+                ++j;
+            }
+            groups.emplace_back(i, j);
+            i = j;
+        }
+
+        std::atomic<size_t> next(0);
+        std::atomic<bool> success(true);
+        std::mutex lock;
+        auto work = [&]() {
+            std::error_code error;
+            for (size_t i = next++; i < groups.size(); i = next++) {
+                if (!create_at(fd, common, paths, groups[i].first, groups[i].second,
+                               files, mode, error)) {
+                    success = false;
+                    std::lock_guard<std::mutex> guard(lock);
+                    if (!ec) {
+                        ec = error;
+                    }
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads && i < groups.size(); ++i) {
+            workers.push_back(std::thread(work));
+        }
+        work();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        sys::close(fd);
+        return success;
+#endif
+    }
+
+#if !defined(_WIN32)
+    inline bool Path::create_at(int fd, size_t length, std::vector<std::string>& paths,
+                                size_t first, size_t last, bool files, mode_t mode,
+                                std::error_code& ec) {
+        /* The directories leading to the last path, which are all open */
+        std::vector<std::pair<int, size_t> > open_dirs(1, std::make_pair(fd, length));
+        const std::string* previous = NULL;
+        bool success = true;
+
+        for (size_t i = first; i < last; ++i) {
+            std::string& p(paths[i]);
+            size_t target = files ? p.rfind(separator) : p.size();
+
+            /* Close anything the previous path needed that this one doesn't */
+            while (open_dirs.size() > 1) {
+                size_t size = open_dirs.back().second;
+                if (size <= target && p.compare(0, size, *previous, 0, size) == 0 &&
+                    (size == p.size() || p[size] == separator)) {
+                    break;
+                }
+                sys::close(open_dirs.back().first);
+                open_dirs.pop_back();
+            }
+            previous = &p;
+
+            /* Make each missing directory down to the target, opening the ones
+             * that something else is going to be made in */
+            bool made = true;
+            for (size_t start = open_dirs.back().second + 1; made && start <= target; ) {
+                size_t stop = std::min(p.find(separator, start), p.size());
+                int dir = open_dirs.back().first;
+                const char* name = &p[start];
+                char saved = p[stop];
+                p[stop] = '\0';
+
+                bool below = i + 1 < last && paths[i + 1].size() > stop &&
+                    paths[i + 1][stop] == separator && paths[i + 1].compare(0, stop, p, 0, stop) == 0;
+                int result = sys::mkdirat(dir, name, mode);
+                if (result != 0 && errno != EEXIST) {
+                    made = false;
+                } else if (stop < target || files || below) {
+                    int child = sys::openat(dir, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                    if (child < 0) {
+                        made = false;
+                    } else {
+                        open_dirs.emplace_back(child, stop);
+                    }
+                } else if (result != 0) {
+                    /* Something's already there, so make sure it's a directory */
+                    struct stat buf;
+                    made = sys::fstatat(dir, name, &buf, 0) == 0 && S_ISDIR(buf.st_mode);
+                    if (!made) {
+                        errno = EEXIST;
+                    }
+                }
+                if (!made && !ec) {
+                    ec = last_error();
+                }
+
+                p[stop] = saved;
+                start = stop + 1;
+            }
+
+            if (made && files) {
+                int file = sys::openat(open_dirs.back().first, p.c_str() + target + 1,
+                                  O_RDONLY | O_CREAT | O_CLOEXEC, mode);
+                made = file != -1 && sys::close(file) != -1;
+                if (!made && !ec) {
+                    ec = last_error();
+                }
+            }
+            success = made && success;
+        }
+
+        for (size_t i = 1; i < open_dirs.size(); ++i) {
+            sys::close(open_dirs[i].first);
+        }
+        return success;
+    }
+#endif
+
+    inline bool Path::rmdirs(const Path& p, bool ignore_errors,
+        unsigned threads) {
+        std::error_code ec;
+        bool success = rmdirs(p, ec, ignore_errors, threads);
+        if (ec && !ignore_errors) {
+            complain("rmdirs", ec);
+        }
+        return success;
+    }
+
+    inline bool Path::rmdirs(const Path& p, std::error_code& ec,
+        bool ignore_errors, unsigned threads) {
+        APATHY_TIME(rmdirs);
+        ec.clear();
+#if defined(_WIN32)
+        (void)(threads);
+        bool success = true;
+
+        Path base(p);
+        base.absolute(ec);
+        if (ec) {
+            return false;
+        }
+        std::vector<Path> contents = recursive_listdir(base);
+        contents.push_back(base);
+
+        //We sort the paths based on the lenght so as to make it easy for rmdir
+        std::sort(contents.begin(), contents.end(),
+                  [](const Path& a, const Path& b)
+                  {
+                      return a.path.size() > b.path.size();
+                  });
+
+        for (const Path &p : contents)
+        {
+            success = p.is_directory()
+                      ? (sys::rmdir(p.path.c_str()) == 0)
+                      : (sys::unlink(p.path.c_str()) == 0);
+
+            if (!success)
+            {
+                if (!ec) {
+                    ec = last_error();
+                }
+                if (!ignore_errors) {
+                    break;
+                }
+            }
+        }
+
+        return !ec;
+#else
+        if (threads <= 1 || !p.symlink_status().is_directory()) {
+            return remove_at(AT_FDCWD, p.path.c_str(), ignore_errors, ec);
+        }
+
+        /* Share out the entries of the top directory between the threads */
+        DIR* dir = sys::opendir(p.path.c_str());
+        if (dir == NULL) {
+            ec = last_error();
+            return false;
+        }
+
+        std::vector<std::string> names;
+        for (dirent* ent = sys::readdir(dir); ent != NULL; ent = sys::readdir(dir)) {
+            if (strcmp(ent->d_name, "..") && strcmp(ent->d_name, ".")) {
+                names.push_back(ent->d_name);
+            }
+        }
+
+        std::atomic<size_t> next(0);
+        std::atomic<bool> success(true);
+        std::mutex lock;
+        auto work = [&]() {
+            std::error_code error;
+            for (size_t i = next++; i < names.size(); i = next++) {
+                if (!remove_at(dirfd(dir), names[i].c_str(), ignore_errors, error)) {
+                    success = false;
+                    {
+                        std::lock_guard<std::mutex> guard(lock);
+                        if (!ec) {
+                            ec = error;
+                        }
+                    }
+                    if (!ignore_errors) {
+                        return;
+                    }
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads; ++i) {
+            workers.push_back(std::thread(work));
+        }
+        work();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        sys::closedir(dir);
+
+        if (!success && !ignore_errors) {
+            return false;
+        }
+
+        if (sys::rmdir(p.path.c_str()) != 0) {
+            if (!ec) {
+                ec = last_error();
+            }
+            return false;
+        }
+        return success;
+#endif
+    }
+
+    /* List all the paths in a directory
+     *
+     * @param p - path to list items for */
+    inline std::vector<Path> Path::listdir(const Path& p) {
+        std::vector<Path> results;
+        std::error_code ec;
+        listdir_into(p, results, ec);
+        return results;
+    }
+
+    inline std::vector<Path> Path::listdir(const Path& p, std::error_code& ec) {
+        std::vector<Path> results;
+        listdir_into(p, results, ec);
+        return results;
+    }
+
+    inline std::pmr::vector<Path> Path::listdir(const Path& p,
+        std::pmr::memory_resource* resource) {
+        std::pmr::vector<Path> results(resource);
+        std::error_code ec;
+        listdir_into(p, results, ec);
+        return results;
+    }
+
+    template <class Paths>
+    inline void Path::listdir_into(const Path& p, Paths& results,
+                                   std::error_code& ec) {
+        APATHY_TIME(listdir);
+        ec.clear();
+        Path base(p);
+        base.absolute(ec);
+        if (ec) {
+            return;
+        }
+        DIR* dir = sys::opendir(base.path.c_str());
+        if (dir == NULL) {
+            /* If there was an error, return an empty vector */
+            ec = last_error();
+            return;
+        }
+
+        /* Otherwise, go through everything. readdir only sets errno if
+         * there's an error, and not at the end */
+        errno = 0;
+        for (dirent* ent = sys::readdir(dir); ent != NULL; ent = sys::readdir(dir)) {
+            /* Skip the parent directory listing */
+            if (!strcmp(ent->d_name, "..")) {
+                continue;
+            }
+
+            /* Skip the self directory listing */
+            if (!strcmp(ent->d_name, ".")) {
+                continue;
+            }
+
+            /* This picks up the vector's allocator, if it has one */
+            results.emplace_back();
+            child(base, ent->d_name, results.back());
+        }
+        if (errno != 0) {
+            ec = last_error();
+        }
+
+        sys::closedir(dir);
+    }
+
+    inline std::vector<Path::Entry> Path::scandir(const Path& p) {
+        std::error_code ec;
+        return scandir(p, ec);
+    }
+
+    inline std::vector<Path::Entry> Path::scandir(const Path& p, std::error_code& ec) {
+        APATHY_TIME(scandir);
+        ec.clear();
+        Path base(p);
+        std::vector<Entry> results;
+        base.absolute(ec);
+        if (ec) {
+            return results;
+        }
+        DIR* dir = sys::opendir(base.string().c_str());
+        if (dir == NULL) {
+            /* If there was an error, return an empty vector */
+            ec = last_error();
+            return results;
+        }
+
+        Entry entry;
+        while (read_entry(dir, base, entry)) {
+            results.push_back(std::move(entry));
+        }
+        if (errno != 0) {
+            ec = last_error();
+        }
+
+        sys::closedir(dir);
+        return results;
+    }
+
+    inline bool Path::read_entry(DIR* dir, const Path& base, Entry& entry) {
+        while (true) {
+            /* readdir only sets errno if there's an error, and not at the end */
+            errno = 0;
+            dirent* ent = sys::readdir(dir);
+            if (ent == NULL) {
+                return false;
+            }
+            if (!strcmp(ent->d_name, "..") || !strcmp(ent->d_name, ".")) {
+                continue;
+            }
+
+            /* Build the path in place, so iterating can reuse its buffer */
+            std::pmr::string& path(entry.path.path);
+            path.assign(base.path);
+            if (!base.trailing_slash()) {
+                path.push_back(separator);
+            }
+            path.append(ent->d_name);
+
+            entry.inode = 0;
+#if !defined(_WIN32)
+            entry.inode = ent->d_ino;
+#endif
+            if (!entry_type(ent, entry.type)) {
+#if defined(_WIN32)
+                entry.type = entry.path.symlink_status().type;
+#else
+                entry.type = status_at(dirfd(dir), ent->d_name, false).type;
+#endif
+            }
+            return true;
+        }
+    }
+
+    inline void Path::child(const Path& base, const char* name, Path& result) {
+        size_t length = strlen(name);
+        result.path.reserve(base.path.size() + length + 1);
+        result.path.assign(base.path);
+        if (!result.trailing_slash()) {
+            result.path.push_back(separator);
+        }
+        result.path.append(name, length);
+    }
+
+#if !defined(_WIN32)
+    inline Path::Status Path::status_at(int fd, const char* name, bool follow_symlinks) {
+        struct stat buf;
+        if (sys::fstatat(fd, name, &buf, follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW) != 0) {
+            return Status();
+        }
+        return Status(buf);
+    }
+#endif
+
+#if !defined(_WIN32)
+    inline DIR* Path::opendir_at(int fd, const char* name, bool follow_symlinks) {
+        int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+        if (!follow_symlinks) {
+            flags |= O_NOFOLLOW;
+        }
+
+        int dir_fd = sys::openat(fd, name, flags);
+        if (dir_fd < 0) {
+            return NULL;
+        }
+
+        DIR* dir = sys::fdopendir(dir_fd);
+        if (dir == NULL) {
+            sys::close(dir_fd);
+        }
+        return dir;
+    }
+
+    inline bool Path::remove_at(int fd, const char* name, bool ignore_errors,
+                                std::error_code& ec) {
+        if (!status_at(fd, name, false).is_directory()) {
+            if (sys::unlinkat(fd, name, 0) == 0) {
+                return true;
+            }
+            if (!ec) {
+                ec = last_error();
+            }
+            return false;
+        }
+
+        /* Each directory we're in the middle of emptying, along with its name
+         * in the directory below it on the stack */
+        std::vector<std::pair<DIR*, std::string> > stack;
+        bool success = true;
+
+        /* Record a failure, and return whether we should give up */
+        auto failed = [&]() {
+            success = false;
+            if (!ec) {
+                ec = last_error();
+            }
+            if (ignore_errors) {
+                return false;
+            }
+
+            for (std::pair<DIR*, std::string>& level : stack) {
+                sys::closedir(level.first);
+            }
+            return true;
+        };
+
+        DIR* root = opendir_at(fd, name, false);
+        if (root == NULL) {
+            failed();
+            return false;
+        }
+        stack.push_back(std::make_pair(root, std::string(name)));
+
+        while (!stack.empty()) {
+            DIR* current = stack.back().first;
+            dirent* ent = sys::readdir(current);
+
+            /* Once a directory is empty, it can go */
+            if (ent == NULL) {
+                std::string done(std::move(stack.back().second));
+                sys::closedir(current);
+                stack.pop_back();
+
+                int parent = stack.empty() ? fd : dirfd(stack.back().first);
+                if (sys::unlinkat(parent, done.c_str(), AT_REMOVEDIR) != 0 && failed()) {
+                    return false;
+                }
+                continue;
+            }
+
+            if (!strcmp(ent->d_name, "..") || !strcmp(ent->d_name, ".")) {
+                continue;
+            }
+
+            Status::Type type;
+            if (!entry_type(ent, type)) {
+                type = status_at(dirfd(current), ent->d_name, false).type;
+            }
+
+            if (type == Status::directory) {
+                DIR* child = opendir_at(dirfd(current), ent->d_name, false);
+                if (child != NULL) {
+                    stack.push_back(std::make_pair(child, std::string(ent->d_name)));
+                } else if (failed()) {
+                    return false;
+                }
+            } else if (sys::unlinkat(dirfd(current), ent->d_name, 0) != 0 && failed()) {
+                return false;
+            }
+        }
+
+        return success;
+    }
+#endif
+
+    inline bool Path::entry_type(const dirent* ent, Status::Type& type) {
+#if defined(DT_UNKNOWN)
+        switch (ent->d_type) {
+            case DT_REG: type = Status::file; return true;
+            case DT_DIR: type = Status::directory; return true;
+            case DT_LNK: type = Status::symlink; return true;
+            case DT_UNKNOWN: return false;
+            default: type = Status::other; return true;
+        }
+#else
+        (void)(ent);
+        (void)(type);
+        return false;
+#endif
+    }
+
+    inline std::vector<Path> Path::glob(const std::string& pattern) {
+        return Glob(pattern).find();
+    }
+
+    inline std::vector<Path> Path::recursive_listdir(const Path &p) {
+        APATHY_TIME(recursive_listdir);
+        std::vector<Path> results;
+        std::vector<Path> directories_to_visit = {p};
+
+        while (!directories_to_visit.empty())
+        {
+            Path current_dir = std::move(directories_to_visit.back());
+            directories_to_visit.pop_back();
+
+            std::vector<Entry> entries = scandir(current_dir);
+
+            for (auto &entry : entries)
+            {
+                /* Symlinks are followed, as far as telling whether we should
+                 * descend into them goes */
+                if (entry.is_directory() ||
+                    (entry.is_symlink() && entry.path.is_directory()))
+                {
+                    directories_to_visit.push_back(entry.path);
+                }
+
+                results.push_back(std::move(entry.path));
+            }
+        }
+
+        return results;
+    }
+
+    inline std::pmr::vector<Path> Path::recursive_listdir(const Path &p,
+        std::pmr::memory_resource* resource) {
+        APATHY_TIME(recursive_listdir);
+        /* Walking lazily, the only paths we allocate are the results */
+        std::pmr::vector<Path> results(resource);
+        for (const Entry& entry : walk(p)) {
+            results.emplace_back(entry.path.view().string());
+        }
+        return results;
+    }
+
+    /**************************************************************************
+     * StatCache
+     *************************************************************************/
+    inline Path::Status StatCache::status(const Path& p) {
+        std::unordered_map<std::pmr::string, Path::Status>::iterator it(
+            entries.find(p.path));
+        if (it != entries.end()) {
+            return it->second;
+        }
+
+        Path::Status result(follow_symlinks ? p.status() : p.symlink_status());
+        entries.emplace(p.path, result);
+        return result;
+    }
+
+    /**************************************************************************
+     * SharedPathCache
+     *************************************************************************/
+    inline Path SharedPathCache::normalize(const Path& p) {
+        Shard& s(shard(p));
+        {
+            std::shared_lock<std::shared_mutex> guard(s.lock);
+            std::unordered_map<std::pmr::string, Path>::const_iterator it(
+                s.normalized.find(p.path));
+            if (it != s.normalized.end()) {
+                return it->second;
+            }
+        }
+
+        Path result(p);
+        result.absolute().sanitize();
+        std::unique_lock<std::shared_mutex> guard(s.lock);
+        return s.normalized.emplace(p.path, std::move(result)).first->second;
+    }
+
+    inline Path::Status SharedPathCache::status(const Path& p) {
+        Shard& s(shard(p));
+        {
+            std::shared_lock<std::shared_mutex> guard(s.lock);
+            std::unordered_map<std::pmr::string, Path::Status>::const_iterator it(
+                s.statuses.find(p.path));
+            if (it != s.statuses.end()) {
+                return it->second;
+            }
+        }
+
+        Path::Status result(follow_symlinks ? p.status() : p.symlink_status());
+        std::unique_lock<std::shared_mutex> guard(s.lock);
+        return s.statuses.emplace(p.path, result).first->second;
+    }
+
+    inline void SharedPathCache::invalidate(const Path& p) {
+        Shard& s(shard(p));
+        std::unique_lock<std::shared_mutex> guard(s.lock);
+        s.normalized.erase(p.path);
+        s.statuses.erase(p.path);
+    }
+
+    inline void SharedPathCache::clear() {
+        for (Shard& s : shards) {
+            std::unique_lock<std::shared_mutex> guard(s.lock);
+            s.normalized.clear();
+            s.statuses.clear();
+        }
+    }
+
+    inline size_t SharedPathCache::size() const {
+        size_t result = 0;
+        for (const Shard& s : shards) {
+            std::shared_lock<std::shared_mutex> guard(s.lock);
+            result += s.normalized.size() + s.statuses.size();
+        }
+        return result;
+    }
+
+    /**************************************************************************
+     * TreeWalker
+     *************************************************************************/
+    inline TreeWalker::TreeWalker(unsigned threads, bool follow):
+        thread_count(threads), follow_symlinks(follow) {
+        if (thread_count == 0) {
+            thread_count = std::max(1u, std::thread::hardware_concurrency());
+        }
+    }
+
+    inline void TreeWalker::walk(const Path& root,
+        const std::function<void(const Path::Entry&)>& callback) const {
+        run(root, [&callback](unsigned, Path::Entry& entry) {
+            callback(entry);
+        });
+    }
+
+    inline std::vector<Path> TreeWalker::listdir(const Path& root,
+        bool sorted) const {
+        /* Each thread gathers its own results, so they don't contend */
+        std::vector<std::vector<Path> > found(thread_count);
+        run(root, [&found](unsigned worker, Path::Entry& entry) {
+            /* Those we might walk into still need their paths */
+            if (entry.is_directory() || entry.is_symlink()) {
+                found[worker].push_back(entry.path);
+            } else {
+                found[worker].push_back(std::move(entry.path));
+            }
+        });
+
+        size_t count = 0;
+        for (const std::vector<Path>& paths : found) {
+            count += paths.size();
+        }
+
+        std::vector<Path> results;
+        results.reserve(count);
+        for (std::vector<Path>& paths : found) {
+            std::move(paths.begin(), paths.end(), std::back_inserter(results));
+        }
+
+        if (sorted) {
+            std::sort(results.begin(), results.end(),
+                [](const Path& a, const Path& b) {
+                    return a.view().string() < b.view().string();
+                });
+        }
+        return results;
+    }
+
+    inline void TreeWalker::run(const Path& root,
+        const std::function<void(unsigned, Path::Entry&)>& callback) const {
+        APATHY_TIME(tree_walk);
+        /* The directories each thread has yet to read */
+        struct Pending {
+            Pending(): lock(), directories() {}
+
+            std::mutex lock;
+            std::deque<Path> directories;
+        };
+        std::unique_ptr<Pending[]> pending(new Pending[thread_count]);
+
+        /* Directories that are queued or being read. When this reaches 0,
+         * there's nothing left for anyone to find */
+        std::atomic<size_t> outstanding(1);
+        /* Directories that are queued, for idle threads to wait on */
+        std::atomic<size_t> queued(1);
+        std::atomic<bool> stopped(false);
+        std::mutex idle_lock;
+        std::condition_variable idle;
+        std::exception_ptr error;
+
+        pending[0].directories.push_back(Path(root).absolute());
+
+        auto take = [&](unsigned worker, Path& directory) {
+            /* First from the back of our own deque... */
+            {
+                std::lock_guard<std::mutex> guard(pending[worker].lock);
+                if (!pending[worker].directories.empty()) {
+                    directory = std::move(pending[worker].directories.back());
+                    pending[worker].directories.pop_back();
+                    return true;
+                }
+            }
+
+            /* ... and otherwise from the front of someone else's */
+            for (unsigned i = 1; i < thread_count; ++i) {
+                Pending& victim = pending[(worker + i) % thread_count];
+                std::lock_guard<std::mutex> guard(victim.lock);
+                if (!victim.directories.empty()) {
+                    directory = std::move(victim.directories.front());
+                    victim.directories.pop_front();
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        auto work = [&](unsigned worker) {
+            Path directory;
+            while (!stopped) {
+                if (!take(worker, directory)) {
+                    std::unique_lock<std::mutex> guard(idle_lock);
+                    idle.wait(guard, [&]() {
+                        return queued > 0 || outstanding == 0 || stopped;
+                    });
+                    if (outstanding == 0) {
+                        return;
+                    }
+                    continue;
+                }
+                --queued;
+
+                try {
+                    std::vector<Path::Entry> entries(Path::scandir(directory));
+                    for (Path::Entry& entry : entries) {
+                        bool descend = entry.is_directory() || (follow_symlinks &&
+                            entry.is_symlink() && entry.path.is_directory());
+
+                        /* The callback leaves us the paths of directories and
+                         * symlinks, so the path can go straight in the deque */
+                        callback(worker, entry);
+
+                        if (descend) {
+                            ++outstanding;
+                            ++queued;
+                            {
+                                std::lock_guard<std::mutex> guard(pending[worker].lock);
+                                pending[worker].directories.push_back(std::move(entry.path));
+                            }
+                            std::lock_guard<std::mutex> guard(idle_lock);
+                            idle.notify_one();
+                        }
+                    }
+                } catch (...) {
+                    std::lock_guard<std::mutex> guard(idle_lock);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    stopped = true;
+                    idle.notify_all();
+                    return;
+                }
+
+                if (--outstanding == 0) {
+                    std::lock_guard<std::mutex> guard(idle_lock);
+                    idle.notify_all();
+                }
+            }
+        };
+
+        /* The calling thread does its share of the walking, too */
+        std::vector<std::thread> threads;
+        for (unsigned worker = 1; worker < thread_count; ++worker) {
+            threads.push_back(std::thread(work, worker));
+        }
+        work(0);
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    /**************************************************************************
+     * Directory Iterators
+     *************************************************************************/
+    inline DirectoryIterator::DirectoryIterator(const Path& p): state() {
+        Path base(p);
+        base.absolute();
+        DIR* dir = sys::opendir(base.path.c_str());
+        if (dir == NULL) {
+            return;
+        }
+
+        state = std::make_shared<State>(dir, base);
+        ++(*this);
+    }
+
+    inline DirectoryIterator& DirectoryIterator::operator++() {
+        if (!Path::read_entry(state->dir, state->base, state->entry)) {
+            state->done = true;
+            state.reset();
+        }
+        return *this;
+    }
+
+    inline RecursiveDirectoryIterator::State::~State() {
+        for (std::pair<DIR*, Path>& directory : directories) {
+            sys::closedir(directory.first);
+        }
+    }
+
+    inline RecursiveDirectoryIterator::RecursiveDirectoryIterator(
+        const Path& p, bool follow_symlinks): state() {
+        Path base(p);
+        base.absolute();
+        DIR* dir = sys::opendir(base.path.c_str());
+        if (dir == NULL) {
+            return;
+        }
+
+        state = std::make_shared<State>(follow_symlinks);
+        state->directories.push_back(std::make_pair(dir, std::move(base)));
+        advance();
+    }
+
+    inline RecursiveDirectoryIterator& RecursiveDirectoryIterator::operator++() {
+        /* Descend into the current entry first, unless we've been told not
+         * to. If we can't open it, we just move on */
+        if (state->descend) {
+            const Path::Entry& entry(state->entry);
+            bool directory = entry.is_directory() || (state->follow_symlinks &&
+                entry.is_symlink() && status(true).is_directory());
+#if defined(_WIN32)
+            DIR* dir = directory ? sys::opendir(entry.path.path.c_str()) : NULL;
+#else
+            /* The name is the tail of the path, so it's null-terminated.
+             * Unless we meant to follow a symlink, make sure this wasn't
+             * swapped out for one since we read it */
+            DIR* dir = directory ? Path::opendir_at(directory_fd(),
+                entry.name().data(), entry.is_symlink()) : NULL;
+#endif
+            if (dir != NULL) {
+                state->directories.push_back(std::make_pair(dir, entry.path));
+            }
+        }
+
+        advance();
+        return *this;
+    }
+
+    inline Path::Status RecursiveDirectoryIterator::status(bool follow_symlinks) const {
+#if defined(_WIN32)
+        (void)(follow_symlinks);
+        return state->entry.path.status();
+#else
+        return Path::status_at(directory_fd(), state->entry.name().data(),
+            follow_symlinks);
+#endif
+    }
+
+    inline void RecursiveDirectoryIterator::advance() {
+        while (!state->directories.empty()) {
+            std::pair<DIR*, Path>& current(state->directories.back());
+            if (Path::read_entry(current.first, current.second, state->entry)) {
+                state->descend = true;
+                return;
+            }
+
+            sys::closedir(current.first);
+            state->directories.pop_back();
+        }
+
+        /* There's nothing left, so we're the end iterator now */
+        state.reset();
+    }
+
+    inline DirectoryRange<DirectoryIterator> Path::iterate(const Path& p) {
+        return DirectoryRange<DirectoryIterator>(DirectoryIterator(p));
+    }
+
+    inline DirectoryRange<RecursiveDirectoryIterator> Path::walk(const Path& p,
+        bool follow_symlinks) {
+        return DirectoryRange<RecursiveDirectoryIterator>(
+            RecursiveDirectoryIterator(p, follow_symlinks));
+    }
+
+    /**************************************************************************
+     * PathTable
+     *************************************************************************/
+    inline PathTable::PathTable():
+        blocks(),
+        block_used(block_size),
+        names(),
+        name_ids(),
+        nodes(),
+        children()
+    {
+        /* The empty path, which everything descends from */
+        nodes.push_back(Node{0, intern(std::string_view())});
+    }
+
+    inline std::uint32_t PathTable::intern(std::string_view name) {
+        std::unordered_map<std::string_view, std::uint32_t>::iterator it(
+            name_ids.find(name));
+        if (it != name_ids.end()) {
+            return it->second;
+        }
+
+        /* Long names get a block of their own */
+        char* storage;
+        if (name.size() > block_size) {
+            blocks.push_back(std::unique_ptr<char[]>(new char[name.size()]));
+            storage = blocks.back().get();
+            block_used = block_size;
+        } else {
+            if (blocks.empty() || block_used + name.size() > block_size) {
+                blocks.push_back(std::unique_ptr<char[]>(new char[block_size]));
+                block_used = 0;
+            }
+            storage = blocks.back().get() + block_used;
+            block_used += name.size();
+        }
+        std::copy(name.begin(), name.end(), storage);
+
+        std::string_view stored(storage, name.size());
+        std::uint32_t id = static_cast<std::uint32_t>(names.size());
+        names.push_back(stored);
+        name_ids.emplace(stored, id);
+        return id;
+    }
+
+    template <class Callback>
+    inline bool PathTable::each_segment(const PathView& p, Callback callback) {
+        std::size_t position = 0;
+        for (PathView::iterator it(p.begin()); it != p.end(); ++it, ++position) {
+            std::string_view segment(*it);
+            /* The leading empty segment is what makes a path absolute */
+            if (!segment.empty() || (position == 0 && p.is_absolute())) {
+                if (!callback(segment)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    inline PathTable::id_type PathTable::insert(const PathView& p) {
+        id_type id = 0;
+        each_segment(p, [this, &id](std::string_view segment) {
+            id = insert(id, segment);
+            return true;
+        });
+        return id;
+    }
+
+    inline PathTable::id_type PathTable::insert(id_type parent,
+        std::string_view name) {
+        std::uint32_t name_id = intern(name);
+        std::uint64_t key = child_key(parent, name_id);
+        std::unordered_map<std::uint64_t, id_type>::iterator it(children.find(key));
+        if (it != children.end()) {
+            return it->second;
+        }
+
+        id_type id = static_cast<id_type>(nodes.size());
+        nodes.push_back(Node{parent, name_id});
+        children.emplace(key, id);
+        return id;
+    }
+
+    inline PathTable::id_type PathTable::insert_tree(const Path& root,
+        bool follow_symlinks) {
+        /* The ids of the directories on the way down to the current entry */
+        std::vector<id_type> directories(1, insert(Path(root).absolute().view()));
+
+        DirectoryRange<RecursiveDirectoryIterator> range(
+            Path::walk(root, follow_symlinks));
+        for (RecursiveDirectoryIterator it(range.begin()); it != range.end(); ++it) {
+            directories.resize(it.depth() + 1);
+            directories.push_back(insert(directories.back(), it->name()));
+        }
+        return directories.front();
+    }
+
+    inline PathTable::id_type PathTable::find(const PathView& p) const {
+        id_type id = 0;
+        each_segment(p, [this, &id](std::string_view segment) {
+            std::unordered_map<std::string_view, std::uint32_t>::const_iterator
+                name(name_ids.find(segment));
+            if (name == name_ids.end()) {
+                id = npos;
+                return false;
+            }
+
+            std::unordered_map<std::uint64_t, id_type>::const_iterator child(
+                children.find(child_key(id, name->second)));
+            if (child == children.end()) {
+                id = npos;
+                return false;
+            }
+
+            id = child->second;
+            return true;
+        });
+        return id;
+    }
+
+    inline size_t PathTable::depth(id_type id) const {
+        size_t result = 0;
+        for (; id != 0; id = nodes[id].parent) {
+            ++result;
+        }
+        return result;
+    }
+
+    inline Path PathTable::path(id_type id) const {
+        /* Gather the segments from the leaf up, and then write them out from
+         * the root down */
+        std::vector<id_type> chain;
+        size_t length = 0;
+        for (; id != 0; id = nodes[id].parent) {
+            chain.push_back(id);
+            length += names[nodes[id].name].size() + 1;
+        }
+
+        std::string result;
+        result.reserve(length);
+        for (std::vector<id_type>::reverse_iterator it(chain.rbegin());
+             it != chain.rend(); ++it) {
+            if (it != chain.rbegin()) {
+                result.push_back(separator);
+            }
+            result.append(names[nodes[*it].name]);
+        }
+
+        /* The root, on its own, still needs its separator */
+        if (chain.size() == 1 && names[nodes[chain[0]].name].empty()) {
+            result.push_back(separator);
+        }
+        return Path(result);
+    }
+    /**************************************************************************
+     * Glob
+     *************************************************************************/
+    inline Glob::Glob(std::string_view pattern):
+        text(pattern), segments(), absolute(false), directories_only(false)
+    {
+        absolute = !pattern.empty() && is_separator(pattern[0]);
+        directories_only = !pattern.empty() && is_separator(pattern.back());
+
+        size_t start = 0;
+        while (start < pattern.size()) {
+            /* Find the end of this segment, stepping over escapes */
+            size_t stop = start;
+            bool magic = false;
+            std::string unescaped;
+            while (stop < pattern.size() && !is_separator(pattern[stop])) {
+                char c = pattern[stop];
+#if !defined(_WIN32)
+                if (c == '\\' && stop + 1 < pattern.size()) {
+                    unescaped.push_back(pattern[stop + 1]);
+                    stop += 2;
+                    continue;
+                }
+#endif
+                magic = magic || c == '*' || c == '?' || c == '[';
+                unescaped.push_back(c);
+                ++stop;
+            }
+
+            std::string_view raw(pattern.substr(start, stop - start));
+            if (raw == "**") {
+                /* Consecutive ones don't match anything more than one does */
+                if (segments.empty() || segments.back().kind != Segment::globstar) {
+                    segments.emplace_back(Segment::globstar, std::string());
+                }
+            } else if (magic) {
+                segments.emplace_back(Segment::wildcard, std::string(raw));
+            } else if (!raw.empty()) {
+                segments.emplace_back(Segment::literal, std::move(unescaped));
+            }
+            start = stop + 1;
+        }
+    }
+
+    inline bool Glob::is_separator(char c) {
+#if defined(_WIN32)
+        return c == windows_separator || c == posix_separator;
+#else
+        return c == separator;
+#endif
+    }
+
+    inline size_t Glob::match_char(std::string_view pattern, size_t index, char c) {
+        const size_t npos = std::string_view::npos;
+        if (index >= pattern.size()) {
+            return npos;
+        }
+
+        char p = pattern[index];
+        if (p == '?') {
+            return index + 1;
+        }
+
+        if (p == '[') {
+            size_t i = index + 1;
+            bool negate = i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+            if (negate) {
+                ++i;
+            }
+
+            /* A ']' straight after the opening is part of the set */
+            bool matched = false;
+            for (bool first = true; i < pattern.size() && (first || pattern[i] != ']'); first = false) {
+                unsigned char low = pattern[i];
+#if !defined(_WIN32)
+                if (low == '\\' && i + 1 < pattern.size()) {
+                    low = pattern[++i];
+                }
+#endif
+                unsigned char high = low;
+                if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+                    high = pattern[i + 2];
+                    i += 2;
+                }
+                unsigned char u = c;
+                matched = matched || (low <= u && u <= high);
+                ++i;
+            }
+
+            if (i >= pattern.size()) {
+                /* Without a closing ']', it's just a '[' */
+                return c == '[' ? index + 1 : npos;
+            }
+            return matched != negate ? i + 1 : npos;
+        }
+
+#if !defined(_WIN32)
+        if (p == '\\' && index + 1 < pattern.size()) {
+            return pattern[index + 1] == c ? index + 2 : npos;
+        }
+#endif
+        return p == c ? index + 1 : npos;
+    }
+
+    inline bool Glob::explicit_dot(std::string_view pattern) {
+#if !defined(_WIN32)
+        if (pattern.size() > 1 && pattern[0] == '\\') {
+            return pattern[1] == '.';
+        }
+#endif
+        return !pattern.empty() && pattern[0] == '.';
+    }
+
+    inline bool Glob::match_segment(std::string_view pattern, std::string_view name) {
+        /* Hidden names have to be asked for explicitly */
+        if (!name.empty() && name[0] == '.' && !explicit_dot(pattern)) {
+            return false;
+        }
+
+        /* Match greedily, and on a mismatch let the last '*' take one more
+         * character. There's never any need to back up further than that */
+        const size_t npos = std::string_view::npos;
+        size_t p = 0;
+        size_t n = 0;
+        size_t star = npos;
+        size_t mark = 0;
+        while (n < name.size()) {
+            if (p < pattern.size() && pattern[p] == '*') {
+                star = ++p;
+                mark = n;
+                continue;
+            }
+
+            size_t next = match_char(pattern, p, name[n]);
+            if (next != npos) {
+                p = next;
+                ++n;
+            } else if (star != npos) {
+                p = star;
+                n = ++mark;
+            } else {
+                return false;
+            }
+        }
+
+        while (p < pattern.size() && pattern[p] == '*') {
+            ++p;
+        }
+        return p == pattern.size();
+    }
+
+    inline bool Glob::match(const PathView& p) const {
+        std::string_view s(p.string());
+        if (s.empty() || is_separator(s[0]) != absolute) {
+            return false;
+        }
+        if (directories_only && !is_separator(s.back())) {
+            return false;
+        }
+
+        std::vector<std::string_view> names;
+        size_t start = 0;
+        while (start < s.size()) {
+            size_t stop = start;
+            while (stop < s.size() && !is_separator(s[stop])) {
+                ++stop;
+            }
+            if (stop > start) {
+                names.push_back(s.substr(start, stop - start));
+            }
+            start = stop + 1;
+        }
+        return match_from(0, names, 0);
+    }
+
+    inline bool Glob::match_from(size_t index, const std::vector<std::string_view>& names,
+                                 size_t name_index) const {
+        for (; index < segments.size(); ++index, ++name_index) {
+            const Segment& segment(segments[index]);
+            if (segment.kind == Segment::globstar) {
+                /* Try swallowing each number of names in turn, but never a
+                 * hidden one */
+                for (; name_index <= names.size(); ++name_index) {
+                    if (match_from(index + 1, names, name_index)) {
+                        return true;
+                    }
+                    if (name_index < names.size() && names[name_index][0] == '.') {
+                        return false;
+                    }
+                }
+                return false;
+            }
+
+            if (name_index == names.size()) {
+                return false;
+            }
+
+            if (segment.kind == Segment::literal ? segment.text != names[name_index]
+                                                 : !match_segment(segment.text, names[name_index])) {
+                return false;
+            }
+        }
+        return name_index == names.size();
+    }
+
+    inline void Glob::find(const std::function<bool(const Path&)>& callback) const {
+        APATHY_TIME(glob);
+        if (segments.empty() && !absolute) {
+            return;
+        }
+        search(absolute ? std::string(1, separator) : std::string(), 0, callback);
+    }
+
+    inline std::vector<Path> Glob::find() const {
+        std::vector<Path> results;
+        find([&results](const Path& p) {
+            results.push_back(p);
+            return true;
+        });
+
+        std::sort(results.begin(), results.end(), [](const Path& a, const Path& b) {
+            return a.string() < b.string();
+        });
+        results.erase(std::unique(results.begin(), results.end()), results.end());
+        return results;
+    }
+
+    inline bool Glob::emit(const std::string& path, bool directory,
+                           const std::function<bool(const Path&)>& callback) const {
+        if (!directories_only) {
+            return callback(Path(path));
+        }
+        if (!directory) {
+            return true;
+        }
+
+        Path result(path);
+        result.directory();
+        return callback(result);
+    }
+
+    inline bool Glob::search(const std::string& prefix, size_t index,
+                             const std::function<bool(const Path&)>& callback) const {
+        if (index == segments.size()) {
+            return emit(prefix, true, callback);
+        }
+
+        const Segment& segment(segments[index]);
+        bool last = index + 1 == segments.size();
+        std::string candidate(prefix);
+        if (!candidate.empty() && !is_separator(candidate.back())) {
+            candidate.push_back(separator);
+        }
+        size_t length = candidate.size();
+
+        /* There's only one thing a literal can be, so look it up directly */
+        if (segment.kind == Segment::literal) {
+            candidate.append(segment.text);
+            if (!last) {
+                return !Path(candidate).is_directory() || search(candidate, index + 1, callback);
+            }
+            Path::Status status(Path(candidate).symlink_status());
+            if (!status.exists()) {
+                return true;
+            }
+            return emit(candidate, !directories_only || Path(candidate).is_directory(), callback);
+        }
+
+        /* A globstar can match no directories at all */
+        if (segment.kind == Segment::globstar) {
+            if (last) {
+                if (!prefix.empty() && !emit(prefix, true, callback)) {
+                    return false;
+                }
+            } else if (!search(prefix, index + 1, callback)) {
+                return false;
+            }
+        }
+
+        for (const Path::Entry& entry : Path::iterate(prefix.empty() ? Path(".") : Path(prefix))) {
+            std::string_view name(entry.name());
+            if (segment.kind == Segment::globstar ? name[0] == '.'
+                                                  : !match_segment(segment.text, name)) {
+                continue;
+            }
+
+            candidate.resize(length);
+            candidate.append(name);
+
+            /* Globstars don't follow symlinks, so that they can't loop */
+            bool directory = entry.is_directory();
+            if (segment.kind == Segment::globstar) {
+                /* Everything under a trailing globstar matches. Otherwise,
+                 * keep looking for the rest of the pattern further down */
+                if (directory) {
+                    if (!search(candidate, index, callback)) {
+                        return false;
+                    }
+                } else if (last && !emit(candidate, false, callback)) {
+                    return false;
+                }
+                continue;
+            }
+
+            /* Only look through symlinks when it matters what they are */
+            if (entry.is_symlink() && (!last || directories_only)) {
+                directory = entry.path.is_directory();
+            }
+            if (last) {
+                if (!emit(candidate, directory, callback)) {
+                    return false;
+                }
+            } else if (directory && !search(candidate, index + 1, callback)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**************************************************************************
+     * PathMatcher
+     *************************************************************************/
+    inline PathMatcher::PathMatcher(): patterns(), nodes(2), suffix_lengths() {}
+
+    inline PathMatcher::state_type PathMatcher::transition(state_type from,
+                                                           const Glob::Segment& segment) {
+        state_type next = static_cast<state_type>(nodes.size());
+        if (segment.kind == Glob::Segment::globstar) {
+            if (nodes[from].globstar == npos) {
+                nodes[from].globstar = next;
+                nodes.emplace_back();
+                nodes.back().loops = true;
+            }
+            return nodes[from].globstar;
+        }
+
+        if (segment.kind == Glob::Segment::literal) {
+            std::pair<std::map<std::string, state_type, std::less<> >::iterator, bool> inserted(
+                nodes[from].literals.emplace(segment.text, next));
+            if (inserted.second) {
+                nodes.emplace_back();
+            }
+            return inserted.first->second;
+        }
+
+        /* A '*' followed by plain characters only needs to check the end */
+        const std::string& text(segment.text);
+        if (text[0] == '*' && text.find_first_of("*?[\\", 1) == std::string::npos) {
+            std::string suffix(text.substr(1));
+            std::pair<std::map<std::string, state_type, std::less<> >::iterator, bool> inserted(
+                nodes[from].suffixes.emplace(suffix, next));
+            if (inserted.second) {
+                nodes.emplace_back();
+                std::vector<size_t>::iterator it(std::lower_bound(
+                    suffix_lengths.begin(), suffix_lengths.end(), suffix.size()));
+                if (it == suffix_lengths.end() || *it != suffix.size()) {
+                    suffix_lengths.insert(it, suffix.size());
+                }
+            }
+            return inserted.first->second;
+        }
+
+        for (const std::pair<std::string, state_type>& wildcard : nodes[from].wildcards) {
+            if (wildcard.first == text) {
+                return wildcard.second;
+            }
+        }
+        nodes[from].wildcards.emplace_back(text, next);
+        nodes.emplace_back();
+        return next;
+    }
+
+    inline size_t PathMatcher::add(std::string_view pattern) {
+        Glob glob(pattern);
+        state_type state = glob.absolute ? 1 : 0;
+        for (const Glob::Segment& segment : glob.segments) {
+            state = transition(state, segment);
+        }
+
+        size_t index = patterns.size();
+        patterns.emplace_back(pattern);
+        nodes[state].accepts.emplace_back(index, glob.directories_only);
+        return index;
+    }
+
+    inline void PathMatcher::closure(std::vector<state_type>& states) const {
+        /* Globstars can't directly follow one another, so there's only ever
+         * one level of these to add */
+        size_t count = states.size();
+        for (size_t i = 0; i < count; ++i) {
+            if (nodes[states[i]].globstar != npos) {
+                states.push_back(nodes[states[i]].globstar);
+            }
+        }
+        std::sort(states.begin(), states.end());
+        states.erase(std::unique(states.begin(), states.end()), states.end());
+    }
+
+    inline void PathMatcher::step(const std::vector<state_type>& from,
+                                  std::string_view name,
+                                  std::vector<state_type>& to) const {
+        to.clear();
+        bool hidden = !name.empty() && name[0] == '.';
+        for (state_type state : from) {
+            const Node& node(nodes[state]);
+            if (node.loops && !hidden) {
+                to.push_back(state);
+            }
+
+            std::map<std::string, state_type, std::less<> >::const_iterator it(
+                node.literals.find(name));
+            if (it != node.literals.end()) {
+                to.push_back(it->second);
+            }
+
+            if (!hidden && !node.suffixes.empty()) {
+                for (size_t length : suffix_lengths) {
+                    if (length > name.size()) {
+                        break;
+                    }
+                    it = node.suffixes.find(name.substr(name.size() - length));
+                    if (it != node.suffixes.end()) {
+                        to.push_back(it->second);
+                    }
+                }
+            }
+
+            for (const std::pair<std::string, state_type>& wildcard : node.wildcards) {
+                if (Glob::match_segment(wildcard.first, name)) {
+                    to.push_back(wildcard.second);
+                }
+            }
+        }
+        closure(to);
+    }
+
+    inline void PathMatcher::accepted(const std::vector<state_type>& states,
+                                      bool directory,
+                                      std::vector<size_t>& results) const {
+        results.clear();
+        for (state_type state : states) {
+            for (const std::pair<size_t, bool>& accept : nodes[state].accepts) {
+                if (directory || !accept.second) {
+                    results.push_back(accept.first);
+                }
+            }
+        }
+        std::sort(results.begin(), results.end());
+    }
+
+    inline bool PathMatcher::can_descend(const std::vector<state_type>& states) const {
+        for (state_type state : states) {
+            const Node& node(nodes[state]);
+            if (node.loops || !node.literals.empty() || !node.suffixes.empty() ||
+                !node.wildcards.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline std::vector<size_t> PathMatcher::match(const PathView& p) const {
+        std::vector<size_t> results;
+        std::string_view s(p.string());
+        if (s.empty()) {
+            return results;
+        }
+
+        std::vector<state_type> current(1, Glob::is_separator(s[0]) ? 1 : 0);
+        std::vector<state_type> next;
+        closure(current);
+
+        size_t start = 0;
+        while (start < s.size() && !current.empty()) {
+            size_t stop = start;
+            while (stop < s.size() && !Glob::is_separator(s[stop])) {
+                ++stop;
+            }
+            if (stop > start) {
+                step(current, s.substr(start, stop - start), next);
+                current.swap(next);
+            }
+            start = stop + 1;
+        }
+
+        accepted(current, Glob::is_separator(s.back()), results);
+        return results;
+    }
+
+    inline bool PathMatcher::matches(const PathView& p) const {
+        return !match(p).empty();
+    }
+
+    inline void PathMatcher::walk(const Path& root,
+        const std::function<bool(const Path::Entry&, const std::vector<size_t>&)>& callback,
+        bool follow_symlinks) const {
+        APATHY_TIME(match_walk);
+        /* The states after each directory between the root and the entry */
+        std::vector<std::vector<state_type> > levels(1, std::vector<state_type>(1, 0));
+        closure(levels[0]);
+        if (!can_descend(levels[0])) {
+            return;
+        }
+
+        std::vector<size_t> results;
+        DirectoryRange<RecursiveDirectoryIterator> range(Path::walk(root, follow_symlinks));
+        for (RecursiveDirectoryIterator it(range.begin()); it != range.end(); ++it) {
+            size_t depth = it.depth();
+            if (levels.size() < depth + 2) {
+                levels.resize(depth + 2);
+            }
+            std::vector<state_type>& states(levels[depth + 1]);
+            step(levels[depth], it->name(), states);
+            if (states.empty()) {
+                it.prune();
+                continue;
+            }
+
+            bool directory = it->is_directory() ||
+                (follow_symlinks && it->is_symlink() && it.status(true).is_directory());
+            accepted(states, directory, results);
+            if (!results.empty() && !callback(*it, results)) {
+                return;
+            }
+            if (!directory || !can_descend(states)) {
+                it.prune();
+            }
+        }
+    }
+
+    /**************************************************************************
+     * AsyncFilesystem
+     *************************************************************************/
+    inline AsyncFilesystem::AsyncFilesystem(unsigned threads, size_t c):
+        lock(), not_empty(), not_full(), queue(), capacity(std::max<size_t>(c, 1)),
+        stopping(false), workers()
+    {
+        if (threads == 0) {
+            threads = 4 * std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (unsigned i = 0; i < threads; ++i) {
+            workers.push_back(std::thread(&AsyncFilesystem::work, this));
+        }
+    }
+
+    inline AsyncFilesystem::~AsyncFilesystem() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        not_empty.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    inline size_t AsyncFilesystem::pending() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return queue.size();
+    }
+
+    inline bool AsyncFilesystem::is_worker() const {
+        std::thread::id id(std::this_thread::get_id());
+        for (const std::thread& worker : workers) {
+            if (worker.get_id() == id) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline void AsyncFilesystem::enqueue(std::vector<Task>& tasks) {
+        bool wait = !is_worker();
+        size_t next = 0;
+        while (next < tasks.size()) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                if (wait) {
+                    not_full.wait(guard, [this]() { return queue.size() < capacity; });
+                }
+                for (; next < tasks.size() && (!wait || queue.size() < capacity); ++next) {
+                    queue.push_back(std::move(tasks[next]));
+                }
+            }
+            not_empty.notify_all();
+        }
+    }
+
+    inline void AsyncFilesystem::work() {
+        while (true) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                not_empty.wait(guard, [this]() { return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                task = std::move(queue.front());
+                queue.pop_front();
+            }
+            not_full.notify_one();
+            task();
+        }
+    }
+
+    template <class F>
+    inline std::future<std::invoke_result_t<F> > AsyncFilesystem::submit(F f) {
+        /* Tasks have to be copyable to go in a std::function */
+        typedef std::invoke_result_t<F> Result;
+        std::shared_ptr<std::packaged_task<Result()> > task(
+            std::make_shared<std::packaged_task<Result()> >(std::move(f)));
+        std::future<Result> result(task->get_future());
+
+        std::vector<Task> tasks(1, [task]() { (*task)(); });
+        enqueue(tasks);
+        return result;
+    }
+
+    template <class F>
+    inline std::vector<std::future<std::invoke_result_t<F, const Path&> > >
+        AsyncFilesystem::submit_all(const std::vector<Path>& paths, F f) {
+        typedef std::invoke_result_t<F, const Path&> Result;
+        std::vector<std::future<Result> > results;
+        std::vector<Task> tasks;
+        results.reserve(paths.size());
+        tasks.reserve(paths.size());
+        for (const Path& p : paths) {
+            std::shared_ptr<std::packaged_task<Result()> > task(
+                std::make_shared<std::packaged_task<Result()> >([f, p]() { return f(p); }));
+            results.push_back(task->get_future());
+            tasks.push_back([task]() { (*task)(); });
+        }
+        enqueue(tasks);
+        return results;
+    }
+
+    inline std::future<bool> AsyncFilesystem::exists(const Path& p) {
+        return submit([p]() { return p.exists(); });
+    }
+
+    inline std::future<bool> AsyncFilesystem::is_file(const Path& p) {
+        return submit([p]() { return p.is_file(); });
+    }
+
+    inline std::future<bool> AsyncFilesystem::is_directory(const Path& p) {
+        return submit([p]() { return p.is_directory(); });
+    }
+
+    inline std::future<size_t> AsyncFilesystem::size(const Path& p) {
+        return submit([p]() { return p.size(); });
+    }
+
+    inline std::future<Path::Status> AsyncFilesystem::status(const Path& p) {
+        return submit([p]() { return p.status(); });
+    }
+
+    inline std::future<std::vector<Path> > AsyncFilesystem::listdir(const Path& p) {
+        return submit([p]() { return Path::listdir(p); });
+    }
+
+    inline std::future<std::error_code> AsyncFilesystem::touch(const Path& p, mode_t mode) {
+        return submit([p, mode]() {
+            std::error_code ec;
+            Path::touch(p, ec, mode);
+            return ec;
+        });
+    }
+
+    inline std::future<std::error_code> AsyncFilesystem::move(const Path& source,
+        const Path& dest, bool mkdirs) {
+        return submit([source, dest, mkdirs]() {
+            std::error_code ec;
+            Path::move(source, dest, ec, mkdirs);
+            return ec;
+        });
+    }
+
+    inline std::future<std::error_code> AsyncFilesystem::rm(const Path& p) {
+        return submit([p]() {
+            std::error_code ec;
+            Path::rm(p, ec);
+            return ec;
+        });
+    }
+
+    inline std::future<std::error_code> AsyncFilesystem::makedirs(const Path& p,
+        mode_t mode) {
+        return submit([p, mode]() {
+            std::error_code ec;
+            Path::makedirs(p, ec, mode);
+            return ec;
+        });
+    }
+
+    inline std::vector<std::future<Path::Status> > AsyncFilesystem::status(
+        const std::vector<Path>& paths) {
+        return submit_all(paths, [](const Path& p) { return p.status(); });
+    }
+
+    /**************************************************************************
+     * MappedFile
+     *************************************************************************/
+    inline MappedFile::MappedFile(const Path& p, Advice advice):
+        address(NULL), length(0), opened(false)
+    {
+#if defined(_WIN32)
+        HANDLE file = CreateFileA(p.string().c_str(), GENERIC_READ, FILE_SHARE_READ,
+            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(file, &size)) {
+            length = static_cast<size_t>(size.QuadPart);
+            opened = length == 0;
+            HANDLE mapping = length ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+            if (mapping != NULL) {
+                address = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+                opened = address != NULL;
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+        if (!opened) {
+            length = 0;
+        }
+#else
+        int fd = sys::open(p.string().c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+
+        struct stat st;
+        if (sys::fstat(fd, &st) == 0 && !S_ISDIR(st.st_mode)) {
+            length = static_cast<size_t>(st.st_size);
+            if (length == 0) {
+                opened = true;
+            } else {
+                void* result = sys::mmap(length, PROT_READ, MAP_PRIVATE, fd);
+                if (result != MAP_FAILED) {
+                    address = static_cast<char*>(result);
+                    opened = true;
+                } else {
+                    length = 0;
+                }
+            }
+        }
+        sys::close(fd);
+#endif
+
+        if (opened && advice != normal) {
+            advise(advice);
+        }
+    }
+
+    inline MappedFile::MappedFile(MappedFile&& other):
+        address(other.address), length(other.length), opened(other.opened)
+    {
+        other.address = NULL;
+        other.length = 0;
+        other.opened = false;
+    }
+
+    inline MappedFile& MappedFile::operator=(MappedFile&& other) {
+        if (this != &other) {
+            close();
+            std::swap(address, other.address);
+            std::swap(length, other.length);
+            std::swap(opened, other.opened);
+        }
+        return *this;
+    }
+
+    inline bool MappedFile::advise(Advice advice) {
+        if (address == NULL) {
+            return opened;
+        }
+#if defined(_WIN32)
+        (void)(advice);
+        return true;
+#else
+        static const int advices[] = {
+            MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED
+        };
+        return sys::madvise(address, length, advices[advice]) == 0;
+#endif
+    }
+
+    inline void MappedFile::close() {
+        if (address != NULL) {
+#if defined(_WIN32)
+            UnmapViewOfFile(address);
+#else
+            sys::munmap(address, length);
+#endif
+        }
+        address = NULL;
+        length = 0;
+        opened = false;
+    }
+
+    /**************************************************************************
+     * Snapshot
+     *************************************************************************/
+    struct Snapshot::Scan {
+        /* Where the tree is being recorded */
+        Snapshot& next;
+        std::vector<Change>& changes;
+        bool reported;
+        bool stat_files;
+        /* Whether directories that are still there keep what was recorded
+         * under them, rather than being read again */
+        bool shallow;
+        /* The path of the entry we're at */
+        std::string path;
+
+        /* A directory being compared, and how far through it we are */
+        struct Level {
+            /* Where it was recorded, or `npos` */
+            size_t index;
+            /* Where it's being recorded in `next`, or `npos` if that's up to
+             * whoever started the scan */
+            size_t recorded;
+            bool unchanged;
+            /* The name of each entry, and its index if it was recorded */
+            std::vector<std::pair<std::string, size_t> > children;
+            size_t position;
+            /* The length of its path */
+            size_t length;
+        };
+
+        /* The directories we're in, the deepest last, and each one's open
+         * directory, which is NULL once it's closed */
+        std::vector<Level> levels;
+        std::vector<DIR*> directories;
+
+        ~Scan() {
+            for (DIR* dir : directories) {
+                if (dir != NULL) {
+                    sys::closedir(dir);
+                }
+            }
+        }
+
+        void push(std::string_view name) {
+            if (path.empty() || path.back() != separator) {
+                path.push_back(separator);
+            }
+            path.append(name);
+        }
+
+        void report(Change::Kind kind, Path::Status::Type type) {
+            if (reported) {
+                changes.push_back(Change{kind, Path(path), type});
+            }
+        }
+    };
+
+    inline Snapshot::Snapshot(const Path& root): root_path(), nodes(), names() {
+        Path absolute(root);
+        absolute.absolute();
+        Snapshot().compare(absolute, *this, true, false);
+    }
+
+    inline Path::Status Snapshot::find(const PathView& relative) const {
+        if (nodes.empty()) {
+            return Path::Status();
+        }
+
+        size_t index = 0;
+        for (std::string_view segment : relative) {
+            if (segment.empty() || segment == ".") {
+                continue;
+            }
+
+            size_t child = index + 1;
+            while (child < nodes[index].end && name(child) != segment) {
+                child = nodes[child].end;
+            }
+            if (child >= nodes[index].end) {
+                return Path::Status();
+            }
+            index = child;
+        }
+        return nodes[index].status;
+    }
+
+    inline std::vector<Snapshot::Change> Snapshot::diff(bool stat_files) const {
+        Snapshot next;
+        return compare(root_path, next, stat_files, true);
+    }
+
+    inline std::vector<Snapshot::Change> Snapshot::update(bool stat_files) {
+        Snapshot next;
+        std::vector<Change> changes(compare(root_path, next, stat_files, true));
+        *this = std::move(next);
+        return changes;
+    }
+
+    inline std::vector<Snapshot::Change> Snapshot::update_directory(
+        const PathView& relative, bool stat_files) {
+        if (nodes.empty() || !nodes[0].status.is_directory()) {
+            return update(stat_files);
+        }
+
+        /* The recorded directories on the way down, and their paths' lengths */
+        std::string path(root_path.string());
+        std::vector<std::pair<size_t, size_t> > chain(1, std::make_pair(0, path.size()));
+        for (std::string_view segment : relative) {
+            if (segment.empty() || segment == ".") {
+                continue;
+            }
+
+            size_t index = chain.back().first;
+            size_t child = index + 1;
+            while (child < nodes[index].end && name(child) != segment) {
+                child = nodes[child].end;
+            }
+            if (child >= nodes[index].end || !nodes[child].status.is_directory()) {
+                break;
+            }
+            if (path.empty() || path.back() != separator) {
+                path.push_back(separator);
+            }
+            path.append(segment);
+            chain.emplace_back(child, path.size());
+        }
+
+        /* Start from the deepest of them that's still a directory */
+        Path::Status status;
+        for (;;) {
+            path.resize(chain.back().second);
+            if (chain.size() == 1) {
+                status = root_path.status();
+                break;
+            }
+            status = Path(path).symlink_status();
+            if (status.is_directory()) {
+                break;
+            }
+            chain.pop_back();
+        }
+        if (!status.is_directory()) {
+            return update(stat_files);
+        }
+
+        APATHY_TIME(snapshot);
+        size_t index = chain.back().first;
+        std::vector<Change> changes;
+        Snapshot next;
+        Scan state{next, changes, true, stat_files, true, path};
+        size_t top = next.open(name(index), status);
+        DIR* dir = sys::opendir(path.c_str());
+        if (dir != NULL) {
+            scan(state, index, same_listing(nodes[index].status, status), dir);
+        }
+        next.close(top);
+        splice(index, next);
+        return changes;
+    }
+
+    inline void Snapshot::keep(Snapshot& next, size_t index) const {
+        /* Where `index` itself has just been recorded */
+        size_t base = next.nodes.size() - 1;
+        for (size_t i = index + 1; i < nodes[index].end; ++i) {
+            next.nodes.push_back(Node{next.names.size(), nodes[i].name_length,
+                                      nodes[i].end - index + base, nodes[i].status});
+            next.names.append(name(i));
+        }
+    }
+
+    inline void Snapshot::splice(size_t index, const Snapshot& replacement) {
+        size_t first = index;
+        size_t last = nodes[index].end;
+        size_t count = replacement.nodes.size();
+
+        /* Its ancestors, and everything after it, end somewhere else now */
+        size_t used = 0;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (i < first || i >= last) {
+                if (nodes[i].end >= last) {
+                    nodes[i].end = nodes[i].end - last + first + count;
+                }
+                used += nodes[i].name_length;
+            }
+        }
+
+        size_t offset = names.size();
+        names.append(replacement.names);
+        std::vector<Node> inserted(replacement.nodes);
+        for (Node& node : inserted) {
+            node.name_offset += offset;
+            node.end += first;
+        }
+        nodes.erase(nodes.begin() + first, nodes.begin() + last);
+        nodes.insert(nodes.begin() + first, inserted.begin(), inserted.end());
+
+        /* The names that were replaced are left behind, until there are more
+         * of them than there are names in use */
+        used += replacement.names.size();
+        if (names.size() > 2 * used) {
+            std::string compacted;
+            compacted.reserve(used);
+            for (Node& node : nodes) {
+                size_t at = compacted.size();
+                compacted.append(names, node.name_offset, node.name_length);
+                node.name_offset = at;
+            }
+            names.swap(compacted);
+        }
+    }
+
+    inline size_t Snapshot::open(std::string_view name, const Path::Status& status) {
+        nodes.push_back(Node{names.size(), name.size(), npos, status});
+        names.append(name);
+        return nodes.size() - 1;
+    }
+
+    inline bool Snapshot::same(const Path::Status& before, const Path::Status& after) {
+        if (before.type != after.type || before.inode != after.inode ||
+            before.device != after.device) {
+            return false;
+        }
+        /* Directories are reported by what's added to or removed from them */
+        return before.is_directory() || (before.size == after.size &&
+            before.mtime == after.mtime && before.mtime_nsec == after.mtime_nsec);
+    }
+
+    inline bool Snapshot::same_listing(const Path::Status& before, const Path::Status& after) {
+        return before.is_directory() && after.is_directory() &&
+            before.inode == after.inode && before.device == after.device &&
+            before.mtime == after.mtime && before.mtime_nsec == after.mtime_nsec;
+    }
+
+    inline std::vector<Snapshot::Change> Snapshot::compare(
+        const Path& root, Snapshot& next, bool stat_files, bool reported) const {
+        APATHY_TIME(snapshot);
+        std::vector<Change> changes;
+        Scan state{next, changes, reported, stat_files, false, root.string()};
+
+        next.root_path = root;
+        next.nodes.clear();
+        next.names.clear();
+
+        Path::Status status(root.status());
+        size_t top = next.open("", status);
+        size_t index = (!nodes.empty() && nodes[0].status.is_directory()) ? 0 : npos;
+        if (status.is_directory()) {
+            DIR* dir = sys::opendir(state.path.c_str());
+            if (dir != NULL) {
+                scan(state, index,
+                     index != npos && same_listing(nodes[index].status, status), dir);
+            }
+        } else if (index != npos) {
+            for (size_t child = 1; child < nodes[0].end; child = nodes[child].end) {
+                removed(state, child);
+            }
+        }
+        next.close(top);
+        return changes;
+    }
+
+    inline void Snapshot::scan(Scan& state, size_t index, bool unchanged, DIR* dir) const {
+        size_t bottom = state.levels.size();
+        state.levels.push_back(Scan::Level{index, npos, unchanged, {}, 0, state.path.size()});
+        state.directories.push_back(dir);
+        list(state);
+
+        while (state.levels.size() > bottom) {
+            Scan::Level& level(state.levels.back());
+            if (level.position == level.children.size()) {
+                /* Done with this one, so back up to its parent */
+                if (state.directories.back() != NULL) {
+                    sys::closedir(state.directories.back());
+                }
+                if (level.recorded != npos) {
+                    state.next.close(level.recorded);
+                }
+                state.path.resize(level.length);
+                state.levels.pop_back();
+                state.directories.pop_back();
+                continue;
+            }
+
+            std::pair<std::string, size_t>& entry(level.children[level.position++]);
+            std::string child_name(std::move(entry.first));
+            size_t child = entry.second;
+            const Path::Status* before = child == npos ? NULL : &nodes[child].status;
+            size_t length = level.length;
+            DIR* parent = state.directories.back();
+
+            state.path.resize(length);
+            state.push(child_name);
+
+            Path::Status status;
+            if (level.unchanged && !state.stat_files && !before->is_directory()) {
+                status = *before;
+#if !defined(_WIN32)
+            } else if (parent != NULL) {
+                status = Path::status_at(dirfd(parent), child_name.c_str(), false);
+#endif
+            } else {
+                status = Path(state.path).symlink_status();
+            }
+
+            /* It went away while we were looking */
+            if (!status.exists()) {
+                state.path.resize(length);
+                if (before != NULL) {
+                    removed(state, child);
+                }
+                continue;
+            }
+
+            size_t recorded = state.next.open(child_name, status);
+            if (before == NULL) {
+                state.report(Change::added, status.type);
+            } else if (!same(*before, status)) {
+                state.report(Change::modified, status.type);
+            }
+
+            bool was_directory = before != NULL && before->is_directory();
+            if (state.shallow && was_directory && status.is_directory() &&
+                before->inode == status.inode && before->device == status.device) {
+                /* Along with the mtime its listing was recorded with, so that
+                 * it's read the next time it's compared */
+                state.next.nodes[recorded].status = *before;
+                keep(state.next, child);
+            } else if (status.is_directory()) {
+#if defined(_WIN32)
+                DIR* subdirectory = sys::opendir(state.path.c_str());
+#else
+                DIR* subdirectory = parent != NULL ?
+                    Path::opendir_at(dirfd(parent), child_name.c_str(), false) :
+                    sys::opendir(state.path.c_str());
+#endif
+                if (subdirectory != NULL) {
+                    /* Its entry is closed once we're back up from it */
+                    state.levels.push_back(Scan::Level{was_directory ? child : npos,
+                        recorded, was_directory && same_listing(*before, status),
+                        {}, 0, state.path.size()});
+                    state.directories.push_back(subdirectory);
+                    list(state);
+                    continue;
+                }
+            } else if (was_directory) {
+                for (size_t grandchild = child + 1; grandchild < nodes[child].end;
+                     grandchild = nodes[grandchild].end) {
+                    removed(state, grandchild);
+                }
+            }
+            state.next.close(recorded);
+        }
+    }
+
+    inline void Snapshot::list(Scan& state) const {
+        Scan::Level& level(state.levels.back());
+        size_t index = level.index;
+        if (level.unchanged) {
+            for (size_t child = index + 1; child < nodes[index].end; child = nodes[child].end) {
+                level.children.emplace_back(std::string(name(child)), child);
+            }
+        } else {
+            std::unordered_map<std::string_view, size_t> recorded;
+            if (index != npos) {
+                for (size_t child = index + 1; child < nodes[index].end; child = nodes[child].end) {
+                    recorded.emplace(name(child), child);
+                }
+            }
+
+            DIR* dir = state.directories.back();
+            for (dirent* ent = sys::readdir(dir); ent != NULL; ent = sys::readdir(dir)) {
+                if (!strcmp(ent->d_name, "..") || !strcmp(ent->d_name, ".")) {
+                    continue;
+                }
+
+                size_t child = npos;
+                auto found = recorded.find(ent->d_name);
+                if (found != recorded.end()) {
+                    child = found->second;
+                    recorded.erase(found);
+                }
+                level.children.emplace_back(std::string(ent->d_name), child);
+            }
 
-        /* So that we can write paths out to ostreams */
-        friend std::ostream& operator<<(std::ostream& stream, const Path& p) {
-            return stream << p.path;
+            /* Whatever's left over isn't there any more */
+            if (index != npos && !recorded.empty()) {
+                for (size_t child = index + 1; child < nodes[index].end; child = nodes[child].end) {
+                    if (recorded.count(name(child))) {
+                        removed(state, child);
+                    }
+                }
+            }
         }
-    private:
-        /* Our current path */
-        std::string path;
-    };
 
-    inline Path::Path(const std::string &p):
-        path(p)
-    {
-#if defined(_WIN32)
-        std::replace(path.begin(), path.end(), posix_separator, windows_separator);
-        //FIXME: Deal with illegal paths on windows, like trying to pass posix paths: /home/meh/r
-#endif
+        /* Below the limit, what's left of this one is looked up by path */
+        if (state.directories.size() > max_open) {
+            sys::closedir(state.directories.back());
+            state.directories.back() = NULL;
+        }
     }
 
-    /* Constructor */
-    template <class T>
-    inline Path::Path(const T& p): path("") {
-        std::stringstream ss;
-        ss << p;
-        path = ss.str();
-#if defined(_WIN32)
-        std::replace(path.begin(), path.end(), posix_separator, windows_separator);
-        //FIXME: Deal with illegal paths on windows, like trying to pass posix paths: /home/meh/r
-#endif
-    }
+    inline void Snapshot::removed(Scan& state, size_t index) const {
+        if (!state.reported) {
+            return;
+        }
 
-    /**************************************************************************
-     * Operators
-     *************************************************************************/
-    inline Path& Path::operator<<(const Path& segment) {
-        return append(segment);
+        /* Where each entry we're in ends, and the length of its parent's
+         * path, so that the path can be put back once we're past it */
+        size_t length = state.path.size();
+        std::vector<std::pair<size_t, size_t> > open;
+        for (size_t i = index; i < nodes[index].end; ++i) {
+            while (!open.empty() && i >= open.back().first) {
+                state.path.resize(open.back().second);
+                open.pop_back();
+            }
+            open.emplace_back(nodes[i].end, state.path.size());
+            state.push(name(i));
+            state.report(Change::removed, nodes[i].status.type);
+        }
+        state.path.resize(length);
     }
 
-    inline Path Path::operator+(const Path& segment) const {
-        Path result(path);
-        result.append(segment);
-        return result;
+    inline void Snapshot::put(std::string& out, std::uint64_t value, size_t bytes) {
+        for (size_t i = 0; i < bytes; ++i) {
+            out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+        }
     }
 
-    inline bool Path::equivalent(const Path& other) {
-        /* Make copies of both paths, sanitize, and ensure they're equal */
+    inline bool Snapshot::get(std::string_view& in, std::uint64_t& value, size_t bytes) {
+        if (in.size() < bytes) {
+            return false;
+        }
 
-#if defined(_WIN32)
-        std::string thisPath = Path(path).absolute().sanitize().path;
-        std::string thatPath = Path(other).absolute().sanitize().path;
-        std::transform(thisPath.begin(), thisPath.end(), thisPath.begin(), ::tolower);
-        std::transform(thatPath.begin(), thatPath.end(), thatPath.begin(), ::tolower);
-        return  thisPath== thatPath;
-#else
-        return Path(path).absolute().sanitize() ==
-               Path(other).absolute().sanitize();
-#endif
+        value = 0;
+        for (size_t i = 0; i < bytes; ++i) {
+            value |= static_cast<std::uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+        }
+        in.remove_prefix(bytes);
+        return true;
     }
 
-    inline std::string Path::filename() const {
-        size_t pos = path.rfind(separator);
-        if (pos != std::string::npos) {
-            return path.substr(pos + 1);
+    /* The root, then the names, then each of the nodes as fixed-size little
+     * endian fields. Names are stored in node order, so only their lengths
+     * are needed to find them again */
+    inline std::string Snapshot::serialize() const {
+        static const size_t node_size = 4 + 8 + 1 + 4 + 8 + 8 + 4 + 8 + 8;
+
+        std::string root(root_path.string());
+        std::string out(magic);
+        out.reserve(out.size() + 24 + root.size() + names.size() +
+                    nodes.size() * node_size);
+        put(out, root.size(), 8);
+        out.append(root);
+        put(out, nodes.size(), 8);
+        put(out, names.size(), 8);
+        out.append(names);
+
+        for (const Node& node : nodes) {
+            const Path::Status& status(node.status);
+            put(out, node.name_length, 4);
+            put(out, node.end, 8);
+            put(out, status.type, 1);
+            put(out, status.mode, 4);
+            put(out, status.size, 8);
+            put(out, static_cast<std::int64_t>(status.mtime), 8);
+            put(out, status.mtime_nsec, 4);
+            put(out, status.inode, 8);
+            put(out, status.device, 8);
         }
-        return "";
+        return out;
     }
 
-    inline std::string Path::extension() const {
-        /* Make sure we only look in the filename, and not the path */
-        std::string name = filename();
-        size_t pos = name.rfind('.');
-        if (pos != std::string::npos) {
-            return name.substr(pos + 1);
+    inline bool Snapshot::deserialize(std::string_view data, Snapshot& result) {
+        std::string_view prefix(magic);
+        if (data.substr(0, prefix.size()) != prefix) {
+            return false;
         }
-        return "";
-    }
+        data.remove_prefix(prefix.size());
 
-    inline Path Path::stem() const {
-        size_t sep_pos = path.rfind(separator);
-        size_t dot_pos = path.rfind('.');
-        if (dot_pos == std::string::npos) {
-            return Path(*this);
+        std::uint64_t root_length, count, names_length;
+        if (!get(data, root_length, 8) || data.size() < root_length) {
+            return false;
         }
+        Path root(std::string(data.substr(0, root_length)));
+        data.remove_prefix(root_length);
 
-        if (sep_pos == std::string::npos || sep_pos < dot_pos) {
-            return Path(path.substr(0, dot_pos));
-        } else {
-            return Path(*this);
+        if (!get(data, count, 8) || !get(data, names_length, 8) ||
+            data.size() < names_length) {
+            return false;
+        }
+        Snapshot parsed;
+        parsed.root_path = root;
+        parsed.names.assign(data.substr(0, names_length));
+        data.remove_prefix(names_length);
+
+        /* Each node's end has to be within its parent's, for walking the
+         * children to stay in bounds */
+        std::vector<size_t> parents;
+        size_t offset = 0;
+        for (std::uint64_t i = 0; i < count; ++i) {
+            std::uint64_t fields[9];
+            static const size_t widths[9] = {4, 8, 1, 4, 8, 8, 4, 8, 8};
+            for (size_t field = 0; field < 9; ++field) {
+                if (!get(data, fields[field], widths[field])) {
+                    return false;
+                }
+            }
+
+            Node node{offset, static_cast<size_t>(fields[0]),
+                static_cast<size_t>(fields[1]), Path::Status()};
+            offset += node.name_length;
+            if (offset > parsed.names.size() || node.end <= i || node.end > count ||
+                fields[2] > Path::Status::other) {
+                return false;
+            }
+
+            while (!parents.empty() && parsed.nodes[parents.back()].end <= i) {
+                parents.pop_back();
+            }
+            if (parents.empty() ? i != 0 : node.end > parsed.nodes[parents.back()].end) {
+                return false;
+            }
+            parents.push_back(i);
+
+            node.status.type = static_cast<Path::Status::Type>(fields[2]);
+            node.status.mode = static_cast<mode_t>(fields[3]);
+            node.status.size = fields[4];
+            node.status.mtime = static_cast<time_t>(static_cast<std::int64_t>(fields[5]));
+            node.status.mtime_nsec = static_cast<long>(fields[6]);
+            node.status.inode = static_cast<ino_t>(fields[7]);
+            node.status.device = static_cast<dev_t>(fields[8]);
+            parsed.nodes.push_back(node);
         }
+
+        if (!data.empty() || offset != parsed.names.size()) {
+            return false;
+        }
+        result = std::move(parsed);
+        return true;
+    }
+
+    inline bool Snapshot::load(const Path& p, Snapshot& result) {
+        std::string data;
+        return Path::read_all(p, data) && deserialize(data, result);
     }
 
     /**************************************************************************
-     * Manipulators
+     * Watcher
      *************************************************************************/
-    inline Path& Path::append(const Path& segment) {
-        /* First, check if the last character is the separator character.
-         * If not, then append one and then the segment. Otherwise, just
-         * the segment */
-        if (!trailing_slash()) {
-            path.push_back(separator);
+    inline void Watcher::Batch::add(Event::Kind kind, const std::string& path,
+                                    Path::Status::Type type) {
+        auto found = positions.find(path);
+        if (found == positions.end()) {
+            positions.emplace(path, events.size());
+            events.push_back(Event{kind, Path(path), type});
+            return;
         }
-        path.append(segment.path);
-        return *this;
-    }
 
-    inline Path& Path::relative(const Path& rel) {
-        if (!rel.is_absolute()) {
-            return append(rel);
-        } else {
-            operator=(rel);
-            return *this;
+        Event& previous = events[found->second];
+        if (previous.kind == Event::added && kind == Event::removed) {
+            /* It came and went, so there's nothing to report */
+            previous.path = Path();
+            positions.erase(found);
+            return;
         }
-    }
 
-    inline Path& Path::up() {
-        /* Make sure we turn this into an absolute url if it's not already
-         * one */
-        if (path.size() == 0) {
-            path = "..";
-            return directory();
+        if (previous.kind == Event::added) {
+            kind = Event::added;
+        } else if (kind == Event::added) {
+            kind = Event::modified;
         }
+        previous.kind = kind;
+        previous.type = type;
+    }
 
-        append(Path("..")).sanitize();
-        if (path.size() == 0) {
-            return *this;
+    inline std::vector<Watcher::Event> Watcher::Batch::take() {
+        std::vector<Event> results;
+        results.reserve(positions.size());
+        for (Event& event : events) {
+            if (!event.path.view().empty()) {
+                results.push_back(std::move(event));
+            }
         }
-
-        return directory();
+        events.clear();
+        positions.clear();
+        return results;
     }
 
-    inline Path& Path::absolute() {
-        /* If the path doesn't begin with our separator, then it's not an
-         * absolute path, and should be appended to the current working
-         * directory */
-        if (!is_absolute()) {
-            /* Join our current working directory with the path */
-            operator=(join(cwd(), path));
+    inline Watcher::Watcher(std::chrono::milliseconds l):
+#if defined(__linux__)
+        fd(sys::inotify_init()), directories(), descriptors(),
+#endif
+        latency(l), watched() {}
+
+    inline Watcher::~Watcher() {
+#if defined(__linux__)
+        if (fd >= 0) {
+            sys::close(fd);
         }
-        return *this;
+#endif
     }
 
-    inline Path& Path::sanitize() {
-        /* Split the path up into segments */
-        std::vector<Segment> segments(split());
-        /* We may have to test this repeatedly, so let's check once */
-        bool relative = !is_absolute();
+    inline bool Watcher::add(const Path& root, unsigned threads) {
+        Path absolute(root);
+        absolute.absolute();
+        if (!absolute.is_directory()) {
+            return false;
+        }
 
-        /* Now, we'll create a new set of segments */
-        std::vector<Segment> pruned;
-        for (size_t pos = 0; pos < segments.size(); ++pos) {
-            /* Skip over empty segments and '.'*/
-            if (segments[pos].segment.size() == 0 ||
-                segments[pos].segment == ".") {
-                continue;
+        bool polled = true;
+#if defined(__linux__)
+        std::string path(absolute.string());
+        if (fd >= 0) {
+            polled = !watch(path, NULL, threads);
+            if (polled) {
+                unwatch(path);
             }
+        }
+#else
+        (void)(threads);
+#endif
+        /* Only snapshot once it's watched, so nothing falls in between */
+        watched.push_back(Root{absolute, Snapshot(absolute), polled, {}});
+        return true;
+    }
 
-#if defined(_WIN32)
-            /* Skip over illegal paths */
-            if (pos != 0 && segments[pos].is_drive_letter())
-            {
-                continue;
+    inline std::vector<Watcher::Event> Watcher::wait(std::chrono::milliseconds timeout) {
+        typedef std::chrono::steady_clock clock;
+        clock::time_point deadline = clock::now() + timeout;
+        clock::time_point until = deadline;
+        clock::time_point scanned = clock::now() - latency;
+        Batch batch;
+
+        for (;;) {
+            clock::duration remaining = std::max(until - clock::now(), clock::duration::zero());
+            if (polled() > 0) {
+                remaining = std::min<clock::duration>(remaining, latency);
             }
-#endif
 
-            /* If there is a '..', then pop off a parent directory. However, if
-             * the path was relative to begin with, if the '..'s exceed the
-             * stack depth, then they should be appended to our path. If it was
-             * absolute to begin with, and we reach root, then '..' has no
-             * effect */
-            if (segments[pos].segment == "..") {
-                if (relative) {
-                    if (pruned.size() && pruned.back().segment != "..") {
-                        pruned.pop_back();
-                    } else {
-                        pruned.push_back(segments[pos]);
-                    }
-                } else if (pruned.size()) {
-#if defined(_WIN32)
-                    if (!pruned[pruned.size() - 1].is_drive_letter())
-                    {
-                        pruned.pop_back();
-                    }
+#if defined(__linux__)
+            if (fd >= 0) {
+                int milliseconds = static_cast<int>(
+                    std::chrono::ceil<std::chrono::milliseconds>(remaining).count());
+                if (sys::poll(fd, milliseconds) > 0) {
+                    read_events(batch);
+                }
+            } else {
+                std::this_thread::sleep_for(remaining);
+            }
 #else
-                    pruned.pop_back();
+            std::this_thread::sleep_for(remaining);
 #endif
-                }
-                continue;
+
+            clock::time_point now = clock::now();
+            if (now - scanned >= latency) {
+                rescan(batch, false);
+                scanned = now;
             }
 
-            pruned.push_back(segments[pos]);
+            /* Once something's changed, only wait a little longer */
+            if (!batch.empty() && until == deadline) {
+                until = std::min(deadline, now + latency);
+            }
+            if (now >= until) {
+                break;
+            }
         }
 
-        bool was_directory = trailing_slash();
-        if (!relative) {
-            path = Path::join(pruned).path;
-#if !defined(_WIN32)
-            path = std::string(1, separator) + path;
-#endif
-            if (was_directory) {
-                return directory();
+#if defined(__linux__)
+        for (Root& root : watched) {
+            if (!root.polled) {
+                sync(root, batch);
             }
-            return *this;
         }
+#endif
+        return batch.take();
+    }
 
-        /* It was a relative path */
-        path = Path::join(pruned).path;
-        if (path.length() && was_directory) {
-            return directory();
-        }
-        return *this;
+    inline size_t Watcher::polled() const {
+        return std::count_if(watched.begin(), watched.end(),
+            [](const Root& root) { return root.polled; });
     }
 
-    inline Path& Path::directory() {
-        trim();
-        path.push_back(separator);
-        return *this;
+    inline size_t Watcher::watches() const {
+#if defined(__linux__)
+        return directories.size();
+#else
+        return 0;
+#endif
     }
 
-    inline Path& Path::trim() {
-        if (path.length() == 0) { return *this; }
+    inline bool Watcher::within(const std::string& path, const std::string& directory) {
+        return path.compare(0, directory.size(), directory) == 0 &&
+            (path.size() == directory.size() || directory.back() == separator ||
+             path[directory.size()] == separator);
+    }
 
-        size_t p = path.find_last_not_of(separator);
-        if (p != std::string::npos) {
-            path.erase(p + 1, path.size());
-        } else {
-            path = "";
+    inline void Watcher::rescan(Batch& batch, bool all) {
+        for (Root& root : watched) {
+            if (!all && !root.polled) {
+                continue;
+            }
+
+#if defined(__linux__)
+            /* New directories are watched along with everything under them,
+             * so the directories under them don't need to be again */
+            std::string covered;
+#endif
+            root.dirty.clear();
+            for (Event& change : root.snapshot.update()) {
+                std::string path(change.path.string());
+#if defined(__linux__)
+                if (!root.polled) {
+                    if (change.type == Path::Status::directory && change.kind != Event::removed) {
+                        if (covered.empty() || !within(path, covered)) {
+                            covered = path;
+                            if (!watch(path, NULL, 1)) {
+                                poll_instead(path, batch);
+                            }
+                        }
+                    } else {
+                        unwatch(path);
+                    }
+                }
+#endif
+                batch.add(change.kind, path, change.type);
+            }
         }
-        return *this;
     }
 
-    /**************************************************************************
-     * Member Utility Methods
-     *************************************************************************/
+#if defined(__linux__)
+    inline bool Watcher::watch(const std::string& root, Batch* batch, unsigned threads) {
+        static const std::uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY |
+            IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |
+            IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+        std::mutex lock;
+        bool exhausted = false;
+        auto add_watch = [&](const std::string& path) {
+            int wd = sys::inotify_add_watch(fd, path.c_str(), mask);
+            int error = errno;
+
+            std::lock_guard<std::mutex> guard(lock);
+            if (wd < 0) {
+                /* Otherwise it's already gone, and we'll hear about that */
+                exhausted = exhausted || error == ENOSPC || error == ENOMEM;
+                return;
+            }
 
-    /* Returns a vector of each of the path segments in this path */
-    inline std::vector<Path::Segment> Path::split() const {
-        std::stringstream stream(path);
-        std::istream_iterator<Path::Segment> start(stream);
-        std::istream_iterator<Path::Segment> end;
-        std::vector<Path::Segment> results(start, end);
+            /* A directory that's moved keeps its watch */
+            auto previous = directories.find(wd);
+            if (previous != directories.end() && previous->second != path) {
+                descriptors.erase(previous->second);
+            }
+            directories[wd] = path;
+            descriptors[path] = wd;
+        };
 
-        if (trailing_slash()) {
-            results.push_back(Path::Segment(""));
+        add_watch(root);
+        TreeWalker(threads, false).walk(root, [&](const Path::Entry& entry) {
+            if (entry.is_directory()) {
+                add_watch(entry.path.string());
+            }
+            if (batch != NULL) {
+                std::lock_guard<std::mutex> guard(lock);
+                batch->add(Event::added, entry.path.string(), entry.type);
+            }
+        });
+        return !exhausted;
+    }
+
+    inline void Watcher::unwatch(const std::string& path) {
+        auto it = descriptors.lower_bound(path);
+        while (it != descriptors.end() && it->first.compare(0, path.size(), path) == 0) {
+            if (!within(it->first, path)) {
+                ++it;
+                continue;
+            }
+            sys::inotify_rm_watch(fd, it->second);
+            directories.erase(it->second);
+            it = descriptors.erase(it);
         }
-        return results;
     }
 
-    /**************************************************************************
-     * Tests
-     *************************************************************************/
-    inline bool Path::is_absolute() const {
-#if defined(_WIN32)
-        return path.size() >= 2 && path[1] == windows_drive_separator;
-#else
-        return path.size() && path[0] == separator;
-#endif
+    inline void Watcher::poll_instead(const std::string& path, Batch& batch) {
+        for (Root& root : watched) {
+            std::string directory(root.path.string());
+            if (!root.polled && within(path, directory)) {
+                /* So that the first poll only finds what's changed since */
+                sync(root, batch);
+                root.polled = true;
+                unwatch(directory);
+            }
+        }
     }
 
-    inline bool Path::trailing_slash() const {
-#if defined(_WIN32)
-        return path.size() && (path[path.length() - 1] == windows_separator
-                               || path[path.length() - 1] == posix_separator);
-#else
-        return path.size() && path[path.length() - 1] == separator;
-#endif
+    inline void Watcher::mark(const std::string& directory) {
+        for (Root& root : watched) {
+            if (within(directory, root.path.string())) {
+                root.dirty.push_back(directory);
+                if (directory.back() != separator) {
+                    root.dirty.back().push_back(separator);
+                }
+            }
+        }
     }
 
-    inline bool Path::exists() const {
-        struct stat buf;
-        if (stat(path.c_str(), &buf) != 0) {
-            return false;
+    inline void Watcher::sync(Root& root, Batch& batch) {
+        /* With trailing separators, parents sort before their children, so
+         * that they're updated first, and duplicates are next to each other */
+        std::sort(root.dirty.begin(), root.dirty.end());
+        root.dirty.erase(std::unique(root.dirty.begin(), root.dirty.end()), root.dirty.end());
+
+        size_t length = root.path.string().size();
+        for (const std::string& directory : root.dirty) {
+            std::string_view relative(std::string_view(directory).substr(length));
+            for (Event& change : root.snapshot.update_directory(relative)) {
+                batch.add(change.kind, change.path.string(), change.type);
+            }
         }
-        return true;
+        root.dirty.clear();
+    }
+
+    inline void Watcher::read_events(Batch& batch) {
+        alignas(struct inotify_event) char buffer[64 * 1024];
+        bool overflowed = false;
+
+        for (;;) {
+            ssize_t length = sys::read(fd, buffer, sizeof(buffer));
+            if (length <= 0) {
+                break;
+            }
+
+            for (char* next = buffer; next < buffer + length; ) {
+                const struct inotify_event* event =
+                    reinterpret_cast<const struct inotify_event*>(next);
+                next += sizeof(struct inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW) {
+                    overflowed = true;
+                    continue;
+                }
+
+                auto found = directories.find(event->wd);
+                if (found == directories.end()) {
+                    continue;
+                }
+                std::string path(found->second);
+
+                if (event->mask & IN_IGNORED) {
+                    auto descriptor = descriptors.find(path);
+                    if (descriptor != descriptors.end() && descriptor->second == event->wd) {
+                        descriptors.erase(descriptor);
+                    }
+                    directories.erase(found);
+                    continue;
+                }
+
+                /* Everything but the roots has a parent to hear about it from */
+                if (event->len == 0) {
+                    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                        for (const Root& root : watched) {
+                            if (root.path.string() == path) {
+                                batch.add(Event::removed, path, Path::Status::directory);
+                                mark(path);
+                                unwatch(path);
+                                break;
+                            }
+                        }
+                    }
+                    continue;
+                }
+                mark(path);
+
+                if (path.back() != separator) {
+                    path.push_back(separator);
+                }
+                path.append(event->name);
+                Path::Status::Type type = (event->mask & IN_ISDIR) ?
+                    Path::Status::directory : Path::Status::file;
+
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    Path::Status status(Path(path).symlink_status());
+                    if (status.exists()) {
+                        type = status.type;
+                    }
+                    batch.add(Event::added, path, type);
+                    if (type == Path::Status::directory && !watch(path, &batch, 1)) {
+                        poll_instead(path, batch);
+                    }
+                } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    batch.add(Event::removed, path, type);
+                    if (type == Path::Status::directory) {
+                        unwatch(path);
+                    }
+                } else if (event->mask & (IN_MODIFY | IN_ATTRIB)) {
+                    batch.add(Event::modified, path, type);
+                }
+            }
+        }
+
+        if (overflowed) {
+            rescan(batch, true);
+        }
+    }
+#endif
+
+    /**************************************************************************
+     * IndexedPath
+     *************************************************************************/
+    inline IndexedPath::IndexedPath(const IndexedPath& other): IndexedPath() {
+        *this = other;
     }
 
-    inline bool Path::is_file() const {
-        struct stat buf;
-        if (stat(path.c_str(), &buf) != 0) {
-            return false;
-        } else {
-            return S_ISREG(buf.st_mode);
+    inline IndexedPath::IndexedPath(IndexedPath&& other) noexcept: IndexedPath() {
+        *this = std::move(other);
+    }
+
+    inline IndexedPath& IndexedPath::operator=(const IndexedPath& other) {
+        if (this != &other) {
+            assign(other.string());
+
+            /* What's known about the path comes along with it */
+            state = other.state;
+            separator_count = other.separator_count;
+            std::copy(other.separators, other.separators + separator_count, separators);
+            last_dot = other.last_dot;
+            hashed = other.hashed;
+            hash_value = other.hash_value;
         }
+        return *this;
     }
 
-    inline bool Path::is_directory() const {
-        struct stat buf;
-        if (stat(path.c_str(), &buf) != 0) {
-            return false;
-        } else {
-            return S_ISDIR(buf.st_mode);
+    inline IndexedPath& IndexedPath::operator=(IndexedPath&& other) noexcept {
+        /* Neither branch allocates. A path that isn't on the heap fits
+         * inline, so copying it is just a memmove */
+        if (this != &other) {
+            if (other.heap) {
+                heap = std::move(other.heap);
+                length = other.length;
+                state = other.state;
+                separator_count = other.separator_count;
+                std::copy(other.separators, other.separators + separator_count, separators);
+                last_dot = other.last_dot;
+                hashed = other.hashed;
+                hash_value = other.hash_value;
+            } else {
+                *this = static_cast<const IndexedPath&>(other);
+            }
+            other.assign(std::string_view());
         }
+        return *this;
     }
 
-    inline size_t Path::size() const {
-        struct stat buf;
-        if (stat(path.c_str(), &buf) != 0) {
-            return 0;
+    inline void IndexedPath::assign(std::string_view p) {
+        if (p.size() > inline_capacity) {
+            /* Copy before letting go, in case `p` is our own */
+            std::unique_ptr<char[]> allocated(new char[p.size()]);
+            std::memcpy(allocated.get(), p.data(), p.size());
+            heap = std::move(allocated);
         } else {
-            return buf.st_size;
+            if (!p.empty()) {
+                std::memmove(buffer, p.data(), p.size());
+            }
+            heap.reset();
         }
+        length = p.size();
+        forget();
     }
 
-    /**************************************************************************
-     * Static Utility Methods
-     *************************************************************************/
-    inline Path Path::join(const Path& a, const Path& b) {
-        Path p(a);
-        p.append(b);
-        return p;
+    inline void IndexedPath::forget() {
+        state = unknown;
+        separator_count = 0;
+        last_dot = none;
+        hashed = false;
+        hash_value = 0;
     }
 
-    inline Path Path::join(const std::vector<Segment>& segments) {
-        std::string path;
-        /* Now, we'll go through the segments, and join them with
-         * separator */
-        std::vector<Segment>::const_iterator it(segments.begin());
-        for(; it != segments.end(); ++it) {
-            path += it->segment;
-            if (it + 1 != segments.end()) {
-                path += std::string(1, separator);
-            }
+    inline bool IndexedPath::index() const {
+        if (state != unknown) {
+            return state == indexed;
         }
-        return Path(path);
-    }
 
-    inline Path Path::cwd() {
-        Path p;
+        state = unindexable;
+        if (length >= none) {
+            return false;
+        }
 
-        char * buf = getcwd(NULL, 0);
-        if (buf != NULL) {
-            p = std::string(buf);
-            free(buf);
-        } else {
-            perror("cwd");
+        const char* d = data();
+        for (size_t start = 0; start < length; start += scan::block) {
+            size_t n = std::min(scan::block, length - start);
+            std::uint64_t found = 0;
+            std::uint64_t dots = 0;
+            scan::with_block(d + start, n, [&](const scan::Block& b) {
+                found = b.equal(separator);
+                dots = b.equal('.');
+                return 0;
+            });
+
+            for (; found; found &= found - 1) {
+                if (separator_count == max_separators) {
+                    separator_count = 0;
+                    return false;
+                }
+                separators[separator_count++] =
+                    static_cast<std::uint16_t>(start + scan::lowest(found));
+            }
+            if (dots) {
+                last_dot = static_cast<std::uint16_t>(start + scan::highest(dots));
+            }
         }
 
-        /* Ensure this is a directory */
-        p.directory();
-        return p;
+        state = indexed;
+        return true;
     }
 
-    inline Path Path::tmp() {
-#if defined(unix) || defined(__unix) || defined(__unix__) || defined(__APPLE__) || defined(__MACH__) || defined(__linux__) || defined(__FreeBSD__)
-        char* env_value = nullptr;
+    inline bool IndexedPath::operator==(const IndexedPath& other) const {
+        if (hashed && other.hashed && hash_value != other.hash_value) {
+            return false;
+        }
+        return string() == other.string();
+    }
 
-        if ((env_value = getenv("TMPDIR"))) // Single = intended
-        {
-            return Path(std::string(env_value));
+    inline std::string_view IndexedPath::filename() const {
+        if (!index()) {
+            return view().filename();
         }
+        /* Like `Path`, no separator means no filename */
+        if (separator_count == 0) {
+            return std::string_view();
+        }
+        return string().substr(last_segment());
+    }
 
-        return Path("/tmp"); // As per the Filesystem Hierarchy Standard.
-#elif defined(_WIN32) || defined(__CYGWIN__)
-        wchar_t buf[MAX_PATH + 1]; // See http://msdn.microsoft.com/en-us/library/windows/desktop/aa364992%28v=vs.85%29.aspx for the +1
-        DWORD count = GetTempPathW(MAX_PATH + 1, buf);
-        std::string result;
+    inline std::string_view IndexedPath::extension() const {
+        if (!index()) {
+            return view().extension();
+        }
+        if (separator_count == 0 || last_dot == none || last_dot < last_segment()) {
+            return std::string_view();
+        }
+        return string().substr(last_dot + 1);
+    }
 
-        if (count == 0)
-        {
-            std::cerr << "Error fetching tmp dir: " << GetLastError() << std::endl;
+    inline PathView IndexedPath::stem() const {
+        if (!index()) {
+            return view().stem();
         }
-        else
-        {
-            //FIXME: All path should be using wstring instead of std::string
-            std::wstring utf16(buf, count);
-            result.reserve(count);
-            std::copy(buf, buf+count, std::back_inserter(result));
+        if (last_dot == none || last_dot < last_segment()) {
+            return view();
         }
+        return PathView(string().substr(0, last_dot));
+    }
 
-        return result;
-#else
-#error "Unsupported platform"
+    inline IndexedPath IndexedPath::parent() const {
+#if !defined(_WIN32)
+        /* Other than the empty path, the parent of a clean path is just
+         * everything up to its last segment. Otherwise there are '..'s to be
+         * added or evaluated */
+        if (length > 0 && index() && scan::normalized(string())) {
+            if (length == 1 && is_absolute()) {
+                return *this;
+            }
+
+            size_t count = separator_count;
+            if (trailing_slash()) {
+                --count;
+            }
+            return IndexedPath(PathView(
+                string().substr(0, count ? separators[count - 1] + 1 : 0)));
+        }
 #endif
+        return IndexedPath(path().parent());
     }
 
-    inline bool Path::touch(const Path& p, mode_t mode) {
-        int fd = open(p.path.c_str(), O_RDONLY | O_CREAT, mode);
-        if (fd == -1) {
-            makedirs(p);
-            fd = open(p.path.c_str(), O_RDONLY | O_CREAT, mode);
-            if (fd == -1) {
-                return false;
+    inline size_t IndexedPath::segments() const {
+        if (!index()) {
+            size_t count = 0;
+            for (PathView::iterator it(view().begin()); it != view().end(); ++it) {
+                ++count;
             }
+            return count;
         }
+        return length ? separator_count + 1 : 0;
+    }
 
-        if (close(fd) == -1) {
-            perror("touch close");
-            return false;
+    inline std::string_view IndexedPath::segment(size_t i) const {
+        if (!index()) {
+            PathView::iterator it(view().begin());
+            std::advance(it, i);
+            return *it;
         }
 
-        return true;
+        size_t start = i ? separators[i - 1] + 1 : 0;
+        size_t stop = i < separator_count ? separators[i] : length;
+        return string().substr(start, stop - start);
     }
 
-    inline bool Path::move(const Path& source, const Path& dest,
-        bool mkdirs) {
-        int result = rename(source.path.c_str(), dest.path.c_str());
-        if (result == 0) {
-            return true;
+    inline size_t IndexedPath::hash() const {
+        if (!hashed) {
+            hash_value = std::hash<std::string_view>()(string());
+            hashed = true;
         }
+        return hash_value;
+    }
 
-        /* Otherwise, there was an error */
-        if (errno == ENOENT && mkdirs) {
-            makedirs(dest.parent());
-            return rename(source.path.c_str(), dest.path.c_str()) == 0;
-        }
+    inline IndexedPath& IndexedPath::append(const PathView& segment) {
+        Path p(path());
+        p.append(Path(segment.string()));
+        assign(p.view().string());
+        return *this;
+    }
 
-        return false;
+    inline IndexedPath& IndexedPath::sanitize() {
+#if !defined(_WIN32)
+        if (scan::normalized(string())) {
+            return *this;
+        }
+#endif
+        Path p(path());
+        p.sanitize();
+        assign(p.view().string());
+        return *this;
     }
 
-    inline bool Path::rm(const Path& path) {
-        if (remove(path.path.c_str()) != 0) {
-            perror("Remove");
-            return false;
+    inline IndexedPath& IndexedPath::trim() {
+        size_t p = scan::find_last_not(string(), separator);
+        size_t trimmed = (p == scan::npos) ? 0 : p + 1;
+        if (trimmed != length) {
+            length = trimmed;
+            forget();
         }
-        return true;
+        return *this;
     }
 
-    inline bool Path::makedirs(const Path& p, mode_t mode) {
-        /* We need to make a copy of the path, that's an absolute path */
-        Path abs = Path(p).absolute();
+    inline IndexedPath& IndexedPath::directory() {
+        Path p(path());
+        p.directory();
+        assign(p.view().string());
+        return *this;
+    }
 
-        /* Now, we'll try to make the directory / ensure it exists */
-        if (makedir(abs.string().c_str(), mode) == 0) {
-            return true;
-        }
+    /**************************************************************************
+     * PathKey
+     *************************************************************************/
+    inline PathKey::PathKey(const Path& p): key(p), hash_value(0) {
+        key.absolute().sanitize();
+#if defined(_WIN32)
+        std::string lowered(key.string());
+        std::transform(lowered.begin(), lowered.end(), lowered.begin(), ::tolower);
+        key = Path(lowered);
+#endif
+        hash_value = std::hash<std::string_view>()(key.view().string());
+    }
 
-        /* Otherwise, there was an error. There are some errors that
-         * may be recoverable */
-        if (errno == EEXIST) {
-            return abs.is_directory();
-        } else if(errno == ENOENT) {
-            /* We'll need to try to recursively make this directory. We
-             * don't need to worry about reaching the '/' path, and then
-             * getting to this point, because / always exists */
-            makedirs(abs.parent(), mode);
-            if (makedir(abs.string().c_str(), mode) == 0) {
-                return true;
-            } else {
-                perror("makedirs");
-                return false;
+    inline std::vector<Path> PathKey::unique(const std::vector<Path>& paths) {
+        /* std::hash<PathKey> isn't declared until the end */
+        struct Hash {
+            size_t operator()(const PathKey& k) const { return k.hash(); }
+        };
+        std::unordered_set<PathKey, Hash> seen;
+        seen.reserve(paths.size());
+        std::vector<Path> results;
+        for (const Path& p : paths) {
+            if (seen.emplace(p).second) {
+                results.push_back(p);
             }
-        } else {
-            perror("makedirs");
         }
+        return results;
+    }
 
-        /* If it's none of these cases, then it's one of unrecoverable
-         * errors described in mkdir(2) */
-        return false;
+    /**************************************************************************
+     * Batch normalization
+     *************************************************************************/
+    template <class T>
+    inline std::string_view Path::string_of(const T& p) {
+        if constexpr (std::is_same<T, Path>::value) {
+            return p.path;
+        } else if constexpr (std::is_same<T, PathView>::value) {
+            return p.string();
+        } else {
+            return std::string_view(p);
+        }
     }
 
-    inline bool Path::rmdirs(const Path& p, bool ignore_errors) {
-        bool success = true;
+    template <class Paths, class Results>
+    inline void Path::normalize(const Paths& paths, const Path& base,
+                                Results& results, unsigned threads) {
+        APATHY_TIME(normalize);
+        Path root(base);
+        root.absolute();
+
+        size_t count = paths.size();
+        results.resize(count);
+
+        /* Hand the paths out in chunks, so that threads aren't all contending
+         * for the next one */
+        static const size_t chunk = 256;
+        std::atomic<size_t> next(0);
+        auto work = [&]() {
+            for (size_t first = next.fetch_add(chunk); first < count;
+                 first = next.fetch_add(chunk)) {
+                size_t last = std::min(count, first + chunk);
+                for (size_t i = first; i < last; ++i) {
+                    std::string_view s(string_of(paths[i]));
+                    Path& result = results[i];
+                    result.path.assign(s.data(), s.size());
+#if defined(_WIN32)
+                    std::replace(result.path.begin(), result.path.end(),
+                                 posix_separator, windows_separator);
+#endif
+                    result.absolute(root).sanitize();
+                }
+            }
+        };
 
-        std::vector<Path> contents = recursive_listdir(p);
-        contents.push_back(p);
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        size_t chunks = (count + chunk - 1) / chunk;
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads && i < chunks; ++i) {
+            workers.push_back(std::thread(work));
+        }
+        work();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
 
-        //We sort the paths based on the lenght so as to make it easy for rmdir
-        std::sort(contents.begin(), contents.end(),
-                  [](const Path& a, const Path& b)
-                  {
-                      return Path(a).absolute().string().size() > Path(b).absolute().string().size();
-                  });
+    template <class Paths, class Results>
+    inline void Path::normalize(const Paths& paths, const Path& base,
+                                Results& results, std::vector<size_t>& groups,
+                                unsigned threads) {
+        normalize(paths, base, results, threads);
 
-        for (const Path &p : contents)
+        /* Number the distinct results in the order they first appear */
+        size_t count = results.size();
+        groups.resize(count);
+        size_t distinct = 0;
         {
-            success = p.is_directory()
-                      ? (rmdir(p.path.c_str()) == 0)
-                      : (unlink(p.path.c_str()) == 0);
+            std::unordered_map<std::string_view, size_t> seen;
+            seen.reserve(count);
+            for (size_t i = 0; i < count; ++i) {
+                auto inserted = seen.emplace(results[i].path, distinct);
+                groups[i] = inserted.first->second;
+                if (inserted.second) {
+                    ++distinct;
+                }
+            }
+        }
 
-            if (!success && !ignore_errors)
-            {
-                perror("rmdirs");
-                break;
+        /* And then move each of them to its number, swapping, so that the
+         * paths left at the end keep their storage until they're dropped.
+         * Everything between a path's number and where it is now has already
+         * been moved down or is a duplicate, so nothing's lost */
+        size_t kept = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (groups[i] == kept) {
+                if (i != kept) {
+                    std::swap(results[kept].path, results[i].path);
+                }
+                ++kept;
             }
         }
+        results.resize(distinct);
+    }
 
-        return success;
+    /**************************************************************************
+     * FixedPath
+     *************************************************************************/
+    template <size_t Capacity>
+    constexpr FixedPath<Capacity>::FixedPath(std::string_view p): buffer(), length(0) {
+        write(p);
     }
 
-    /* List all the paths in a directory
-     *
-     * @param p - path to list items for */
-    inline std::vector<Path> Path::listdir(const Path& p) {
-        Path base(p);
-        base.absolute();
-        std::vector<Path> results;
-        DIR* dir = opendir(base.string().c_str());
-        if (dir == NULL) {
-            /* If there was an error, return an empty vector */
-            return results;
+    template <size_t Capacity>
+    constexpr void FixedPath<Capacity>::write(std::string_view s) {
+        /* Check the capacity once, rather than for every character */
+        if (s.size() > Capacity - length) {
+            throw std::length_error("apathy::FixedPath: path exceeds capacity");
+        }
+        for (char c : s) {
+#if defined(_WIN32)
+            buffer[length++] = (c == posix_separator) ? windows_separator : c;
+#else
+            buffer[length++] = c;
+#endif
+        }
+        buffer[length] = '\0';
+    }
+
+    template <size_t Capacity>
+    constexpr FixedPath<Capacity>& FixedPath<Capacity>::append(std::string_view segment) & {
+        if (!trailing_slash()) {
+            write(std::string_view(&separator, 1));
         }
+        write(segment);
+        return *this;
+    }
 
-        /* Otherwise, go through everything */
-        for (dirent* ent = readdir(dir); ent != NULL; ent = readdir(dir)) {
-            Path cpy(base);
+    template <size_t Capacity>
+    template <class... Segments>
+    constexpr FixedPath<Capacity> FixedPath<Capacity>::join(
+            std::string_view first, const Segments&... rest) {
+        FixedPath result(first);
+        (result.append(std::string_view(rest)), ...);
+        return result;
+    }
 
-            /* Skip the parent directory listing */
-            if (!strcmp(ent->d_name, "..")) {
+    template <size_t Capacity>
+    constexpr FixedPath<Capacity>& FixedPath<Capacity>::sanitize() & {
+        /* The same single pass as `Path::sanitize`, finding segments with
+         * `find` rather than a `PathView::iterator` */
+        bool relative = !is_absolute();
+        bool was_directory = trailing_slash();
+
+        size_t out = 0;
+#if !defined(_WIN32)
+        if (!relative) {
+            out = 1;
+        }
+#endif
+        size_t base = out;
+        size_t floor = out;
+
+        std::string_view path(string());
+        for (size_t next = 0, pos = 0; next <= path.size(); ++pos) {
+            size_t start = next;
+            size_t stop = path.find(separator, start);
+            if (stop == std::string_view::npos) {
+                stop = path.size();
+            }
+            size_t count = stop - start;
+            next = stop + 1;
+
+            if (count == 0 || (count == 1 && buffer[start] == '.')) {
                 continue;
             }
 
-            /* Skip the self directory listing */
-            if (!strcmp(ent->d_name, ".")) {
+#if defined(_WIN32)
+            bool drive_letter = count >= 2 &&
+                buffer[start + 1] == windows_drive_separator;
+            if (pos != 0 && drive_letter) {
                 continue;
             }
+#endif
+
+            bool parent = count == 2 && buffer[start] == '.' &&
+                buffer[start + 1] == '.';
+            if (parent) {
+                if (out > floor) {
+                    size_t cut = path.substr(0, out).rfind(separator);
+                    out = (cut != std::string_view::npos && cut >= floor) ?
+                        cut : floor;
+                    continue;
+                } else if (!relative) {
+                    continue;
+                }
+            }
+
+            if (out > base) {
+                buffer[out++] = separator;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                buffer[out++] = buffer[start + i];
+            }
 
-            cpy.relative(Path(ent->d_name));
-            results.push_back(cpy);
+            if (parent) {
+                floor = out;
+            }
+#if defined(_WIN32)
+            if (pos == 0 && drive_letter) {
+                floor = out;
+            }
+#endif
         }
+        length = out;
+        buffer[length] = '\0';
 
-        errno = 0;
-        closedir(dir);
-        return results;
+        if (was_directory && (!relative || length)) {
+            return directory();
+        }
+        return *this;
     }
 
-#if !defined(_WIN32)
-    inline std::vector<Path> Path::glob(const std::string& pattern) {
-        /* First, we need a glob_t, and then we'll look at the results */
-        glob_t globbuf;
-        if (::glob(pattern.c_str(), 0, NULL, &globbuf) != 0) {
-            /* Then there was an error */
-            return std::vector<Path>();
+    template <size_t Capacity>
+    constexpr FixedPath<Capacity>& FixedPath<Capacity>::trim() & {
+        size_t p = string().find_last_not_of(separator);
+        length = (p == std::string_view::npos) ? 0 : p + 1;
+        buffer[length] = '\0';
+        return *this;
+    }
+
+    template <size_t Capacity>
+    constexpr FixedPath<Capacity>& FixedPath<Capacity>::directory() & {
+        trim();
+        write(std::string_view(&separator, 1));
+        return *this;
+    }
+
+    template <size_t Capacity>
+    constexpr std::string_view FixedPath<Capacity>::filename() const {
+        size_t pos = string().rfind(separator);
+        if (pos != std::string_view::npos) {
+            return string().substr(pos + 1);
         }
+        return std::string_view();
+    }
 
-        std::vector<Path> results;
-        for (std::size_t i = 0; i < globbuf.gl_pathc; ++i) {
-            results.push_back(globbuf.gl_pathv[i]);
+    template <size_t Capacity>
+    constexpr std::string_view FixedPath<Capacity>::extension() const {
+        std::string_view name = filename();
+        size_t pos = name.rfind('.');
+        if (pos != std::string_view::npos) {
+            return name.substr(pos + 1);
         }
-        return results;
+        return std::string_view();
     }
-#endif
 
-    inline std::vector<Path> Path::recursive_listdir(const Path &p) {
-        std::vector<Path> results;
-        std::vector<Path> directories_to_visit = {p};
+    template <size_t Capacity>
+    constexpr FixedPath<Capacity> FixedPath<Capacity>::stem() const {
+        size_t sep_pos = string().rfind(separator);
+        size_t name_pos = (sep_pos == std::string_view::npos) ? 0 : sep_pos + 1;
+        size_t dot_pos = string().substr(name_pos).rfind('.');
+        if (dot_pos == std::string_view::npos) {
+            return *this;
+        }
+        return FixedPath(string().substr(0, name_pos + dot_pos));
+    }
 
-        while (!directories_to_visit.empty())
-        {
-            Path current_dir = directories_to_visit.back();
-            directories_to_visit.pop_back();
+    template <size_t Capacity>
+    constexpr bool FixedPath<Capacity>::is_absolute() const {
+#if defined(_WIN32)
+        return length >= 2 && buffer[1] == windows_drive_separator;
+#else
+        return length && buffer[0] == separator;
+#endif
+    }
+
+    template <size_t Capacity>
+    constexpr bool FixedPath<Capacity>::trailing_slash() const {
+#if defined(_WIN32)
+        return length && (buffer[length - 1] == windows_separator
+                          || buffer[length - 1] == posix_separator);
+#else
+        return length && buffer[length - 1] == separator;
+#endif
+    }
 
-            std::vector<Path> items = listdir(current_dir);
+}
 
-            for (const auto &item : items)
-            {
-                results.push_back(item);
+/* So that paths can go in unordered containers */
+namespace std {
+    template <>
+    struct hash<apathy::PathView> {
+        size_t operator()(const apathy::PathView& p) const {
+            return hash<string_view>()(p.string());
+        }
+    };
 
-                if (item.is_directory())
-                {
-                    directories_to_visit.push_back(item);
-                }
-            }
+    template <>
+    struct hash<apathy::Path> {
+        size_t operator()(const apathy::Path& p) const {
+            return hash<string_view>()(p.view().string());
         }
+    };
 
-        return results;
-    }
+    template <>
+    struct hash<apathy::IndexedPath> {
+        size_t operator()(const apathy::IndexedPath& p) const { return p.hash(); }
+    };
+
+    template <>
+    struct hash<apathy::PathKey> {
+        size_t operator()(const apathy::PathKey& k) const { return k.hash(); }
+    };
 }
 
 #endif
@@ -28,12 +28,25 @@
 
 #include <catch.hpp>
 #include <algorithm>
+#include <stdexcept>
+#include <fstream>
+#include <random>
+#include <unordered_set>
 
 /* Internal libraries */
 #include "path.hpp"
 
 using namespace apathy;
 
+/* Something that can only become a path by streaming it */
+struct Streamed {
+    std::string contents;
+
+    friend std::ostream& operator<<(std::ostream& stream, const Streamed& s) {
+        return stream << s.contents;
+    }
+};
+
 TEST_CASE("path", "Path functionality works as advertised") {
     SECTION("cwd", "And equivalent vs ==") {
         Path cwd(Path::cwd());
@@ -47,6 +60,27 @@ TEST_CASE("path", "Path functionality works as advertised") {
         REQUIRE(Path() == "");
     }
 
+    SECTION("chdir", "Make sure the cached cwd follows us around") {
+        Path original(Path::cwd());
+        Path::makedirs("foo/bar");
+        REQUIRE(Path::chdir("foo"));
+        REQUIRE(Path::cwd() == Path(original).append("foo").directory());
+        REQUIRE(Path("bar").absolute() == Path(original).append("foo/bar"));
+        REQUIRE(Path("bar").absolute(original) == Path(original).append("bar"));
+        REQUIRE(Path("/bar").absolute(original) == Path("/bar"));
+
+        /* Changing directory behind its back needs an invalidation */
+        REQUIRE(::chdir("bar") == 0);
+        REQUIRE(Path::cwd() == Path(original).append("foo").directory());
+        Path::invalidate_cwd();
+        REQUIRE(Path::cwd() == Path(original).append("foo/bar").directory());
+
+        REQUIRE(!Path::chdir("nonexistent"));
+        REQUIRE(Path::chdir(original));
+        REQUIRE(Path::cwd() == original);
+        REQUIRE(Path::rmdirs("foo"));
+    }
+
     SECTION("operator=", "Make sure assignment works as expected") {
         Path cwd(Path::cwd());
         Path empty("");
@@ -135,10 +169,44 @@ TEST_CASE("path", "Path functionality works as advertised") {
         root = Path("/");
         root << "hello" << 5 << "how" << 3.14 << "are";
         REQUIRE(root.string() == "/hello/5/how/3.14/are");
+
+        /* And they should come out just like they would from a stream */
+        root = Path("/");
+        root << -12 << 10000000000LL << 0.1 + 0.2 << 1e100 << 'c' << true;
+        REQUIRE(root.string() == "/-12/10000000000/0.3/1e+100/c/1");
+
+        root = Path("/");
+        const char* name = "name";
+        root << name << std::string_view("view") << PathView("path/view");
+        REQUIRE(root.string() == "/name/view/path/view");
+
+        /* Streamed values come through whole, even with a NUL in them */
+        std::string nul("a\0b", 3);
+        REQUIRE(Path(Streamed{nul}).string() == nul);
     }
 
     SECTION("operator+", "Make sure operator+ works correctly") {
         REQUIRE((Path("foo/bar") + "baz").string() == "foo/bar/baz");
+
+        /* Chaining shouldn't touch the original */
+        Path base("foo");
+        REQUIRE((base + "bar" + "baz").string() == "foo/bar/baz");
+        REQUIRE(base.string() == "foo");
+    }
+
+    SECTION("join", "Make sure we can join many segments at once") {
+        Path base("/foo/");
+        REQUIRE(Path::join(base, "bar") == "/foo/bar");
+        REQUIRE(Path::join(base, "bar", 5, Path("baz/")) == "/foo/bar/5/baz/");
+        REQUIRE(Path::join(Path("a"), "b", "c") == "a/b/c");
+        REQUIRE(base.string() == "/foo/");
+    }
+
+    SECTION("temporaries", "Make sure manipulators chain on temporaries") {
+        REQUIRE(Path("/a/b/../c").sanitize().directory() == "/a/c/");
+        REQUIRE(Path("/a/b/").trim().parent() == "/a/");
+        REQUIRE((Path("/a") << "b" << "c") == "/a/b/c");
+        REQUIRE(Path("a").absolute() == Path::cwd().append("a"));
     }
 
     SECTION("trim", "Make sure trim actually strips off separators") {
@@ -185,6 +253,241 @@ TEST_CASE("path", "Path functionality works as advertised") {
         REQUIRE(Path("/./././a/./b/../../c").sanitize() == "/c");
 
         REQUIRE(Path("././a/b/c/").sanitize() == "a/b/c/");
+
+        /* Edge cases around the root and running out of segments */
+        REQUIRE(Path("/").sanitize() == "/");
+        REQUIRE(Path("///").sanitize() == "/");
+        REQUIRE(Path("/..").sanitize() == "/");
+        REQUIRE(Path("").sanitize() == "");
+        REQUIRE(Path("./").sanitize() == "");
+        REQUIRE(Path("a/..").sanitize() == "");
+        REQUIRE(Path("a/../../b/").sanitize() == "../b/");
+        REQUIRE(Path("../a/../../b").sanitize() == "../../b");
+        REQUIRE(Path(".../a/.b/..").sanitize() == ".../a");
+    }
+
+    SECTION("scan", "Make sure the scanning kernels agree with the slow way") {
+        std::mt19937 random(42);
+        const char alphabet[] = "a./";
+        for (size_t i = 0; i < 5000; ++i) {
+            std::string s(random() % 200, 'a');
+            for (char& c : s) {
+                c = alphabet[random() % 3];
+            }
+
+            REQUIRE(scan::find_last(s, '/') == s.rfind('/'));
+            REQUIRE(scan::find_last(s, '.') == s.rfind('.'));
+            REQUIRE(scan::find_last_not(s, '/') == s.find_last_not_of('/'));
+            REQUIRE(scan::count(s, '.') == size_t(std::count(s.begin(), s.end(), '.')));
+
+            /* Only the leading and trailing segments may be empty, and none
+             * may be '.' or '..' */
+            std::vector<std::string_view> segments(
+                PathView(s).begin(), PathView(s).end());
+            bool normalized = true;
+            for (size_t j = 0; j < segments.size(); ++j) {
+                bool inner = j != 0 && j + 1 != segments.size();
+                if ((segments[j].empty() && inner) ||
+                    segments[j] == "." || segments[j] == "..") {
+                    normalized = false;
+                }
+            }
+            REQUIRE(scan::normalized(s) == normalized);
+
+            /* Which means sanitizing the long way changes nothing */
+            if (normalized && !s.empty() && s.back() != '/') {
+                REQUIRE(Path(s + "/./").sanitize() == s + "/");
+            }
+        }
+    }
+
+    SECTION("normalize", "Make sure batches of paths normalize in parallel") {
+        std::vector<std::string> inputs({
+            "a/b", "/x/../y", "./a//b", "../c", "", "/", "a/b/", "../../../.."});
+        for (int i = 0; i < 3000; ++i) {
+            inputs.push_back("d" + std::to_string(i % 7) + "/./e//../f" + std::to_string(i % 13));
+        }
+
+        for (unsigned threads : {1u, 4u}) {
+            std::vector<Path> results;
+            Path::normalize(inputs, "/base/dir", results, threads);
+            REQUIRE(results.size() == inputs.size());
+            for (size_t i = 0; i < inputs.size(); ++i) {
+                REQUIRE(results[i] == Path(inputs[i]).absolute("/base/dir").sanitize());
+            }
+
+            /* Results get reused, and shrunk to fit */
+            Path::normalize(std::vector<Path>({"x", "/y/./z"}), "/base", results, threads);
+            REQUIRE(results == std::vector<Path>({"/base/x", "/y/z"}));
+        }
+
+        /* Into an arena, relative to the working directory */
+        std::pmr::synchronized_pool_resource pool;
+        std::pmr::vector<Path> arena(&pool);
+        std::vector<std::string_view> views(inputs.begin(), inputs.end());
+        Path::normalize(views, "", arena, 4);
+        REQUIRE(arena.size() == inputs.size());
+        REQUIRE(arena[0].string() == Path::cwd().append("a/b").string());
+        REQUIRE(arena[0].get_allocator().resource() == &pool);
+
+        /* And without duplicates */
+        std::vector<Path> unique;
+        std::vector<size_t> groups;
+        Path::normalize(inputs, "/base/dir", unique, groups, 4);
+        REQUIRE(groups.size() == inputs.size());
+        REQUIRE(unique.size() == 6 + 7 * 13);
+        REQUIRE(std::vector<Path>(unique.begin(), unique.begin() + 6) == std::vector<Path>({
+            "/base/dir/a/b", "/y", "/base/c", "/base/dir/", "/", "/base/dir/a/b/"}));
+        REQUIRE(groups[2] == 0);
+        REQUIRE(groups[7] == 4);
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            REQUIRE(unique[groups[i]] == Path(inputs[i]).absolute("/base/dir").sanitize());
+        }
+    }
+
+    SECTION("ordering", "Make sure paths sort parents first, and hash") {
+        std::vector<Path> paths({"b", "a.c", "a-b", "a/b/c", "a/b", "a"});
+        std::sort(paths.begin(), paths.end());
+        REQUIRE(paths == std::vector<Path>({"a", "a/b", "a/b/c", "a-b", "a.c", "b"}));
+        REQUIRE(Path("a") < Path("a/"));
+        REQUIRE(Path("a/b") <= Path("a/b"));
+        REQUIRE(Path("a-b") > Path("a/b"));
+        REQUIRE(PathView("a/z") < PathView("a0"));
+        REQUIRE(IndexedPath("a/b") < IndexedPath("a-b"));
+        REQUIRE(IndexedPath("a-b") > IndexedPath("a/b"));
+        REQUIRE(IndexedPath("a/b") <= IndexedPath("a/b"));
+        REQUIRE(IndexedPath("a/") >= IndexedPath("a"));
+
+        std::unordered_set<Path> set(paths.begin(), paths.end());
+        REQUIRE(set.size() == paths.size());
+        REQUIRE(set.count(Path("a/b")));
+        REQUIRE(std::hash<Path>()(Path("a/b")) == std::hash<PathView>()(PathView("a/b")));
+        REQUIRE(std::hash<IndexedPath>()(IndexedPath("a/b")) == std::hash<Path>()(Path("a/b")));
+
+        /* Keys for equivalent paths are the same */
+        PathKey key("./foo//a/../b");
+        REQUIRE(key == PathKey("foo/b"));
+        REQUIRE(key.hash() == PathKey(Path::join(Path::cwd(), "foo/b")).hash());
+        REQUIRE(key.path() == Path::join(Path::cwd(), "foo/b"));
+        REQUIRE(key != PathKey("foo/b/"));
+        REQUIRE(key.path().equivalent("foo/b"));
+
+        std::vector<Path> unique(PathKey::unique(
+            {"foo/b", "./foo/b", "foo/c", "foo/a/../b", "foo/c", "foo//c", "/foo/b"}));
+        REQUIRE(unique == std::vector<Path>({"foo/b", "foo/c", "/foo/b"}));
+    }
+
+    SECTION("IndexedPath", "Make sure indexed paths answer the same as paths") {
+        std::string long_name(300, 'x');
+        std::string deep;
+        for (size_t i = 0; i < 50; ++i) {
+            deep += "/d";
+        }
+        const char* examples[] = {
+            "", "/", "a", "a.b", ".bashrc", "/a/b.c/", "foo/bar.txt",
+            "foo/.bashrc", "/usr/local/lib/libfoo.so.1", "a/b/c/", "../a/b",
+            "./a//b/../c", "/..", "a.b/c", "a/"
+        };
+        std::vector<std::string> paths(std::begin(examples), std::end(examples));
+        paths.push_back("/tmp/" + long_name + "/file." + long_name);
+        paths.push_back(deep + "/file.txt");
+        paths.push_back("a/" + std::string(IndexedPath::inline_capacity - 2, 'y'));
+        paths.push_back("a/" + std::string(IndexedPath::inline_capacity - 1, 'y'));
+
+        for (const std::string& s : paths) {
+            Path p(s);
+            IndexedPath indexed(s);
+            for (int twice = 0; twice < 2; ++twice) {
+                REQUIRE(indexed.string() == s);
+                REQUIRE(indexed.is_absolute() == p.is_absolute());
+                REQUIRE(indexed.trailing_slash() == p.trailing_slash());
+                REQUIRE(std::string(indexed.filename()) == p.filename());
+                REQUIRE(std::string(indexed.extension()) == p.extension());
+                REQUIRE(indexed.stem().string() == p.stem().string());
+                REQUIRE(indexed.parent().path() == p.parent());
+
+                std::vector<Path::Segment> segments(p.split());
+                REQUIRE(indexed.segments() == segments.size());
+                for (size_t i = 0; i < segments.size(); ++i) {
+                    REQUIRE(std::string(indexed.segment(i)) == segments[i].segment);
+                }
+                REQUIRE(indexed.hash() == std::hash<std::string_view>()(s));
+            }
+
+            /* Copies and moves keep the same answers */
+            IndexedPath copy(indexed);
+            REQUIRE(copy == indexed);
+            REQUIRE(std::string(copy.filename()) == p.filename());
+            IndexedPath moved(std::move(copy));
+            REQUIRE(moved == indexed);
+            REQUIRE(moved.segments() == indexed.segments());
+            REQUIRE(copy.string().empty());
+
+            REQUIRE(IndexedPath(indexed).sanitize().path() == Path(p).sanitize());
+            REQUIRE(IndexedPath(indexed).trim().path() == Path(p).trim());
+            REQUIRE(IndexedPath(indexed).directory().path() == Path(p).directory());
+            REQUIRE(IndexedPath(indexed).append("x.y").path() == Path(p).append("x.y"));
+        }
+
+        /* So that vectors of them move rather than copy when they grow */
+        static_assert(std::is_nothrow_move_constructible<IndexedPath>::value, "move");
+        static_assert(std::is_nothrow_move_assignable<IndexedPath>::value, "move");
+        static_assert(sizeof(IndexedPath) <= 128, "two cache lines");
+
+        /* Modifying it forgets what it knew */
+        IndexedPath p("foo/bar.txt");
+        REQUIRE(p.extension() == "txt");
+        p.append("baz");
+        REQUIRE(p.filename() == "baz");
+        REQUIRE(p.extension() == "");
+        REQUIRE(p.segments() == 3);
+        REQUIRE(p != IndexedPath("foo/bar.txt"));
+        p = PathView("/a/b");
+        REQUIRE(p.parent() == IndexedPath("/a/"));
+    }
+
+    SECTION("FixedPath", "Make sure fixed paths work at compile time too") {
+        constexpr FixedPath prefix("/usr/share/");
+        constexpr auto icons = FixedPath<64>(prefix) << "./app//" << "../app/icons/";
+        constexpr auto clean = FixedPath<64>(icons).sanitize();
+        static_assert(clean.string() == "/usr/share/app/icons/", "sanitize");
+        static_assert(prefix.capacity() == 11, "deduced capacity");
+        static_assert(FixedPath<32>::join("a", "b.tar.gz").extension() == "gz", "join");
+        static_assert(FixedPath<32>("a/b.tar.gz").stem().string() == "a/b.tar", "stem");
+        static_assert(FixedPath<32>("a/b.c").filename() == "b.c", "filename");
+        static_assert(!FixedPath<32>("a/").is_absolute(), "is_absolute");
+        static_assert(FixedPath<32>("a/").trailing_slash(), "trailing_slash");
+        static_assert(FixedPath<32>("a///").directory() == FixedPath<32>("a/"), "directory");
+
+        /* Into a path, with one copy */
+        Path p(clean);
+        REQUIRE(p == Path("/usr/share/app/icons/"));
+        REQUIRE(std::string(clean.c_str()) == "/usr/share/app/icons/");
+
+        /* The same answers as Path gives */
+        constexpr auto sanitized = [](std::string_view s) {
+            return FixedPath<32>(s).sanitize();
+        };
+        static_assert(sanitized("").string() == "", "sanitize");
+        static_assert(sanitized("/..").string() == "/", "sanitize");
+        static_assert(sanitized("./").string() == "", "sanitize");
+        static_assert(sanitized("./a//b/../c").string() == "a/c", "sanitize");
+        static_assert(sanitized("a/../..").string() == "..", "sanitize");
+        static_assert(sanitized("../../a/./b/../../..").string() == "../../..", "sanitize");
+        static_assert(sanitized("a/b/c/../../../../d").string() == "../d", "sanitize");
+        static_assert(sanitized("/a/../../b/").string() == "/b/", "sanitize");
+        static_assert(sanitized("//a//b//").string() == "/a/b/", "sanitize");
+        static_assert(FixedPath<32>("./").trim().string() == ".", "trim");
+        static_assert(FixedPath<32>("").directory().string() == "/", "directory");
+        static_assert(FixedPath<32>("").append("x").string() == "/x", "append");
+        static_assert(FixedPath<32>("foo/.bashrc").extension() == "bashrc", "extension");
+        static_assert(FixedPath<32>("foo/.bashrc").stem().string() == "foo/", "stem");
+        static_assert(FixedPath<32>("/..").stem().string() == "/.", "stem");
+        static_assert(FixedPath<32>("a").filename() == "", "filename");
+
+        /* Past the capacity, it won't fit */
+        FixedPath<4> small("abc");
+        REQUIRE_THROWS_AS(small.append("d"), std::length_error);
     }
 
     SECTION("equivalent", "Make sure equivalent paths work") {
@@ -198,15 +501,576 @@ TEST_CASE("path", "Path functionality works as advertised") {
         Path path("foo");
         REQUIRE(!path.exists());
         path << "bar" << "baz" << "whiz";
-        Path::makedirs(path);
+        REQUIRE(Path::makedirs(path));
         REQUIRE(path.exists());
         REQUIRE(path.is_directory());
+        REQUIRE(Path::makedirs(path));
+
+        /* Only some of the ancestors exist, or the path is untidy */
+        REQUIRE(Path::makedirs("foo/bar/a/b/c/d/e/f/g/h"));
+        REQUIRE(Path("foo/bar/a/b/c/d/e/f/g/h").is_directory());
+        REQUIRE(Path::makedirs("foo//bar/./x/../y/"));
+        REQUIRE(Path("foo/bar/y").is_directory());
+
+        /* Files in the way don't count */
+        Path::touch("foo/file");
+        REQUIRE(!Path::makedirs("foo/file"));
+        REQUIRE(!Path::makedirs("foo/file/a/b"));
+
+        /* Racing to make the same directories is fine */
+        std::vector<std::thread> threads;
+        std::atomic<int> made(0);
+        for (int i = 0; i < 4; ++i) {
+            threads.emplace_back([&made]() {
+                for (int j = 0; j < 20; ++j) {
+                    made += Path::makedirs(Path::join("foo/race", j, "a/b"));
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        REQUIRE(made == 80);
 
         /* Now, we should remove the directories, make sure it's gone. */
         REQUIRE(Path::rmdirs("foo"));
         REQUIRE(!Path("foo").exists());
     }
 
+#if defined(APATHY_INSTRUMENT)
+    SECTION("instrument", "Make sure system calls and allocations get counted") {
+        using namespace apathy::instrument;
+        Path::makedirs("foo");
+        Path::touch("foo/bar");
+
+        reset();
+        REQUIRE(Path("foo/bar").exists());
+        REQUIRE(thread_counters()[Syscall::stat] == 1);
+        REQUIRE(thread_counters().total() == 1);
+
+        reset();
+        Path::listdir("foo");
+        REQUIRE(thread_counters()[Syscall::opendir] == 1);
+        REQUIRE(thread_counters()[Syscall::closedir] == 1);
+        REQUIRE(thread_counters()[Syscall::readdir] >= 1);
+
+        /* Hooks see every call */
+        static std::atomic<int> renames(0);
+        set_hook([](Syscall call, const char*) {
+            renames += call == Syscall::rename;
+        });
+        REQUIRE(Path::move("foo/bar", "foo/baz"));
+        set_hook(nullptr);
+        REQUIRE(renames == 1);
+
+        /* Walks are timed */
+        uint64_t before = histogram(Operation::recursive_listdir).total();
+        Path::recursive_listdir("foo");
+        REQUIRE(histogram(Operation::recursive_listdir).total() == before + 1);
+        REQUIRE(histogram(Operation::recursive_listdir).percentile(0.5) > 0);
+
+        track_allocations();
+        reset();
+        Path p("some/path/that/is/too/long/for/the/small/string/buffer");
+        REQUIRE(thread_counters().allocations == 1);
+        REQUIRE(thread_counters().bytes_allocated > p.string().size());
+
+        REQUIRE(Path::rmdirs("foo"));
+    }
+#endif
+
+    SECTION("AsyncFilesystem", "Make sure operations can run in the background") {
+        AsyncFilesystem fs(4, 8);
+        REQUIRE(fs.threads() == 4);
+
+        REQUIRE(!fs.makedirs("foo/bar").get());
+        REQUIRE(!fs.touch("foo/bar/a").get());
+        REQUIRE(fs.exists("foo/bar/a").get());
+        REQUIRE(fs.is_file("foo/bar/a").get());
+        REQUIRE(fs.is_directory("foo/bar").get());
+        REQUIRE(fs.size("foo/bar/a").get() == 0);
+        REQUIRE(fs.status("foo/bar").get().is_directory());
+        REQUIRE(!fs.move("foo/bar/a", "foo/bar/b").get());
+        REQUIRE(fs.listdir("foo/bar").get().size() == 1);
+        REQUIRE(!fs.rm("foo/bar/b").get());
+        REQUIRE(!fs.exists("foo/bar/b").get());
+
+        /* Errors come back in the future rather than being printed */
+        REQUIRE(fs.rm("foo/bar/b").get() == std::errc::no_such_file_or_directory);
+        REQUIRE(!fs.touch("foo/bar/a").get());
+        REQUIRE(fs.makedirs("foo/bar/a/c").get() == std::errc::not_a_directory);
+        REQUIRE(!fs.rm("foo/bar/a").get());
+
+        /* Batches bigger than the queue still all get run */
+        std::vector<Path> paths;
+        for (int i = 0; i < 100; ++i) {
+            paths.push_back(Path::join("foo", i));
+        }
+        std::vector<std::future<bool> > made(fs.submit_all(paths, [](const Path& p) {
+            return Path::touch(p);
+        }));
+        for (std::future<bool>& result : made) {
+            REQUIRE(result.get());
+        }
+        std::vector<std::future<Path::Status> > statuses(fs.status(paths));
+        for (std::future<Path::Status>& status : statuses) {
+            REQUIRE(status.get().is_file());
+        }
+
+        /* Exceptions make it back, and tasks can queue more tasks */
+        std::future<int> thrown(fs.submit([]() -> int { throw std::runtime_error("nope"); }));
+        REQUIRE_THROWS_AS(thrown.get(), std::runtime_error);
+        std::future<bool> nested(fs.submit([&fs]() { return fs.exists("foo").get(); }));
+        REQUIRE(nested.get());
+
+        REQUIRE(Path::rmdirs("foo"));
+    }
+
+#if !defined(_WIN32)
+    SECTION("copy", "Make sure we can copy files and trees") {
+        Path::makedirs("foo/a/b");
+        std::string contents(3 * 1024 * 1024 + 17, 'x');
+        for (size_t i = 0; i < contents.size(); i += 7) {
+            contents[i] = static_cast<char>('a' + i % 26);
+        }
+        {
+            std::ofstream out("foo/a/big");
+            out << contents;
+        }
+        Path::touch("foo/a/b/empty");
+        REQUIRE(chmod("foo/a/big", 0640) == 0);
+        REQUIRE(symlink("../big", "foo/a/b/link") == 0);
+
+        /* Files keep their contents, mode and times */
+        REQUIRE(Path::copy("foo/a/big", "foo/copy"));
+        std::ifstream in("foo/copy");
+        std::string copied((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        REQUIRE(copied == contents);
+        Path::Status original(Path("foo/a/big").status());
+        Path::Status copy(Path("foo/copy").status());
+        REQUIRE(copy.mode == original.mode);
+        REQUIRE(copy.mtime == original.mtime);
+        REQUIRE(copy.mtime_nsec == original.mtime_nsec);
+
+        /* Copies replace what's there, and don't leave anything behind */
+        REQUIRE(Path::copy("foo/a/b/empty", "foo/copy"));
+        REQUIRE(Path("foo/copy").size() == 0);
+        REQUIRE(!Path::copy("foo/nope", "foo/copy"));
+        REQUIRE(Path::listdir("foo").size() == 2);
+
+        /* Only regular files are copied, so FIFOs don't wait for a writer */
+        std::error_code ec;
+        REQUIRE(mkfifo("foo/fifo", 0600) == 0);
+        REQUIRE(!Path::copy("foo/fifo", "foo/other", ec));
+        REQUIRE(ec == std::errc::invalid_argument);
+        REQUIRE(!Path::copy("foo/a", "foo/other", ec));
+        REQUIRE(ec == std::errc::is_a_directory);
+        REQUIRE(Path::rm("foo/fifo"));
+        REQUIRE(Path::listdir("foo").size() == 2);
+
+        /* Trees keep their structure, and symlinks stay symlinks */
+        REQUIRE(Path::recursive_copy("foo/a", "foo/tree", 4));
+        REQUIRE(Path("foo/tree/big").size() == contents.size());
+        REQUIRE(Path("foo/tree/b/empty").is_file());
+        REQUIRE(Path("foo/tree/b/link").symlink_status().is_symlink());
+        REQUIRE(Path("foo/tree/b").status().mtime == Path("foo/a/b").status().mtime);
+        REQUIRE(!Path::recursive_copy("foo/a", "foo/tree"));
+        REQUIRE(!Path::recursive_copy("foo/copy", "foo/other"));
+        REQUIRE(Path::listdir("foo").size() == 3);
+
+        /* Moving to another filesystem copies and removes */
+        Path shm("/dev/shm");
+        if (shm.is_directory() && shm.status().device != Path("foo").status().device) {
+            Path target(Path::join(shm, "apathy-test-" + std::to_string(getpid())));
+            REQUIRE(Path::move("foo/tree", target));
+            REQUIRE(!Path("foo/tree").exists());
+            REQUIRE(Path::join(target, "big").size() == contents.size());
+            REQUIRE(Path::join(target, "b/link").symlink_status().is_symlink());
+            REQUIRE(Path::move(Path::join(target, "big"), "foo/big"));
+            REQUIRE(Path("foo/big").size() == contents.size());
+            REQUIRE(Path::rmdirs(target));
+        }
+
+        REQUIRE(Path::rmdirs("foo"));
+    }
+#endif
+
+    SECTION("read_all", "Make sure we can read, write and map whole files") {
+        Path::makedirs("foo");
+        std::string contents(100000, 'x');
+        for (size_t i = 0; i < contents.size(); i += 13) {
+            contents[i] = '\n';
+        }
+
+        REQUIRE(Path::write_all("foo/bar", contents));
+        std::string read;
+        REQUIRE(Path::read_all("foo/bar", read));
+        REQUIRE(read == contents);
+
+        /* Writes replace the file whole, and leave nothing else behind */
+        REQUIRE(Path::write_all("foo/bar", "short"));
+        REQUIRE(Path::read_all("foo/bar", read));
+        REQUIRE(read == "short");
+        REQUIRE(Path::listdir("foo").size() == 1);
+        REQUIRE(!Path::read_all("foo/nope", read));
+        REQUIRE(!Path::write_all("foo/nope/bar", "x"));
+
+        REQUIRE(Path::write_all("foo/bar", contents));
+        MappedFile mapped("foo/bar", MappedFile::sequential);
+        REQUIRE(mapped.is_open());
+        REQUIRE(mapped.view() == contents);
+        REQUIRE(mapped.advise(MappedFile::random));
+
+        /* Mappings can be moved, and outlive the file's name */
+        MappedFile moved(std::move(mapped));
+        REQUIRE(!mapped.is_open());
+        REQUIRE(Path::rm("foo/bar"));
+        REQUIRE(moved.size() == contents.size());
+        REQUIRE(moved.view().substr(0, 13) == contents.substr(0, 13));
+        moved.close();
+        REQUIRE(!moved.is_open());
+
+        Path::touch("foo/empty");
+        MappedFile empty("foo/empty");
+        REQUIRE(empty.is_open());
+        REQUIRE(empty.view().empty());
+        REQUIRE(!MappedFile("foo/nope").is_open());
+
+        REQUIRE(Path::rmdirs("foo"));
+    }
+
+    SECTION("snapshot", "Make sure we can snapshot trees and diff them") {
+        Path::makedirs("foo/b");
+        Path::makedirs("foo/d/e");
+        Path::touch("foo/a");
+        Path::touch("foo/b/c");
+        Path::touch("foo/d/e/f");
+
+        Snapshot snapshot("foo");
+        REQUIRE(snapshot.root() == Path("foo").absolute());
+        REQUIRE(snapshot.size() == 7);
+        REQUIRE(snapshot.find("b/c").is_file());
+        REQUIRE(snapshot.find("d/e").is_directory());
+        REQUIRE(!snapshot.find("b/nope").exists());
+        REQUIRE(snapshot.diff().empty());
+
+        std::ofstream("foo/a", std::ios::app) << "changed";
+        Path::touch("foo/b/g");
+        REQUIRE(Path::rmdirs("foo/d"));
+
+        Path root(snapshot.root());
+        std::vector<Snapshot::Change> changes(snapshot.update());
+        std::map<std::string, Snapshot::Change::Kind> kinds;
+        for (const Snapshot::Change& change : changes) {
+            kinds[change.path.string()] = change.kind;
+        }
+        REQUIRE(changes.size() == 5);
+        REQUIRE(kinds[Path::join(root, "a").string()] == Snapshot::Change::modified);
+        REQUIRE(kinds[Path::join(root, "b/g").string()] == Snapshot::Change::added);
+        REQUIRE(kinds[Path::join(root, "d").string()] == Snapshot::Change::removed);
+        REQUIRE(kinds[Path::join(root, "d/e/f").string()] == Snapshot::Change::removed);
+        REQUIRE(snapshot.size() == 5);
+        REQUIRE(snapshot.diff().empty());
+
+        /* Files changed in place only show up when they're stat'd */
+        std::ofstream("foo/b/c", std::ios::app) << "changed";
+        REQUIRE(snapshot.diff(false).empty());
+        REQUIRE(snapshot.diff().size() == 1);
+        REQUIRE(snapshot.diff()[0].path == Path::join(root, "b/c"));
+
+        /* Snapshots survive being saved and loaded */
+        REQUIRE(snapshot.save("snapshot"));
+        Snapshot loaded;
+        REQUIRE(Snapshot::load("snapshot", loaded));
+        REQUIRE(loaded.root() == root);
+        REQUIRE(loaded.size() == snapshot.size());
+        REQUIRE(loaded.diff().size() == 1);
+        std::string data(snapshot.serialize());
+        REQUIRE(!Snapshot::deserialize(data.substr(0, data.size() - 1), loaded));
+        REQUIRE(!Snapshot::deserialize("nope", loaded));
+        REQUIRE(loaded.size() == snapshot.size());
+
+        /* Updating one directory leaves what's under its subdirectories as
+         * it was, unless they're new */
+        Path::makedirs("foo/b/h/i");
+        Path::touch("foo/g");
+        changes = snapshot.update_directory("");
+        REQUIRE(changes.size() == 1);
+        REQUIRE(changes[0].path == Path::join(root, "g"));
+        changes = snapshot.update_directory("b/h");
+        REQUIRE(changes.size() == 3);
+        kinds.clear();
+        for (const Snapshot::Change& change : changes) {
+            kinds[change.path.string()] = change.kind;
+        }
+        REQUIRE(kinds[Path::join(root, "b/c").string()] == Snapshot::Change::modified);
+        REQUIRE(kinds[Path::join(root, "b/h/i").string()] == Snapshot::Change::added);
+        REQUIRE(snapshot.find("b/h/i").is_directory());
+        REQUIRE(snapshot.size() == 8);
+        REQUIRE(snapshot.diff().empty());
+
+        /* Trees deeper than a scan keeps directories open for are fine */
+        std::string deep("foo/deep");
+        for (int i = 0; i < 70; ++i) {
+            deep += "/d";
+        }
+        REQUIRE(Path::makedirs(deep));
+        Path::touch(deep + "/f");
+        Snapshot deeper("foo/deep");
+        REQUIRE(deeper.size() == 72);
+        std::ofstream(deep + "/f") << "changed";
+        REQUIRE(deeper.diff().size() == 1);
+        REQUIRE(Path::rmdirs("foo/deep"));
+        REQUIRE(deeper.diff().size() == 71);
+
+        REQUIRE(Path::rm("snapshot"));
+        REQUIRE(Path::rmdirs("foo"));
+    }
+
+#if defined(__linux__)
+    SECTION("watcher", "Make sure we can watch trees for changes") {
+        typedef std::map<std::string, Watcher::Event::Kind> Kinds;
+        /* Gather batches until `count` paths have changed, or nothing does */
+        auto gather = [](Watcher& watcher, size_t count) {
+            Kinds kinds;
+            while (kinds.size() < count) {
+                std::vector<Watcher::Event> events(watcher.wait(std::chrono::seconds(2)));
+                if (events.empty()) {
+                    break;
+                }
+                for (const Watcher::Event& event : events) {
+                    kinds[event.path.string()] = event.kind;
+                }
+            }
+            return kinds;
+        };
+
+        Path::makedirs("foo/a");
+        Watcher watcher(std::chrono::milliseconds(20));
+        REQUIRE(watcher.add("foo"));
+        REQUIRE(!watcher.add("foo/nope"));
+        REQUIRE(watcher.roots() == 1);
+        REQUIRE(watcher.polled() == 0);
+        REQUIRE(watcher.watches() == 2);
+        REQUIRE(watcher.wait(std::chrono::milliseconds(0)).empty());
+
+        /* Directories are watched as they appear, and whatever was already
+         * in them is reported too */
+        Path root(Path("foo").absolute());
+        Path::makedirs("foo/c/d");
+        Path::touch("foo/c/d/e");
+        Path::touch("foo/b");
+        Kinds kinds(gather(watcher, 4));
+        REQUIRE(kinds.size() == 4);
+        REQUIRE(kinds[Path::join(root, "b").string()] == Watcher::Event::added);
+        REQUIRE(kinds[Path::join(root, "c").string()] == Watcher::Event::added);
+        REQUIRE(kinds[Path::join(root, "c/d/e").string()] == Watcher::Event::added);
+        REQUIRE(watcher.watches() == 4);
+
+        /* Changes within a batch are coalesced */
+        Path::touch("foo/x");
+        std::ofstream("foo/x") << "changed";
+        REQUIRE(Path::rm("foo/x"));
+        std::ofstream("foo/c/d/e", std::ios::app) << "changed";
+        std::ofstream("foo/c/d/e", std::ios::app) << "again";
+        kinds = gather(watcher, 1);
+        REQUIRE(kinds.size() == 1);
+        REQUIRE(kinds[Path::join(root, "c/d/e").string()] == Watcher::Event::modified);
+
+        REQUIRE(Path::rmdirs("foo/c"));
+        kinds = gather(watcher, 3);
+        REQUIRE(kinds.size() == 3);
+        REQUIRE(kinds[Path::join(root, "c").string()] == Watcher::Event::removed);
+        REQUIRE(kinds[Path::join(root, "c/d/e").string()] == Watcher::Event::removed);
+        REQUIRE(watcher.watches() == 2);
+
+        /* Overflowing the kernel's queue is recovered from by diffing, which
+         * only finds what hasn't been reported already */
+        std::vector<Path> files;
+        for (int i = 0; i < 20000; ++i) {
+            files.push_back(Path::join("foo/a", i));
+        }
+        REQUIRE(Path::touch(files));
+        kinds = gather(watcher, files.size());
+        REQUIRE(kinds.size() == files.size());
+        REQUIRE(!kinds.count(Path::join(root, "b").string()));
+        REQUIRE(watcher.wait(std::chrono::milliseconds(100)).empty());
+        size_t added = 0;
+        for (const Kinds::value_type& kind : kinds) {
+            added += kind.second == Watcher::Event::added;
+        }
+        REQUIRE(added == files.size());
+
+        REQUIRE(Path::rmdirs("foo"));
+    }
+#endif
+
+    SECTION("batch", "Make sure we can make many paths at once") {
+        for (unsigned threads = 1; threads <= 4; threads += 3) {
+            std::vector<Path> directories;
+            std::vector<Path> files;
+            for (int i = 0; i < 10; ++i) {
+                for (int j = 0; j < 5; ++j) {
+                    directories.push_back(Path::join("foo/bar", i, j));
+                    files.push_back(Path::join("foo/baz", i, j));
+                }
+            }
+            directories.push_back("foo/bar/3/");
+            directories.push_back("foo/bar");
+
+            REQUIRE(Path::makedirs(directories, 0777, threads));
+            REQUIRE(Path::makedirs(directories, 0777, threads));
+            REQUIRE(Path::touch(files, 0777, threads));
+            for (const Path& p : directories) {
+                REQUIRE(p.is_directory());
+            }
+            for (const Path& p : files) {
+                REQUIRE(p.is_file());
+            }
+
+            /* Files in the way are failures, but don't stop the others */
+            REQUIRE(!Path::makedirs(std::vector<Path>({"foo/baz/1/1", "foo/whiz"})));
+            REQUIRE(Path("foo/whiz").is_directory());
+            REQUIRE(Path::rmdirs("foo"));
+        }
+    }
+
+    SECTION("rmdirs", "Make sure we can remove whole trees") {
+        for (unsigned threads = 1; threads <= 4; threads += 3) {
+            for (int i = 0; i < 10; ++i) {
+                Path::makedirs(Path::join("foo", i, "a", "b"));
+                Path::touch(Path::join("foo", i, "file"));
+                Path::touch(Path::join("foo", i, "a", "b", "file"));
+            }
+            Path::touch("foo/file");
+            REQUIRE(Path::rmdirs("foo", false, threads));
+            REQUIRE(!Path("foo").exists());
+        }
+
+#if !defined(_WIN32)
+        /* Symlinks get removed, not what they point to */
+        Path::makedirs("bar");
+        Path::touch("bar/keep");
+        Path::makedirs("foo");
+        REQUIRE(symlink(Path("bar").absolute().string().c_str(), "foo/link") == 0);
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+        REQUIRE(Path("bar/keep").exists());
+        REQUIRE(Path::rmdirs("bar"));
+#endif
+
+        /* Plain files can be removed, too, but not things that don't exist */
+        Path::touch("foo");
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path::rmdirs("foo", true));
+    }
+
+    SECTION("error_code", "Make sure errors can come back as values") {
+        std::error_code ec;
+        REQUIRE(Path::listdir("missing", ec).empty());
+        REQUIRE(ec == std::errc::no_such_file_or_directory);
+        REQUIRE(Path::scandir("missing", ec).empty());
+        REQUIRE(ec == std::errc::no_such_file_or_directory);
+        REQUIRE(!Path::rm("missing", ec));
+        REQUIRE(ec == std::errc::no_such_file_or_directory);
+        REQUIRE(!Path::rmdirs("missing", ec));
+        REQUIRE(ec == std::errc::no_such_file_or_directory);
+
+        REQUIRE(Path::touch("foo", ec));
+        REQUIRE(!ec);
+        REQUIRE(!Path::makedirs("foo", ec));
+        REQUIRE(ec == std::errc::file_exists);
+        REQUIRE(!Path::makedirs("foo/bar", ec));
+        REQUIRE(ec == std::errc::not_a_directory);
+        REQUIRE(!Path::makedirs(std::vector<Path>({"foo/bar", "foo/baz"}), ec));
+        REQUIRE(ec == std::errc::not_a_directory);
+        REQUIRE(!Path::touch(std::vector<Path>({"foo/bar/a", "foo/baz/b"}), ec));
+        REQUIRE(ec == std::errc::not_a_directory);
+        REQUIRE(Path::listdir(".", ec).size() > 0);
+        REQUIRE(!ec);
+        REQUIRE(Path::cwd(ec) == Path::cwd());
+        REQUIRE(!ec);
+        REQUIRE(Path("a").absolute(ec) == Path::cwd().append("a"));
+        REQUIRE(!ec);
+
+        std::string contents;
+        REQUIRE(!Path::read_all("missing", contents, ec));
+        REQUIRE(ec == std::errc::no_such_file_or_directory);
+        REQUIRE(!Path::write_all("missing/foo", "a", ec));
+        REQUIRE(ec == std::errc::no_such_file_or_directory);
+        REQUIRE(!Path::copy("missing", "bar", ec));
+        REQUIRE(ec == std::errc::no_such_file_or_directory);
+        REQUIRE(!Path::move("missing", "bar", ec));
+        REQUIRE(ec == std::errc::no_such_file_or_directory);
+        REQUIRE(!Path::recursive_copy("foo", "bar", ec));
+        REQUIRE(ec == std::errc::not_a_directory);
+        REQUIRE(!Path::recursive_copy(".", "foo", ec));
+        REQUIRE(ec == std::errc::file_exists);
+        REQUIRE(!Path::recursive_copy("missing", "bar"));
+        REQUIRE(errno == ENOENT);
+
+        REQUIRE(Path::write_all("foo", "a", ec));
+        REQUIRE(!ec);
+        REQUIRE(Path::copy("foo", "bar", ec));
+        REQUIRE(!ec);
+        REQUIRE(Path::move("bar", "baz/bar", ec, true));
+        REQUIRE(!ec);
+        REQUIRE(Path::read_all("baz/bar", contents, ec));
+        REQUIRE(!ec);
+        REQUIRE(contents == "a");
+        REQUIRE(Path::rmdirs("baz", ec));
+        REQUIRE(Path::rm("foo", ec));
+        REQUIRE(!ec);
+
+#if defined(__linux__)
+        /* Paths are left relative if the working directory has gone */
+        Path original(Path::cwd());
+        REQUIRE(Path::makedirs("gone"));
+        REQUIRE(Path::chdir("gone"));
+        REQUIRE(rmdir(Path(original).append("gone").string().c_str()) == 0);
+        REQUIRE(Path("a").absolute(ec) == Path("a"));
+        REQUIRE(ec == std::errc::no_such_file_or_directory);
+        REQUIRE(Path("a").absolute() == Path("a"));
+        REQUIRE(!Path::makedirs("a", ec));
+        REQUIRE(ec == std::errc::no_such_file_or_directory);
+        REQUIRE(Path::chdir(original));
+        REQUIRE(Path("a").absolute(ec) == Path(original).append("a"));
+        REQUIRE(!ec);
+#endif
+    }
+
+    SECTION("SharedPathCache", "Make sure threads can share cached lookups") {
+        REQUIRE(Path::makedirs("foo/bar"));
+        std::vector<Path> paths({"foo/bar", "foo/./bar/../bar", "foo/missing", "foo//"});
+        SharedPathCache cache(4);
+        std::atomic<size_t> wrong(0);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; ++i) {
+            threads.push_back(std::thread([&]() {
+                for (size_t j = 0; j < 1000; ++j) {
+                    const Path& p(paths[j % paths.size()]);
+                    if (cache.normalize(p) != Path(p).absolute().sanitize() ||
+                        cache.status(p).exists() != p.exists()) {
+                        ++wrong;
+                    }
+                }
+            }));
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        REQUIRE(wrong == 0);
+        REQUIRE(cache.size() == 2 * paths.size());
+
+        /* Statuses are kept until they're invalidated */
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(cache.status("foo/bar").is_directory());
+        cache.invalidate("foo/bar");
+        REQUIRE(!cache.status("foo/bar").exists());
+        cache.clear();
+        REQUIRE(cache.size() == 0);
+    }
+
     SECTION("listdirs", "Make sure we can list directories") {
         Path path("foo");
         path << "bar" << "baz" << "whiz";
@@ -233,6 +1097,96 @@ TEST_CASE("path", "Path functionality works as advertised") {
         REQUIRE(!Path("foo").exists());
     }
 
+    SECTION("status", "Make sure we can get everything from one stat") {
+        REQUIRE(!Path("foo").status().exists());
+        REQUIRE(Path("foo").status().type == Path::Status::not_found);
+
+        Path::makedirs("foo");
+        Path::touch("foo/bar");
+        Path::Status dir(Path("foo").status());
+        REQUIRE(dir.is_directory());
+        REQUIRE(!dir.is_file());
+
+        Path::Status file(Path("foo/bar").status());
+        REQUIRE(file.is_file());
+        REQUIRE(file.size == 0);
+        REQUIRE(file.inode != dir.inode);
+        REQUIRE(file.device == dir.device);
+
+        /* The cache only stats once, until we tell it otherwise */
+        static_assert(!std::is_convertible<bool, StatCache>::value, "explicit");
+        StatCache cache;
+        REQUIRE(cache.status("foo/bar").is_file());
+        REQUIRE(Path::rm("foo/bar"));
+        REQUIRE(cache.status("foo/bar").is_file());
+        REQUIRE(cache.size() == 1);
+        cache.invalidate("foo/bar");
+        REQUIRE(!cache.status("foo/bar").exists());
+
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+    }
+
+    SECTION("scandir", "Make sure we can list entries with their types") {
+        Path::makedirs("foo/bar");
+        Path::touch("foo/baz");
+
+        std::vector<Path::Entry> entries = Path::scandir("foo");
+        REQUIRE(entries.size() == 2);
+        for (const Path::Entry& entry : entries) {
+            REQUIRE(entry.path == Path("foo").absolute().append(Path(std::string(entry.name()))));
+            if (entry.name() == "bar") {
+                REQUIRE(entry.is_directory());
+            } else {
+                REQUIRE(entry.name() == "baz");
+                REQUIRE(entry.is_file());
+            }
+#if !defined(_WIN32)
+            REQUIRE(entry.inode == entry.path.status().inode);
+#endif
+        }
+
+        REQUIRE(Path::scandir("nonexistent").empty());
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+    }
+
+    SECTION("pmr", "Make sure paths can live in a memory resource") {
+        char buffer[64 * 1024];
+        std::pmr::monotonic_buffer_resource arena(
+            buffer, sizeof(buffer), std::pmr::null_memory_resource());
+
+        Path p("foo///bar/../a-long-enough-name-to-need-an-allocation/", &arena);
+        REQUIRE(p.get_allocator().resource() == &arena);
+        p.sanitize().absolute();
+        REQUIRE(p == Path::cwd().append("foo/a-long-enough-name-to-need-an-allocation/"));
+        REQUIRE(p.get_allocator().resource() == &arena);
+
+        /* Copies go back to the default resource */
+        Path copy(p);
+        REQUIRE(copy.get_allocator().resource() == std::pmr::get_default_resource());
+        REQUIRE(copy == p);
+
+        Path::makedirs("foo/bar");
+        Path::touch("foo/bar/a");
+        Path::touch("foo/b");
+
+        std::pmr::vector<Path> listed(Path::listdir("foo", &arena));
+        REQUIRE(listed.size() == 2);
+        std::pmr::vector<Path> all(Path::recursive_listdir("foo", &arena));
+        REQUIRE(all.size() == 3);
+        for (const Path& path : listed) {
+            REQUIRE(path.get_allocator().resource() == &arena);
+            REQUIRE(std::find(all.begin(), all.end(), path) != all.end());
+        }
+        for (const Path& path : all) {
+            REQUIRE(path.get_allocator().resource() == &arena);
+        }
+
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+    }
+
     SECTION("rm", "Make sure we can remove files we create") {
         REQUIRE(!Path("foo").exists());
         Path::touch("foo");
@@ -285,6 +1239,30 @@ TEST_CASE("path", "Path functionality works as advertised") {
         REQUIRE(a.split().size() == 5);
     }
 
+    SECTION("view", "Make sure we can walk segments without copying") {
+        Path a("/foo/bar/baz/");
+        PathView view(a.view());
+        std::vector<std::string> segments(view.begin(), view.end());
+        REQUIRE(segments.size() == a.split().size());
+        REQUIRE(segments[0] == "");
+        REQUIRE(segments[1] == "foo");
+        REQUIRE(segments[3] == "baz");
+        REQUIRE(segments[4] == "");
+
+        /* We should be able to walk it backwards, too */
+        PathView::iterator it(view.end());
+        REQUIRE(*(--it) == "");
+        REQUIRE(*(--it) == "baz");
+        REQUIRE(*(--it) == "bar");
+
+        /* And an empty path has no segments at all */
+        REQUIRE(PathView("").begin() == PathView("").end());
+
+        REQUIRE(PathView("foo/bar.baz/out.gz").filename() == "out.gz");
+        REQUIRE(PathView("foo/bar.baz/out.gz").extension() == "gz");
+        REQUIRE(PathView("foo/bar.baz/out.gz").stem() == "foo/bar.baz/out");
+    }
+
     SECTION("extension", "Make sure we can accurately get th file extension") {
         /* Works in a basic way */
         REQUIRE(Path("foo/bar/baz.out").extension() == "out");
@@ -310,7 +1288,6 @@ TEST_CASE("path", "Path functionality works as advertised") {
         a = a.stem(); REQUIRE(a == Path("foo"));
     }
 
-#if !defined(_WIN32)
     SECTION("glob", "Make sure glob works") {
         /* We'll touch a bunch of files to work with */
         Path::makedirs("foo");
@@ -326,12 +1303,130 @@ TEST_CASE("path", "Path functionality works as advertised") {
         REQUIRE(Path::glob("foo/b*"  ).size() == 5);
         REQUIRE(Path::glob("foo/baz*").size() == 2);
         REQUIRE(Path::glob("foo/ba?" ).size() == 2);
+        REQUIRE(Path::glob("foo/ba[rz]").size() == 2);
+        REQUIRE(Path::glob("foo/bar[!2]").size() == 1);
+        REQUIRE(Path::glob("foo/bar[1-2]").size() == 1);
+        REQUIRE(Path::glob("foo/bar").size() == 1);
+        REQUIRE(Path::glob("foo/nope").size() == 0);
+        REQUIRE(Path::glob("foo/").size() == 1);
+        REQUIRE(Path::glob("foo/b*/").size() == 0);
+
+        /* Hidden files have to be asked for */
+        Path::touch("foo/.hidden");
+        REQUIRE(Path::glob("foo/*").size() == 6);
+        REQUIRE(Path::glob("foo/.h*").size() == 1);
+
+        /* Results are sorted, and relative to the pattern */
+        std::vector<Path> results(Path::glob("foo/bar*"));
+        REQUIRE(results.size() == 3);
+        REQUIRE(results[0] == Path("foo/bar"));
+        REQUIRE(results[2] == Path("foo/bar3"));
 
         /* Now, we should remove the directories, make sure it's gone. */
         REQUIRE(Path::rmdirs("foo"));
         REQUIRE(!Path("foo").exists());
     }
-#endif
+
+    SECTION("globstar", "Make sure ** matches any number of directories") {
+        Path::makedirs("foo/a/b/c");
+        Path::makedirs("foo/.git/b");
+        Path::touch("foo/x.txt");
+        Path::touch("foo/a/y.txt");
+        Path::touch("foo/a/b/c/z.txt");
+        Path::touch("foo/a/b/c/z.cpp");
+        Path::touch("foo/.git/b/w.txt");
+
+        REQUIRE(Path::glob("foo/**/*.txt").size() == 3);
+        REQUIRE(Path::glob("foo/**/**/*.txt").size() == 3);
+        REQUIRE(Path::glob("foo/**/c/*").size() == 2);
+        REQUIRE(Path::glob("foo/**/b").size() == 1);
+        REQUIRE(Path::glob("foo/**").size() == 8);
+        REQUIRE(Path::glob("foo/**/").size() == 4);
+
+        /* Matches can be streamed, and stopped early */
+        size_t count = 0;
+        Glob("foo/**/*.txt").find([&count](const Path&) {
+            return ++count < 2;
+        });
+        REQUIRE(count == 2);
+
+        /* Paths can also be matched without the filesystem */
+        Glob pattern("foo/**/*.txt");
+        REQUIRE(pattern.match("foo/x.txt"));
+        REQUIRE(pattern.match("foo/a/b/c/z.txt"));
+        REQUIRE(!pattern.match("foo/a/b/c/z.cpp"));
+        REQUIRE(!pattern.match("foo/.git/b/w.txt"));
+        REQUIRE(!pattern.match("/foo/x.txt"));
+        REQUIRE(Glob("/usr/*/lib").match("/usr/local/lib"));
+        REQUIRE(Glob("a\\*b").match("a*b"));
+        REQUIRE(!Glob("a\\*b").match("axb"));
+
+        REQUIRE(Path::rmdirs("foo"));
+    }
+
+    SECTION("PathMatcher", "Make sure many patterns can be matched at once") {
+        PathMatcher matcher;
+        REQUIRE(matcher.add("src/**/*.cpp") == 0);
+        REQUIRE(matcher.add("src/**/*.hpp") == 1);
+        REQUIRE(matcher.add("**/*.cpp") == 2);
+        REQUIRE(matcher.add("src/a/") == 3);
+        REQUIRE(matcher.add("src/?.txt") == 4);
+        REQUIRE(matcher.add("/etc/[a-m]*") == 5);
+        REQUIRE(matcher.size() == 6);
+
+        REQUIRE(matcher.match("src/a/b.cpp") == std::vector<size_t>({0, 2}));
+        REQUIRE(matcher.match("src/b.hpp") == std::vector<size_t>({1}));
+        REQUIRE(matcher.match("b.cpp") == std::vector<size_t>({2}));
+        REQUIRE(matcher.match("src/a/") == std::vector<size_t>({3}));
+        REQUIRE(matcher.match("src/a").empty());
+        REQUIRE(matcher.match("src/x.txt") == std::vector<size_t>({4}));
+        REQUIRE(matcher.match("/etc/hosts") == std::vector<size_t>({5}));
+        REQUIRE(!matcher.matches("src/.git/b.cpp"));
+        REQUIRE(!matcher.matches("src/xy.txt"));
+        REQUIRE(!matcher.matches("etc/hosts"));
+
+        /* Each pattern matches the same paths a Glob does */
+        const char* paths[] = {"src/a/b.cpp", "src/b.hpp", "b.cpp", "src/a/",
+            "src/x.txt", "/etc/hosts", "src/.git/b.cpp", "x/y/z.cpp", "src/b.cpp"};
+        for (size_t i = 0; i < matcher.size(); ++i) {
+            Glob glob(matcher.pattern(i));
+            for (const char* path : paths) {
+                std::vector<size_t> matched(matcher.match(path));
+                bool found = std::find(matched.begin(), matched.end(), i) != matched.end();
+                REQUIRE(found == glob.match(path));
+            }
+        }
+
+        /* Walking only reports matches */
+        Path::makedirs("foo/src/a");
+        Path::makedirs("foo/other");
+        Path::touch("foo/src/a/b.cpp");
+        Path::touch("foo/src/a/b.hpp");
+        Path::touch("foo/src/c.txt");
+        Path::touch("foo/other/d.cpp");
+        Path::touch("foo/other/e.txt");
+
+        std::vector<std::string> found;
+        matcher.walk("foo", [&found](const Path::Entry& entry, const std::vector<size_t>&) {
+            found.push_back(entry.name().data());
+            return true;
+        });
+        std::sort(found.begin(), found.end());
+        REQUIRE(found == std::vector<std::string>({"a", "b.cpp", "b.hpp", "c.txt", "d.cpp"}));
+
+        /* Directories that can't match are pruned rather than reported */
+        PathMatcher narrow;
+        narrow.add("src/*/*.cpp");
+        size_t visited = 0;
+        narrow.walk("foo", [&visited](const Path::Entry& entry, const std::vector<size_t>&) {
+            ++visited;
+            REQUIRE(entry.name() == "b.cpp");
+            return true;
+        });
+        REQUIRE(visited == 1);
+
+        REQUIRE(Path::rmdirs("foo"));
+    }
 
     SECTION("recursive_listdir", "Make sure we can recursively list directory") {
         /* We'll touch a bunch of files to work with */
@@ -354,4 +1449,159 @@ TEST_CASE("path", "Path functionality works as advertised") {
         REQUIRE(Path::rmdirs(Path("foo")));
         REQUIRE(!Path("foo").exists());
     }
+
+    SECTION("walk", "Make sure we can lazily iterate over directories") {
+        Path::makedirs("foo/bar/baz");
+        Path::makedirs("foo/skip/this");
+        Path::touch("foo/a");
+        Path::touch("foo/bar/b");
+        Path::touch("foo/bar/baz/c");
+        Path::touch("foo/skip/d");
+
+        std::vector<Path> entries;
+        for (const Path::Entry& entry : Path::iterate("foo")) {
+            entries.push_back(entry.path);
+        }
+        REQUIRE(entries.size() == 3);
+        REQUIRE(Path::iterate("nonexistent").begin() == Path::iterate("nonexistent").end());
+
+        /* Walking finds everything, with directories before their contents */
+        size_t count = 0;
+        std::vector<Path> directories = {Path("foo").absolute().directory()};
+        for (const Path::Entry& entry : Path::walk("foo")) {
+            REQUIRE(std::find(directories.begin(), directories.end(),
+                entry.path.parent()) != directories.end());
+            if (entry.is_directory()) {
+                directories.push_back(Path(entry.path).directory());
+            }
+            ++count;
+        }
+        REQUIRE(count == Path::recursive_listdir("foo").size());
+
+        /* Pruning skips a subtree, and we can stop whenever we like */
+        count = 0;
+        DirectoryRange<RecursiveDirectoryIterator> range(Path::walk("foo"));
+        for (RecursiveDirectoryIterator it = range.begin(); it != range.end(); ++it) {
+            if (it->name() == "skip") {
+                it.prune();
+            }
+            REQUIRE(it->path.view().string().find("skip/") == std::string_view::npos);
+            REQUIRE(it.depth() <= 2);
+            ++count;
+        }
+        REQUIRE(count == 6);
+
+        for (const Path::Entry& entry : Path::walk("foo")) {
+            (void)(entry);
+            break;
+        }
+
+        /* Once a walk is over, it's over for every copy of it */
+        REQUIRE(range.begin() == range.end());
+
+        /* Stat'ing relative to the directory agrees with the full path */
+        range = Path::walk("foo");
+        for (auto it = range.begin(); it != range.end(); ++it) {
+            REQUIRE(it.status().inode == it->path.status().inode);
+            REQUIRE(it.status(false).type == it->type);
+        }
+
+#if !defined(_WIN32)
+        /* The walk survives its directories being renamed out from under it */
+        bool found = false;
+        range = Path::walk("foo");
+        for (RecursiveDirectoryIterator it = range.begin(); it != range.end(); ++it) {
+            if (it->name() == "baz") {
+                REQUIRE(Path::move("foo/bar", "foo/moved"));
+            }
+            found = found || it->name() == "c";
+        }
+        REQUIRE(found);
+#endif
+
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+    }
+
+    SECTION("PathTable", "Make sure we can intern paths") {
+        PathTable table;
+        REQUIRE(table.size() == 1);
+        REQUIRE(table.path(0) == "");
+
+        PathTable::id_type a = table.insert("/foo/bar/a");
+        PathTable::id_type b = table.insert("/foo/bar/b");
+        PathTable::id_type c = table.insert("foo/bar/a");
+        REQUIRE(a != b);
+        REQUIRE(a != c);
+        REQUIRE(table.parent(a) == table.parent(b));
+        REQUIRE(table.parent(a) != table.parent(c));
+        REQUIRE(table.insert("/foo//bar/a/") == a);
+        REQUIRE(table.find("/foo/bar/a") == a);
+        REQUIRE(table.find("/foo/bar/c") == PathTable::npos);
+        REQUIRE(table.find("") == 0);
+
+        /* Names are only stored once */
+        REQUIRE(table.name_count() == 5);
+        REQUIRE(table.filename(a) == "a");
+        REQUIRE(table.depth(a) == 4);
+        REQUIRE(table.depth(c) == 3);
+
+        REQUIRE(table.path(a) == "/foo/bar/a");
+        REQUIRE(table.path(c) == "foo/bar/a");
+        REQUIRE(table.path(table.parent(a)) == "/foo/bar");
+        REQUIRE(table.path(table.insert("/")) == "/");
+        REQUIRE(table.parent(table.insert("/")) == 0);
+        REQUIRE(table.insert(table.parent(a), "b") == b);
+
+        /* We can fill it straight from a walk */
+        Path::makedirs("foo/bar");
+        Path::touch("foo/bar/a");
+        Path::touch("foo/b");
+        PathTable walked;
+        PathTable::id_type root = walked.insert_tree("foo");
+        REQUIRE(walked.path(root) == Path("foo").absolute());
+        REQUIRE(walked.size() == walked.depth(root) + 4);
+        PathTable::id_type found = walked.find(Path("foo/bar/a").absolute().view());
+        REQUIRE(found != PathTable::npos);
+        REQUIRE(walked.filename(walked.parent(found)) == "bar");
+        REQUIRE(walked.parent(walked.parent(found)) == root);
+
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+    }
+
+    SECTION("TreeWalker", "Make sure we can walk a tree in parallel") {
+        Path::makedirs("foo/bar2/bar3");
+        Path::makedirs("foo/bar");
+        for (int i = 0; i < 20; ++i) {
+            Path::touch(Path::join("foo", i));
+            Path::touch(Path::join("foo/bar", i));
+            Path::touch(Path::join("foo/bar2/bar3", i));
+        }
+
+        std::vector<Path> expected(Path::recursive_listdir("foo"));
+        REQUIRE(expected.size() == 63);
+        std::sort(expected.begin(), expected.end(), [](const Path& a, const Path& b) {
+            return a.string() < b.string();
+        });
+
+        for (unsigned threads = 1; threads <= 4; ++threads) {
+            TreeWalker walker(threads);
+            REQUIRE(walker.threads() == threads);
+            REQUIRE(walker.listdir("foo", true) == expected);
+
+            std::atomic<size_t> count(0);
+            walker.walk("foo", [&count](const Path::Entry&) { ++count; });
+            REQUIRE(count == expected.size());
+        }
+
+        /* Exceptions from the callback make it back to us */
+        REQUIRE_THROWS(TreeWalker(4).walk("foo", [](const Path::Entry&) {
+            throw std::runtime_error("stop");
+        }));
+
+        REQUIRE(TreeWalker().listdir("nonexistent").empty());
+        REQUIRE(Path::rmdirs(Path("foo")));
+        REQUIRE(!Path("foo").exists());
+    }
 }